@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "async_io.h"
+
+#define ASYNC_IO_THREADS 4        // Most I/O threads of the fallback
+#define MAX_TRANSFER (1u << 30)   // Bytes per read or write call
+
+struct AsyncIO
+{
+    int capacity; // Requests in flight at most
+    int inFlight;
+
+    // io_uring backend, ringFd -1 when the threads are used
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // Thread backend: circular queues of capacity requests
+    pthread_t threads[ASYNC_IO_THREADS];
+    int numThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t completed;
+    AsyncRequest **pending;
+    int pendingHead;
+    int pendingCount;
+    AsyncRequest **finished;
+    int finishedHead;
+    int finishedCount;
+    int stopping;
+};
+
+// Moves the rest of request with blocking calls
+static void transferAll(AsyncRequest *request)
+{
+    while (request->done < request->length && request->error == 0)
+    {
+        size_t chunk = request->length - request->done;
+        chunk = chunk > MAX_TRANSFER ? MAX_TRANSFER : chunk;
+        ssize_t moved = request->write ? pwrite(request->fd, request->buffer + request->done, chunk,
+                                                request->offset + (off_t)request->done)
+                                       : pread(request->fd, request->buffer + request->done, chunk,
+                                               request->offset + (off_t)request->done);
+        if (moved > 0)
+        {
+            request->done += (size_t)moved;
+        }
+        else if (moved == 0)
+        {
+            request->error = EIO;
+        }
+        else if (errno != EINTR)
+        {
+            request->error = errno;
+        }
+    }
+}
+
+static void *ioThread(void *arg)
+{
+    AsyncIO *io = (AsyncIO *)arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;)
+    {
+        while (!io->stopping && io->pendingCount == 0)
+        {
+            pthread_cond_wait(&io->queued, &io->lock);
+        }
+        if (io->pendingCount == 0)
+        {
+            break;
+        }
+        AsyncRequest *request = io->pending[io->pendingHead];
+        io->pendingHead = (io->pendingHead + 1) % io->capacity;
+        io->pendingCount--;
+        pthread_mutex_unlock(&io->lock);
+
+        transferAll(request);
+
+        pthread_mutex_lock(&io->lock);
+        io->finished[(io->finishedHead + io->finishedCount) % io->capacity] = request;
+        io->finishedCount++;
+        pthread_cond_signal(&io->completed);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static int startThreads(AsyncIO *io)
+{
+    io->pending = (AsyncRequest **)malloc(io->capacity * sizeof(AsyncRequest *));
+    io->finished = (AsyncRequest **)malloc(io->capacity * sizeof(AsyncRequest *));
+    if (io->pending == NULL || io->finished == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->queued, NULL);
+    pthread_cond_init(&io->completed, NULL);
+    int wanted = io->capacity < ASYNC_IO_THREADS ? io->capacity : ASYNC_IO_THREADS;
+    for (; io->numThreads < wanted; io->numThreads++)
+    {
+        if (pthread_create(&io->threads[io->numThreads], NULL, ioThread, io) != 0)
+        {
+            break;
+        }
+    }
+    return io->numThreads > 0 ? 0 : -1;
+}
+
+// Maps the rings of a new io_uring. Returns 0, or -1 if the kernel offers none
+static int setupRing(AsyncIO *io)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, io->capacity, &params);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    io->ringFd = fd;
+
+    // IORING_OP_READ / WRITE came with the same kernel as this feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS) || params.sq_entries < (unsigned)io->capacity)
+    {
+        return -1;
+    }
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        io->sqRingSize = io->cqRingSize > io->sqRingSize ? io->cqRingSize : io->sqRingSize;
+        io->cqRingSize = io->sqRingSize;
+    }
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQ_RING);
+    if (io->sqRing == MAP_FAILED)
+    {
+        io->sqRing = NULL;
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        io->cqRing = io->sqRing;
+    }
+    else
+    {
+        io->cqRing = mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_CQ_RING);
+        if (io->cqRing == MAP_FAILED)
+        {
+            io->cqRing = NULL;
+            return -1;
+        }
+    }
+    io->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe *)mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED)
+    {
+        io->sqes = NULL;
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *)io->sqRing;
+    uint8_t *cq = (uint8_t *)io->cqRing;
+    io->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    io->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned *)(sq + params.sq_off.array);
+    io->cqHead = (unsigned *)(cq + params.cq_off.head);
+    io->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    io->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void closeRing(AsyncIO *io)
+{
+    if (io->sqes != NULL)
+    {
+        munmap(io->sqes, io->sqesSize);
+    }
+    if (io->cqRing != NULL && io->cqRing != io->sqRing)
+    {
+        munmap(io->cqRing, io->cqRingSize);
+    }
+    if (io->sqRing != NULL)
+    {
+        munmap(io->sqRing, io->sqRingSize);
+    }
+    if (io->ringFd != -1)
+    {
+        close(io->ringFd);
+    }
+    io->sqes = NULL;
+    io->sqRing = io->cqRing = NULL;
+    io->ringFd = -1;
+}
+
+static int enterRing(AsyncIO *io, unsigned toSubmit, unsigned minComplete)
+{
+    for (;;)
+    {
+        long result = syscall(__NR_io_uring_enter, io->ringFd, toSubmit, minComplete,
+                              minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result >= 0)
+        {
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return -1;
+        }
+        if (minComplete > 0 && errno == EINTR)
+        {
+            return 0;
+        }
+    }
+}
+
+// Queues the rest of request on the ring
+static int queueOnRing(AsyncIO *io, AsyncRequest *request)
+{
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    size_t chunk = request->length - request->done;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(request->buffer + request->done);
+    sqe->len = chunk > MAX_TRANSFER ? MAX_TRANSFER : (unsigned)chunk;
+    sqe->off = (uint64_t)(request->offset + (off_t)request->done);
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return enterRing(io, 1, 0);
+}
+
+/* Creates an engine with room for capacity requests in flight. Returns
+ * NULL if not even the I/O threads can be started.
+ */
+AsyncIO *createAsyncIO(int capacity)
+{
+    AsyncIO *io = (AsyncIO *)calloc(1, sizeof(AsyncIO));
+    if (io == NULL)
+    {
+        return NULL;
+    }
+    io->capacity = capacity > 0 ? capacity : 1;
+    io->ringFd = -1;
+
+    const char *backend = getenv("EX7_ASYNC_IO");
+    if ((backend == NULL || strcmp(backend, "threads") != 0) && setupRing(io) == 0)
+    {
+        return io;
+    }
+    closeRing(io);
+    if (startThreads(io) != 0)
+    {
+        destroyAsyncIO(io);
+        return NULL;
+    }
+    return io;
+}
+
+const char *getAsyncIOBackend(const AsyncIO *io)
+{
+    return io->ringFd != -1 ? "io_uring" : "threads";
+}
+
+/* Starts moving request->length bytes between request->buffer and
+ * request->fd at request->offset; done and error are reset. Returns 0, or
+ * -1 with errno set (EBUSY when capacity requests are already in flight).
+ */
+int submitAsyncIO(AsyncIO *io, AsyncRequest *request)
+{
+    if (io->inFlight == io->capacity)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    request->done = 0;
+    request->error = 0;
+    if (io->ringFd != -1)
+    {
+        if (queueOnRing(io, request) != 0)
+        {
+            return -1;
+        }
+        io->inFlight++;
+        return 0;
+    }
+
+    pthread_mutex_lock(&io->lock);
+    io->pending[(io->pendingHead + io->pendingCount) % io->capacity] = request;
+    io->pendingCount++;
+    io->inFlight++;
+    pthread_cond_signal(&io->queued);
+    pthread_mutex_unlock(&io->lock);
+    return 0;
+}
+
+/* Blocks until a request has been moved completely or has failed, and
+ * returns it, in completion order. Returns NULL if nothing is in flight.
+ */
+AsyncRequest *waitAsyncIO(AsyncIO *io)
+{
+    if (io->inFlight == 0)
+    {
+        return NULL;
+    }
+    if (io->ringFd == -1)
+    {
+        pthread_mutex_lock(&io->lock);
+        while (io->finishedCount == 0)
+        {
+            pthread_cond_wait(&io->completed, &io->lock);
+        }
+        AsyncRequest *request = io->finished[io->finishedHead];
+        io->finishedHead = (io->finishedHead + 1) % io->capacity;
+        io->finishedCount--;
+        io->inFlight--;
+        pthread_mutex_unlock(&io->lock);
+        return request;
+    }
+
+    for (;;)
+    {
+        unsigned head = *io->cqHead;
+        if (head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE))
+        {
+            if (enterRing(io, 0, 1) != 0)
+            {
+                return NULL;
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cqMask];
+        AsyncRequest *request = (AsyncRequest *)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+
+        if (result > 0)
+        {
+            request->done += (size_t)result;
+        }
+        else if (result == 0)
+        {
+            request->error = EIO;
+        }
+        else if (result != -EINTR && result != -EAGAIN)
+        {
+            request->error = -result;
+        }
+        if (request->done < request->length && request->error == 0)
+        {
+            // Short transfer: queue the rest, it stays in flight
+            if (queueOnRing(io, request) == 0)
+            {
+                continue;
+            }
+            request->error = errno;
+        }
+        io->inFlight--;
+        return request;
+    }
+}
+
+// Closes the ring, abandoning what is in flight, or lets the I/O threads finish theirs and stops them
+void destroyAsyncIO(AsyncIO *io)
+{
+    if (io == NULL)
+    {
+        return;
+    }
+    if (io->ringFd != -1)
+    {
+        closeRing(io);
+    }
+    else if (io->numThreads > 0)
+    {
+        pthread_mutex_lock(&io->lock);
+        io->stopping = 1;
+        pthread_cond_broadcast(&io->queued);
+        pthread_mutex_unlock(&io->lock);
+        for (int i = 0; i < io->numThreads; i++)
+        {
+            pthread_join(io->threads[i], NULL);
+        }
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->queued);
+        pthread_cond_destroy(&io->completed);
+    }
+    free(io->pending);
+    free(io->finished);
+    free(io);
+}
@@ -0,0 +1,34 @@
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Asynchronous whole-buffer reads and writes. Requests are queued on an
+ * io_uring (raw syscalls, no liburing) when the kernel offers one, else on
+ * a few I/O threads doing pread / pwrite; EX7_ASYNC_IO=threads forces the
+ * threads. Short transfers are resubmitted until the whole buffer is done,
+ * so a completed request has moved length bytes or has error set.
+ */
+typedef struct AsyncRequest
+{
+    int fd;
+    int write; // 0: read into buffer, 1: write it out
+    uint8_t *buffer;
+    size_t length;
+    off_t offset;
+    size_t done; // Bytes transferred so far
+    int error;   // errno of a failed transfer, EIO for a read past the end, else 0
+    void *user;  // Left alone, for the caller
+} AsyncRequest;
+
+typedef struct AsyncIO AsyncIO;
+
+AsyncIO *createAsyncIO(int depth);
+const char *getAsyncIOBackend(const AsyncIO *io);
+int submitAsyncIO(AsyncIO *io, AsyncRequest *request);
+AsyncRequest *waitAsyncIO(AsyncIO *io);
+void destroyAsyncIO(AsyncIO *io);
+
+#endif /* async_io.h */
@@ -0,0 +1,1596 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "async_io.h"
+#include "bmp.h"
+#include "cache.h"
+#include "shm_image.h"
+#include "threadpool.h"
+#include "convolution.h"
+#include "pipeline.h"
+#include "planar.h"
+#include "luma.h"
+#include "plan.h"
+#include "sequence.h"
+#include "daemon.h"
+#include "fleet.h"
+#include "streaming.h"
+#include "trace.h"
+
+#define DEFAULT_OUTPUT_DIR "out"
+
+typedef struct
+{
+    char *input;
+    char *output; // NULL: outputDir/<input file name>
+} BatchJob;
+
+typedef struct
+{
+    BatchJob *jobs;
+    int count;
+    int capacity;
+} BatchJobList;
+
+typedef struct
+{
+    int numThreads;
+    const char *outputDir;
+    const char *manifest;
+    const char *filters;    // -f as given, forwarded to the daemon
+    FilterChain chain;      // No stages: ex7's blur bottom half + edge top half
+    const char *daemonName; // -d: serve instead of processing
+    const char *clientName; // -c: hand the jobs to this daemon
+    int stopDaemon;
+    int stream;   // -S: filter band by band instead of loading whole images
+    int bandRows; // -b: rows per band, 0 for DEFAULT_BAND_BYTES
+    const char *fleet;       // -F: worker count or sockets to spread the bands over
+    const char *fleetSocket; // -W: serve as a fleet worker
+    int ioDepth;             // -Q: reads and writes in flight, 0 for the loader thread
+    const char *cacheDir;    // -C: result cache, NULL for none
+    uint64_t cacheBytes;     // -M: size bound of the cache
+    int sequenceTile;        // -I: tile size of the frame sequence mode, 0 for independent images
+} BatchOptions;
+
+// One job of the asynchronous I/O mode
+typedef struct
+{
+    AsyncRequest request; // Read of the input file, then write of the result
+    BMP_Image *image;     // Decoded input
+    BMP_Image *result;    // Output file laid out in memory
+    int width;
+    int height;
+    int bytesPerPixel;
+    struct timespec start;
+} AsyncJob;
+
+/*
+ * The loader thread reads the images in job order and hands them over one
+ * at a time through a single slot, so image N+1 is read while image N is
+ * filtered. A job whose image could not be read is handed over as NULL.
+ * With a result cache the loader hashes the input first and skips decoding
+ * it when the result is cached.
+ */
+typedef struct
+{
+    int keyed; // 0: the input is not a regular file, so it has no key
+    int hit;   // The cache holds the result, no image was decoded
+    uint64_t key;
+} CacheLookup;
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    const BatchJobList *list;
+    ResultCache *cache; // NULL: no lookups
+    uint64_t seed;      // Hash of the filter parameters
+    BMP_Image *slot;
+    CacheLookup slotLookup;
+    int slotFull;
+} Prefetcher;
+
+static double elapsedSeconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int addJob(BatchJobList *list, const char *input, const char *output)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        BatchJob *jobs = (BatchJob *)realloc(list->jobs, capacity * sizeof(BatchJob));
+        if (jobs == NULL)
+        {
+            printError(MEMORY_ERROR);
+            return -1;
+        }
+        list->jobs = jobs;
+        list->capacity = capacity;
+    }
+
+    BatchJob *job = &list->jobs[list->count];
+    job->input = strdup(input);
+    job->output = output != NULL ? strdup(output) : NULL;
+    if (job->input == NULL || (output != NULL && job->output == NULL))
+    {
+        free(job->input);
+        free(job->output);
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static void freeJobs(BatchJobList *list)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        free(list->jobs[i].input);
+        free(list->jobs[i].output);
+    }
+    free(list->jobs);
+}
+
+static int hasBMPExtension(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".bmp") == 0;
+}
+
+static int selectBMPEntry(const struct dirent *entry)
+{
+    return entry->d_name[0] != '.' && hasBMPExtension(entry->d_name);
+}
+
+// Adds every *.bmp of a directory, sorted by name
+static int addDirectory(BatchJobList *list, const char *dir)
+{
+    struct dirent **entries;
+    int count = scandir(dir, &entries, selectBMPEntry, alphasort);
+    if (count == -1)
+    {
+        perror(dir);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char path[PATH_MAX];
+        if (result == 0 && snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name) < (int)sizeof(path))
+        {
+            result = addJob(list, path, NULL);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return result;
+}
+
+// Adds a file, the BMPs of a directory or the matches of a glob pattern
+static int addInput(BatchJobList *list, const char *input)
+{
+    struct stat info;
+    if (strpbrk(input, "*?[") != NULL)
+    {
+        glob_t matches;
+        int status = glob(input, 0, NULL, &matches);
+        if (status == GLOB_NOMATCH)
+        {
+            fprintf(stderr, "No files match '%s'\n", input);
+            return 0;
+        }
+        if (status != 0)
+        {
+            fprintf(stderr, "Error expanding '%s'\n", input);
+            return -1;
+        }
+        int result = 0;
+        for (size_t i = 0; i < matches.gl_pathc && result == 0; i++)
+        {
+            result = addJob(list, matches.gl_pathv[i], NULL);
+        }
+        globfree(&matches);
+        return result;
+    }
+
+    if (stat(input, &info) == -1)
+    {
+        perror(input);
+        return -1;
+    }
+    return S_ISDIR(info.st_mode) ? addDirectory(list, input) : addJob(list, input, NULL);
+}
+
+// Manifest lines are "input [output]"; blank lines and '#' comments are skipped
+static int addManifest(BatchJobList *list, const char *manifest)
+{
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL)
+    {
+        perror(manifest);
+        return -1;
+    }
+
+    char line[2 * PATH_MAX];
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *input = strtok(line, " \t\r\n");
+        if (input == NULL || input[0] == '#')
+        {
+            continue;
+        }
+        char *output = strtok(NULL, " \t\r\n");
+        result = output != NULL ? addJob(list, input, output) : addInput(list, input);
+    }
+    fclose(file);
+    return result;
+}
+
+/* Reads and validates the image at path, faulting a mapped one in so the
+ * filters never wait on the disk. Returns NULL (with a message) on failure.
+ */
+BMP_Image *loadInputImage(const char *path)
+{
+    BMP_Image *image = mapBMPImage(path);
+    if (image == NULL)
+    {
+        FILE *source = fopen(path, "rb");
+        if (source == NULL)
+        {
+            perror(path);
+            return NULL;
+        }
+        readImage(source, &image);
+        fclose(source);
+        if (image == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    if (!checkBMPValid(&image->header))
+    {
+        fprintf(stderr, "%s: ", path);
+        printError(VALID_ERROR);
+        freeImage(image);
+        return NULL;
+    }
+
+    if (image->mapping != NULL)
+    {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        const volatile uint8_t *bytes = (const volatile uint8_t *)image->mapping;
+        for (size_t offset = 0; offset < image->mapping_size; offset += pageSize)
+        {
+            (void)bytes[offset];
+        }
+    }
+    return image;
+}
+
+static void *prefetchThread(void *arg)
+{
+    Prefetcher *prefetcher = (Prefetcher *)arg;
+
+    for (int i = 0; i < prefetcher->list->count; i++)
+    {
+        const char *input = prefetcher->list->jobs[i].input;
+        CacheLookup lookup = {0, 0, 0};
+        BMP_Image *image = NULL;
+        if (prefetcher->cache != NULL && hashInputFile(input, prefetcher->seed, &lookup.key) == 0)
+        {
+            lookup.keyed = 1;
+            lookup.hit = hasCachedResult(prefetcher->cache, lookup.key);
+        }
+        if (!lookup.hit)
+        {
+            TRACE_BEGIN(span, "read");
+            image = loadInputImage(input);
+            TRACE_END(span);
+        }
+
+        pthread_mutex_lock(&prefetcher->lock);
+        while (prefetcher->slotFull)
+        {
+            pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+        }
+        prefetcher->slot = image;
+        prefetcher->slotLookup = lookup;
+        prefetcher->slotFull = 1;
+        pthread_cond_broadcast(&prefetcher->changed);
+        pthread_mutex_unlock(&prefetcher->lock);
+    }
+    return NULL;
+}
+
+/* Takes the next image from the loader (NULL if it could not be read, or
+ * was not read because lookup, unless NULL, reports a cache hit).
+ */
+static BMP_Image *takeImage(Prefetcher *prefetcher, CacheLookup *lookup)
+{
+    TRACE_BEGIN(span, "prefetch wait");
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!prefetcher->slotFull)
+    {
+        pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+    }
+    TRACE_END(span);
+    BMP_Image *image = prefetcher->slot;
+    if (lookup != NULL)
+    {
+        *lookup = prefetcher->slotLookup;
+    }
+    prefetcher->slotFull = 0;
+    pthread_cond_broadcast(&prefetcher->changed);
+    pthread_mutex_unlock(&prefetcher->lock);
+    return image;
+}
+
+static int isSameFile(const char *a, const char *b)
+{
+    struct stat infoA, infoB;
+    return stat(a, &infoA) == 0 && stat(b, &infoB) == 0 && infoA.st_dev == infoB.st_dev &&
+           infoA.st_ino == infoB.st_ino;
+}
+
+// The luma edge map has its own pixel format
+static void outputHeaderFor(const BMP_Image *image, BMP_Header *header)
+{
+    *header = image->header;
+    if (getLumaEdgeOutput() != 0)
+    {
+        header->bits_per_pixel = getLumaEdgeOutput();
+    }
+}
+
+/* The plan of a chain of at most one stage: -r, ex7's halves, or the one
+ * filter on the whole image. Returns 0, or -1 if -r does not fit the image.
+ */
+static int planFor(const FilterChain *chain, int width, int height, FilterPlan *plan)
+{
+    if (chain->numStages == 1)
+    {
+        plan->numRegions = 0;
+        return addPlanRegion(plan, chain->stages[0], 0, 0, width, height, NULL, 0);
+    }
+    if (getFilterPlanSpec() == NULL)
+    {
+        setDefaultPlan(plan, width, height);
+        return 0;
+    }
+    return parseFilterPlan(getFilterPlanSpec(), width, height, plan);
+}
+
+/* Applies chain to image with the pool, writing imageOut. An empty chain
+ * applies the plan selected with setFilterPlanSpec, by default ex7's blur
+ * on the bottom half and edge on the top half. Returns 0, or -1 on failure.
+ */
+static int filterImage(ThreadPool *pool, const FilterChain *chain, BMP_Image *image, BMP_Image *imageOut)
+{
+    // Chains and the default plan write every pixel, so the output needs no
+    // initial copy
+    int height = image->norm_height;
+    int result = 0;
+    FilterPlan plan;
+    TRACE_BEGIN(filterSpan, "filter");
+    if (getLumaEdgeOutput() != 0)
+    {
+        result = applyLumaEdge(pool, image, imageOut, 0, height);
+    }
+    else if (getPlanarLayout())
+    {
+        result = applyPlanarChain(pool, chain, image, imageOut);
+    }
+    else if (chain->numStages == 0)
+    {
+        result = planFor(chain, image->header.width_px, height, &plan);
+        if (result == 0 && !planCoversImage(&plan, image->header.width_px, height))
+        {
+            size_t rowBytes = (size_t)image->header.width_px * image->bytes_per_pixel;
+            for (int y = 0; y < height; y++)
+            {
+                memcpy(imageOut->pixels[y], image->pixels[y], rowBytes);
+            }
+        }
+        if (result == 0)
+        {
+            result = applyFilterPlan(pool, &plan, image, imageOut);
+        }
+    }
+    else
+    {
+        result = applyParallelPipeline(pool, chain->stages, chain->numStages, image, imageOut, 0, height);
+    }
+    TRACE_END(filterSpan);
+    return result;
+}
+
+/* Applies chain to image with the pool and writes the result to output, see
+ * filterImage. shared holds the output when the file cannot be mapped and
+ * is kept for the next call. Returns 0 on success, -1 on failure.
+ */
+int filterImageToFile(ThreadPool *pool, SharedImage *shared, const FilterChain *chain, BMP_Image *image,
+                      const char *output)
+{
+    int destFd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (destFd == -1)
+    {
+        perror(output);
+        return -1;
+    }
+
+    BMP_Header outHeader;
+    outputHeaderFor(image, &outHeader);
+
+    // Filter straight into the mapped output file, or into the shared segment
+    BMP_Image *mappedOut = mapBMPOutputImage(destFd, &outHeader);
+    BMP_Image *imageOut = mappedOut;
+    if (imageOut == NULL)
+    {
+        if (acquireSharedImage(shared, &outHeader, SHM_IMAGE_OUTPUT) != 0)
+        {
+            close(destFd);
+            return -1;
+        }
+        imageOut = shared->out;
+    }
+
+    int result = filterImage(pool, chain, image, imageOut);
+
+    // Unmapping a mapped output is its write
+    TRACE_BEGIN(writeSpan, "write");
+    if (result == 0 && mappedOut == NULL && !writeImageFile(destFd, imageOut))
+    {
+        perror(output);
+        result = -1;
+    }
+    freeImage(mappedOut);
+    TRACE_END(writeSpan);
+    if (close(destFd) == -1)
+    {
+        perror(output);
+        result = -1;
+    }
+    return result;
+}
+
+// Resolves where job writes its result. Returns 0, or -1 if the path does not fit
+static int outputPathFor(const BatchOptions *options, const BatchJob *job, char *output, size_t size)
+{
+    const char *name = strrchr(job->input, '/');
+    name = name != NULL ? name + 1 : job->input;
+    int length = job->output != NULL ? snprintf(output, size, "%s", job->output)
+                                     : snprintf(output, size, "%s/%s", options->outputDir, name);
+    if (length >= (int)size)
+    {
+        fprintf(stderr, "%s: output path too long\n", job->input);
+        return -1;
+    }
+    return 0;
+}
+
+// The daemon does not share our working directory
+static int absolutePath(const char *path, char *buffer, size_t size)
+{
+    char cwd[PATH_MAX];
+    if (path[0] == '/')
+    {
+        return snprintf(buffer, size, "%s", path) < (int)size ? 0 : -1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        return -1;
+    }
+    return snprintf(buffer, size, "%s/%s", cwd, path) < (int)size ? 0 : -1;
+}
+
+static void printUsage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-f filter,... | -r plan | -g bits] [-o outdir] [-m manifest] [-c name] [-HLP] "
+            "[-T WxH] [input...]\n"
+            "       %s -d name [-t threads] [-r plan | -g bits] [-T WxH] [-HLP]\n"
+            "       %s -c name -k\n"
+            "       %s -W socket [-t threads] [-T WxH]\n"
+            "  input     BMP file, directory or quoted glob pattern\n"
+            "  -t        worker threads (default: online CPUs)\n"
+            "  -f        filters applied in order to the whole image (%s);\n"
+            "            default: blur on the bottom half, edge on the top half\n"
+            "  -r        filters applied to regions, \"filter[:x,y,w,h];...\" from the top left\n"
+            "            corner in pixels or percent, e.g. \"edge:0,0,50%%,100%%;blur:50%%,0,50%%,100%%\"\n"
+            "  -g        write only the luma edge map, as an 8 or 24 bit grey image\n"
+            "  -o        output directory (default: " DEFAULT_OUTPUT_DIR ")\n"
+            "  -m        manifest file, one \"input [output]\" per line\n"
+            "  -d        run as the resident filter daemon called name\n"
+            "  -c        send the images to the filter daemon called name\n"
+            "  -k        with -c, stop the daemon\n"
+            "  -F        filter in bands on a worker fleet: a number of local worker\n"
+            "            processes, or the comma separated sockets of -W workers\n"
+            "  -W        run as a fleet worker listening on the Unix socket\n"
+            "  -Q        keep this many image reads and writes in flight (io_uring or threads)\n"
+            "  -C        reuse the results of identical inputs cached in this directory\n"
+            "  -M        with -C, bound the cache to this many MiB (default: 1024)\n"
+            "  -I        filter the inputs as frames of one sequence: only the tiles of this many\n"
+            "            pixels square (e.g. 32) that changed since the previous frame are refiltered\n"
+            "  -T        filter tile size in pixels, e.g. 64x64 or 0x32 for full-width tiles 32 rows\n"
+            "            high (default: full rows, about 256 KiB and at least %d tiles per thread)\n"
+            "  -H        back the pixel buffers held in memory (shared segment, planar copies,\n"
+            "            stream bands, -Q and -I results) with huge pages; files stay mapped\n"
+            "            with normal pages\n"
+            "  -L        filter a planar copy of every image, one plane per channel\n"
+            "  -P        pin the workers to CPUs, node by node\n"
+            "  -S        stream images larger than memory band by band\n"
+            "  -b        with -S, rows per band (default: about 16 MiB)\n"
+            "Without arguments the program asks for one image at a time.\n",
+            program, program, program, program, listKernels(), TASKS_PER_THREAD);
+}
+
+static int parseOptions(int argc, char **argv, BatchOptions *options)
+{
+    int opt;
+    FilterPlan plan; // Only checks the syntax of -r
+    options->numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    options->numThreads = options->numThreads > 0 ? options->numThreads : 1;
+    options->outputDir = DEFAULT_OUTPUT_DIR;
+    options->manifest = NULL;
+    options->filters = "";
+    options->chain.numStages = 0;
+    options->daemonName = NULL;
+    options->clientName = NULL;
+    options->stopDaemon = 0;
+    options->stream = 0;
+    options->bandRows = 0;
+    options->fleet = NULL;
+    options->fleetSocket = NULL;
+    options->ioDepth = 0;
+    options->cacheDir = NULL;
+    options->cacheBytes = CACHE_DEFAULT_MAX_BYTES;
+    options->sequenceTile = 0;
+
+    while ((opt = getopt(argc, argv, "t:f:g:r:o:m:d:c:kF:W:Q:C:M:I:T:HLPSb:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            options->numThreads = atoi(optarg);
+            if (options->numThreads <= 0)
+            {
+                fprintf(stderr, "Number of threads must be a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'f':
+            if (parseFilterChain(optarg, &options->chain) != 0)
+            {
+                return -1;
+            }
+            options->filters = optarg;
+            break;
+        case 'g':
+            setLumaEdgeOutput(atoi(optarg));
+            if (getLumaEdgeOutput() == 0)
+            {
+                fprintf(stderr, "The edge map is written with 8 or 24 bits per pixel.\n");
+                return -1;
+            }
+            break;
+        case 'r':
+            if (parseFilterPlan(optarg, 1, 1, &plan) != 0)
+            {
+                return -1;
+            }
+            setFilterPlanSpec(optarg);
+            break;
+        case 'o':
+            options->outputDir = optarg;
+            break;
+        case 'm':
+            options->manifest = optarg;
+            break;
+        case 'd':
+            options->daemonName = optarg;
+            break;
+        case 'c':
+            options->clientName = optarg;
+            break;
+        case 'k':
+            options->stopDaemon = 1;
+            break;
+        case 'F':
+            options->fleet = optarg;
+            break;
+        case 'W':
+            options->fleetSocket = optarg;
+            break;
+        case 'Q':
+            options->ioDepth = atoi(optarg);
+            if (options->ioDepth <= 0)
+            {
+                fprintf(stderr, "The I/O depth must be a positive integer.\n");
+                return -1;
+            }
+            break;
+        case 'C':
+            options->cacheDir = optarg;
+            break;
+        case 'M':
+            if (atoi(optarg) <= 0)
+            {
+                fprintf(stderr, "The cache size must be a positive number of MiB.\n");
+                return -1;
+            }
+            options->cacheBytes = (uint64_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'I':
+            options->sequenceTile = atoi(optarg);
+            if (options->sequenceTile < MIN_SEQUENCE_TILE)
+            {
+                fprintf(stderr, "Sequence tiles are at least %d pixels.\n", MIN_SEQUENCE_TILE);
+                return -1;
+            }
+            break;
+        case 'T':
+            if (parseTileSize(optarg) != 0)
+            {
+                return -1;
+            }
+            break;
+        case 'H':
+            setSharedImageHugePages(1);
+            break;
+        case 'L':
+            setPlanarLayout(1);
+            break;
+        case 'P':
+            setThreadPoolPinning(1);
+            break;
+        case 'S':
+            options->stream = 1;
+            break;
+        case 'b':
+            options->bandRows = atoi(optarg);
+            if (options->bandRows <= 0)
+            {
+                fprintf(stderr, "Rows per band must be a positive integer.\n");
+                return -1;
+            }
+            break;
+        default:
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (options->stopDaemon && options->clientName == NULL)
+    {
+        fprintf(stderr, "-k needs the daemon name given with -c\n");
+        return -1;
+    }
+    if (options->stream && (getLumaEdgeOutput() != 0 || getPlanarLayout()))
+    {
+        fprintf(stderr, "-g and -L cannot be combined with -S\n");
+        return -1;
+    }
+    if (getFilterPlanSpec() != NULL &&
+        (options->chain.numStages != 0 || getLumaEdgeOutput() != 0 || getPlanarLayout() || options->stream))
+    {
+        fprintf(stderr, "-r cannot be combined with -f, -g, -L or -S\n");
+        return -1;
+    }
+    if (options->fleet != NULL &&
+        (options->clientName != NULL || getLumaEdgeOutput() != 0 || getPlanarLayout() || options->stream))
+    {
+        fprintf(stderr, "-F cannot be combined with -c, -g, -L or -S\n");
+        return -1;
+    }
+    if (options->ioDepth > 0 && (options->clientName != NULL || options->fleet != NULL || options->stream))
+    {
+        fprintf(stderr, "-Q cannot be combined with -c, -F or -S\n");
+        return -1;
+    }
+    if (options->cacheDir != NULL &&
+        (options->clientName != NULL || options->fleet != NULL || options->ioDepth > 0 || options->stream))
+    {
+        fprintf(stderr, "-C cannot be combined with -c, -F, -Q or -S\n");
+        return -1;
+    }
+    if (options->sequenceTile > 0 &&
+        (options->chain.numStages > 1 || getLumaEdgeOutput() != 0 || getPlanarLayout() ||
+         options->clientName != NULL || options->fleet != NULL || options->ioDepth > 0 || options->stream ||
+         options->cacheDir != NULL))
+    {
+        fprintf(stderr, "-I takes at most one -f filter and cannot be combined with -g, -L, -c, -F, -Q, -S "
+                        "or -C\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void printSummary(int processed, int failed, int numThreads, double seconds, double megapixels,
+                         double megabytes)
+{
+    printf("--------------------------------------------------------\n");
+    printf("%d images processed, %d failed, %d threads\n", processed, failed, numThreads);
+    printf("%.3f s total, %.2f images/s, %.2f MPixel/s, %.2f MiB/s\n", seconds,
+           seconds > 0 ? processed / seconds : 0, seconds > 0 ? megapixels / seconds : 0,
+           seconds > 0 ? megabytes / seconds : 0);
+}
+
+// Everything besides the input that decides the output, so changing any of it changes every key
+static uint64_t cacheSeed(const BatchOptions *options)
+{
+    char params[1024];
+    const char *plan = getFilterPlanSpec();
+    int length = snprintf(params, sizeof(params), "ex7 result v1|f=%s|r=%s|g=%d", options->filters,
+                          plan != NULL ? plan : "", getLumaEdgeOutput());
+    return hashBytes(params, length < (int)sizeof(params) ? (size_t)length : sizeof(params) - 1, 0);
+}
+
+static void printCacheStats(ResultCache *cache)
+{
+    ResultCacheStats stats;
+    getResultCacheStats(cache, &stats);
+    printf("cache: %d hits, %d misses, %d stored, %d evicted, %d entries (%.1f MiB)\n", stats.hits, stats.misses,
+           stats.stores, stats.evictions, stats.entries, stats.bytes / (1024.0 * 1024.0));
+}
+
+// Filters every job in this process. Returns the number of failed jobs, -1 on setup errors
+static int runLocalJobs(const BatchOptions *options, BatchJobList *list)
+{
+    ResultCache *cache = NULL;
+    if (options->cacheDir != NULL && (cache = openResultCache(options->cacheDir, options->cacheBytes)) == NULL)
+    {
+        return -1;
+    }
+    ThreadPool *pool = createThreadPool(options->numThreads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating thread pool\n");
+        closeResultCache(cache);
+        return -1;
+    }
+
+    Prefetcher prefetcher = {.list = list, .cache = cache, .slot = NULL, .slotFull = 0};
+    prefetcher.seed = cache != NULL ? cacheSeed(options) : 0;
+    pthread_mutex_init(&prefetcher.lock, NULL);
+    pthread_cond_init(&prefetcher.changed, NULL);
+    if (pthread_create(&prefetcher.thread, NULL, prefetchThread, &prefetcher) != 0)
+    {
+        fprintf(stderr, "Error creating loader thread\n");
+        destroyThreadPool(pool);
+        closeResultCache(cache);
+        return -1;
+    }
+
+    SharedImage shared = SHARED_IMAGE_INIT;
+    struct timespec start;
+    int processed = 0, failed = 0;
+    double megapixels = 0, megabytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        BatchJob *job = &list->jobs[i];
+        CacheLookup lookup;
+        BMP_Image *image = takeImage(&prefetcher, &lookup);
+        char output[PATH_MAX];
+        if ((image == NULL && !lookup.hit) || outputPathFor(options, job, output, sizeof(output)) != 0)
+        {
+            freeImage(image);
+            failed++;
+            continue;
+        }
+
+        struct timespec imageStart;
+        clock_gettime(CLOCK_MONOTONIC, &imageStart);
+        if (isSameFile(job->input, output))
+        {
+            fprintf(stderr, "%s: refusing to overwrite the input\n", job->input);
+            failed++;
+            freeImage(image);
+            continue;
+        }
+        if (lookup.hit)
+        {
+            if (fetchCachedResult(cache, lookup.key, output) == 0)
+            {
+                processed++;
+                printf("%s -> %s (cached, %.1f ms)\n", job->input, output, elapsedSeconds(&imageStart) * 1e3);
+                continue;
+            }
+            // The entry went away since the lookup: filter after all
+            if ((image = loadInputImage(job->input)) == NULL)
+            {
+                failed++;
+                continue;
+            }
+        }
+
+        if (filterImageToFile(pool, &shared, &options->chain, image, output) != 0)
+        {
+            failed++;
+        }
+        else
+        {
+            double pixels = (double)image->header.width_px * image->norm_height;
+            processed++;
+            megapixels += pixels / 1e6;
+            megabytes += pixels * image->bytes_per_pixel / (1024.0 * 1024.0);
+            if (lookup.keyed)
+            {
+                storeCachedResult(cache, lookup.key, output);
+            }
+            printf("%s -> %s (%dx%d, %.1f ms)\n", job->input, output, image->header.width_px, image->norm_height,
+                   elapsedSeconds(&imageStart) * 1e3);
+        }
+        freeImage(image);
+    }
+
+    double seconds = elapsedSeconds(&start);
+    pthread_join(prefetcher.thread, NULL);
+    pthread_mutex_destroy(&prefetcher.lock);
+    pthread_cond_destroy(&prefetcher.changed);
+    destroyThreadPool(pool);
+    releaseSharedImage(&shared);
+
+    printSummary(processed, failed, options->numThreads, seconds, megapixels, megabytes);
+    if (cache != NULL)
+    {
+        printCacheStats(cache);
+        closeResultCache(cache);
+    }
+    return failed;
+}
+
+// Writes the result of a frame, held in memory, to output
+static int writeFrame(BMP_Image *frameOut, const char *output)
+{
+    int destFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destFd == -1)
+    {
+        perror(output);
+        return -1;
+    }
+    TRACE_BEGIN(span, "write");
+    int result = writeImageFile(destFd, frameOut) ? 0 : -1;
+    TRACE_END(span);
+    if (close(destFd) == -1 || result != 0)
+    {
+        perror(output);
+        return -1;
+    }
+    return 0;
+}
+
+/* Filters the jobs in order as the frames of one sequence: each frame is
+ * refiltered only where it differs from the previous one, see sequence.h.
+ */
+static int runSequenceJobs(const BatchOptions *options, BatchJobList *list)
+{
+    FrameSequence *sequence = createFrameSequence(options->sequenceTile);
+    if (sequence == NULL)
+    {
+        return -1; // Reported as a memory error
+    }
+    ThreadPool *pool = createThreadPool(options->numThreads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating thread pool\n");
+        destroyFrameSequence(sequence);
+        return -1;
+    }
+
+    Prefetcher prefetcher = {.list = list, .slot = NULL, .slotFull = 0};
+    pthread_mutex_init(&prefetcher.lock, NULL);
+    pthread_cond_init(&prefetcher.changed, NULL);
+    if (pthread_create(&prefetcher.thread, NULL, prefetchThread, &prefetcher) != 0)
+    {
+        fprintf(stderr, "Error creating loader thread\n");
+        destroyFrameSequence(sequence);
+        destroyThreadPool(pool);
+        return -1;
+    }
+
+    struct timespec start;
+    int processed = 0, failed = 0;
+    double megapixels = 0, megabytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        BatchJob *job = &list->jobs[i];
+        BMP_Image *image = takeImage(&prefetcher, NULL);
+        char output[PATH_MAX];
+        if (image == NULL || outputPathFor(options, job, output, sizeof(output)) != 0)
+        {
+            freeImage(image);
+            failed++;
+            continue;
+        }
+        if (isSameFile(job->input, output))
+        {
+            fprintf(stderr, "%s: refusing to overwrite the input\n", job->input);
+            freeImage(image);
+            failed++;
+            continue;
+        }
+
+        struct timespec imageStart;
+        clock_gettime(CLOCK_MONOTONIC, &imageStart);
+        int width = image->header.width_px;
+        int height = image->norm_height;
+        double pixels = (double)width * height;
+        double bytes = pixels * image->bytes_per_pixel;
+        FilterPlan plan;
+        BMP_Image *frameOut;
+        double share;
+        if (planFor(&options->chain, width, height, &plan) != 0)
+        {
+            freeImage(image);
+            failed++;
+            continue;
+        }
+        // The sequence keeps the image as the previous frame
+        TRACE_BEGIN(filterSpan, "filter");
+        int result = filterFrame(pool, sequence, &plan, image, &frameOut, &share);
+        TRACE_END(filterSpan);
+        if (result != 0 || writeFrame(frameOut, output) != 0)
+        {
+            failed++;
+            continue;
+        }
+        processed++;
+        megapixels += pixels / 1e6;
+        megabytes += bytes / (1024.0 * 1024.0);
+        printf("%s -> %s (%dx%d, %.1f ms, %.1f%% refiltered)\n", job->input, output, width, height,
+               elapsedSeconds(&imageStart) * 1e3, share * 100);
+    }
+
+    double seconds = elapsedSeconds(&start);
+    pthread_join(prefetcher.thread, NULL);
+    pthread_mutex_destroy(&prefetcher.lock);
+    pthread_cond_destroy(&prefetcher.changed);
+
+    SequenceStats stats;
+    getSequenceStats(sequence, &stats);
+    destroyFrameSequence(sequence);
+    destroyThreadPool(pool);
+
+    printSummary(processed, failed, options->numThreads, seconds, megapixels, megabytes);
+    printf("sequence: %d frames, %d filtered in full, %lld of %lld tiles changed, %.1f%% of the pixels "
+           "refiltered\n",
+           stats.frames, stats.fullFrames, stats.dirtyTiles, stats.tiles,
+           stats.pixels > 0 ? 100.0 * stats.refiltered / stats.pixels : 100.0);
+    return failed;
+}
+
+// Spreads the bands of every job over the fleet while the loader reads the next image
+static int runFleetJobs(const BatchOptions *options, BatchJobList *list)
+{
+    // Fork the local workers before the loader thread exists
+    Fleet *fleet = createFleet(options->fleet, options->numThreads);
+    if (fleet == NULL)
+    {
+        return -1;
+    }
+
+    Prefetcher prefetcher = {.list = list, .slot = NULL, .slotFull = 0};
+    pthread_mutex_init(&prefetcher.lock, NULL);
+    pthread_cond_init(&prefetcher.changed, NULL);
+    if (pthread_create(&prefetcher.thread, NULL, prefetchThread, &prefetcher) != 0)
+    {
+        fprintf(stderr, "Error creating loader thread\n");
+        destroyFleet(fleet);
+        return -1;
+    }
+
+    struct timespec start;
+    int processed = 0, failed = 0;
+    double megapixels = 0, megabytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        BatchJob *job = &list->jobs[i];
+        BMP_Image *image = takeImage(&prefetcher, NULL);
+        char output[PATH_MAX];
+        if (image == NULL || outputPathFor(options, job, output, sizeof(output)) != 0)
+        {
+            freeImage(image);
+            failed++;
+            continue;
+        }
+
+        struct timespec imageStart;
+        clock_gettime(CLOCK_MONOTONIC, &imageStart);
+        if (isSameFile(job->input, output))
+        {
+            fprintf(stderr, "%s: refusing to overwrite the input\n", job->input);
+            failed++;
+        }
+        else if (fleetFilterImage(fleet, options->filters, image, output) != 0)
+        {
+            failed++;
+        }
+        else
+        {
+            double pixels = (double)image->header.width_px * image->norm_height;
+            processed++;
+            megapixels += pixels / 1e6;
+            megabytes += pixels * image->bytes_per_pixel / (1024.0 * 1024.0);
+            printf("%s -> %s (%dx%d, fleet, %.1f ms)\n", job->input, output, image->header.width_px,
+                   image->norm_height, elapsedSeconds(&imageStart) * 1e3);
+        }
+        freeImage(image);
+    }
+
+    double seconds = elapsedSeconds(&start);
+    pthread_join(prefetcher.thread, NULL);
+    pthread_mutex_destroy(&prefetcher.lock);
+    pthread_cond_destroy(&prefetcher.changed);
+    destroyFleet(fleet);
+
+    printSummary(processed, failed, options->numThreads, seconds, megapixels, megabytes);
+    return failed;
+}
+
+// Opens the input of job and queues a read of the whole file into anonymous
+// memory. Returns 0 if the read is in flight, 1 if the image is already
+// decoded (not a regular file: read with the stdio fallback), -1 on failure
+static int startAsyncRead(AsyncIO *io, const BatchJob *job, AsyncJob *state)
+{
+    struct stat info;
+    clock_gettime(CLOCK_MONOTONIC, &state->start);
+    state->request.user = state;
+    if (stat(job->input, &info) == 0 && !S_ISREG(info.st_mode))
+    {
+        state->image = loadInputImage(job->input);
+        return state->image != NULL ? 1 : -1;
+    }
+    int fd = open(job->input, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &info) == -1 || info.st_size < (off_t)sizeof(BMP_Header))
+    {
+        fprintf(stderr, "%s: %s\n", job->input, fd == -1 ? strerror(errno) : "not a BMP file");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    uint8_t *buffer = (uint8_t *)mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        perror(job->input);
+        close(fd);
+        return -1;
+    }
+    state->request.fd = fd;
+    state->request.write = 0;
+    state->request.buffer = buffer;
+    state->request.length = (size_t)info.st_size;
+    state->request.offset = 0;
+    if (submitAsyncIO(io, &state->request) != 0)
+    {
+        perror(job->input);
+        munmap(buffer, (size_t)info.st_size);
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes a completed read. Returns 0, or -1 if the file is not a usable BMP
+static int finishAsyncRead(const BatchJob *job, AsyncJob *state)
+{
+    AsyncRequest *request = &state->request;
+    close(request->fd);
+    if (request->error != 0)
+    {
+        fprintf(stderr, "%s: %s\n", job->input, strerror(request->error));
+        munmap(request->buffer, request->length);
+        return -1;
+    }
+    TRACE_BEGIN(span, "decode");
+    state->image = decodeBMPMapping(request->buffer, request->length);
+    TRACE_END(span);
+    if (state->image == NULL || !checkBMPValid(&state->image->header))
+    {
+        fprintf(stderr, "%s: ", job->input);
+        printError(VALID_ERROR);
+        freeImage(state->image);
+        state->image = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Filters the decoded image of job into a file laid out in memory and queues
+// its write. Returns 0 if the write is in flight, -1 on failure
+static int startAsyncWrite(const BatchOptions *options, AsyncIO *io, ThreadPool *pool, const BatchJob *job,
+                           AsyncJob *state)
+{
+    char output[PATH_MAX];
+    BMP_Header outHeader;
+    BMP_Image *image = state->image;
+    state->image = NULL;
+    state->width = image->header.width_px;
+    state->height = image->norm_height;
+    state->bytesPerPixel = image->bytes_per_pixel;
+    if (outputPathFor(options, job, output, sizeof(output)) != 0)
+    {
+        freeImage(image);
+        return -1;
+    }
+    if (isSameFile(job->input, output))
+    {
+        fprintf(stderr, "%s: refusing to overwrite the input\n", job->input);
+        freeImage(image);
+        return -1;
+    }
+
+    outputHeaderFor(image, &outHeader);
+    state->result = mapBMPOutputImage(-1, &outHeader);
+    if (state->result != NULL)
+    {
+        adviseHugePages(state->result->mapping, state->result->mapping_size);
+    }
+    if (state->result == NULL || filterImage(pool, &options->chain, image, state->result) != 0)
+    {
+        freeImage(state->result);
+        freeImage(image);
+        return -1;
+    }
+    freeImage(image);
+
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(output);
+        freeImage(state->result);
+        return -1;
+    }
+    state->request.fd = fd;
+    state->request.write = 1;
+    state->request.buffer = (uint8_t *)state->result->mapping;
+    state->request.length = state->result->mapping_size;
+    state->request.offset = 0;
+    if (submitAsyncIO(io, &state->request) != 0)
+    {
+        perror(output);
+        close(fd);
+        freeImage(state->result);
+        return -1;
+    }
+    return 0;
+}
+
+/* Keeps up to ioDepth input files being read and ioDepth results being
+ * written while the pool filters whichever image was decoded first, so
+ * neither the disk nor the cores wait for the other.
+ */
+static int runAsyncJobs(const BatchOptions *options, BatchJobList *list)
+{
+    int depth = options->ioDepth;
+    ThreadPool *pool = createThreadPool(options->numThreads);
+    AsyncIO *io = createAsyncIO(2 * depth);
+    AsyncJob *states = (AsyncJob *)calloc(list->count, sizeof(AsyncJob));
+    int *ready = (int *)malloc(list->count * sizeof(int)); // Decoded jobs, oldest first
+    if (pool == NULL || io == NULL || states == NULL || ready == NULL)
+    {
+        fprintf(stderr, "Error setting up the asynchronous I/O pipeline\n");
+        destroyThreadPool(pool);
+        destroyAsyncIO(io);
+        free(states);
+        free(ready);
+        return -1;
+    }
+    printf("Asynchronous I/O with %s, %d reads and %d writes in flight\n", getAsyncIOBackend(io), depth, depth);
+
+    struct timespec start;
+    int processed = 0, failed = 0;
+    int next = 0, reads = 0, writes = 0, readyHead = 0, numReady = 0;
+    double megapixels = 0, megabytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (processed + failed < list->count)
+    {
+        // Keep the reads ahead, counting what is decoded but not filtered yet
+        while (next < list->count && reads + numReady < depth)
+        {
+            int status = startAsyncRead(io, &list->jobs[next], &states[next]);
+            if (status == 0)
+            {
+                reads++;
+            }
+            else if (status == 1)
+            {
+                ready[(readyHead + numReady++) % list->count] = next;
+            }
+            else
+            {
+                failed++;
+            }
+            next++;
+        }
+
+        if (numReady > 0 && writes < depth)
+        {
+            int index = ready[readyHead];
+            readyHead = (readyHead + 1) % list->count;
+            numReady--;
+            if (startAsyncWrite(options, io, pool, &list->jobs[index], &states[index]) == 0)
+            {
+                writes++;
+            }
+            else
+            {
+                failed++;
+            }
+            continue;
+        }
+
+        TRACE_BEGIN(waitSpan, "I/O wait");
+        AsyncRequest *request = waitAsyncIO(io);
+        TRACE_END(waitSpan);
+        if (request == NULL)
+        {
+            break;
+        }
+        AsyncJob *state = (AsyncJob *)request->user;
+        int index = (int)(state - states);
+        BatchJob *job = &list->jobs[index];
+        if (!request->write)
+        {
+            reads--;
+            if (finishAsyncRead(job, state) == 0)
+            {
+                ready[(readyHead + numReady++) % list->count] = index;
+            }
+            else
+            {
+                failed++;
+            }
+            continue;
+        }
+
+        writes--;
+        int result = request->error == 0 ? 0 : -1;
+        if (close(request->fd) == -1)
+        {
+            result = -1;
+        }
+        if (result != 0)
+        {
+            fprintf(stderr, "%s: writing the result failed: %s\n", job->input,
+                    strerror(request->error != 0 ? request->error : errno));
+            failed++;
+        }
+        else
+        {
+            char output[PATH_MAX];
+            double pixels = (double)state->width * state->height;
+            processed++;
+            megapixels += pixels / 1e6;
+            megabytes += pixels * state->bytesPerPixel / (1024.0 * 1024.0);
+            outputPathFor(options, job, output, sizeof(output));
+            printf("%s -> %s (%dx%d, %.1f ms)\n", job->input, output, state->width, state->height,
+                   elapsedSeconds(&state->start) * 1e3);
+        }
+        freeImage(state->result);
+        state->result = NULL;
+    }
+
+    double seconds = elapsedSeconds(&start);
+    destroyAsyncIO(io);
+    destroyThreadPool(pool);
+    free(states);
+    free(ready);
+    printSummary(processed, failed, options->numThreads, seconds, megapixels, megabytes);
+    return failed;
+}
+
+// Streams every job through the pool band by band; the bands double-buffer
+// their own I/O, so there is no image prefetcher
+// Whether the header of path describes rows that can stream, see streaming.h
+static int isStreamable(const char *path)
+{
+    BMP_Header header;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return 1; // Let streamFilterFile report the error
+    }
+    ssize_t bytes = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+    return bytes != sizeof(header) || header.bits_per_pixel != 8;
+}
+
+// Filters an indexed image in memory, as the local jobs do, and returns its header
+static int filterInMemory(ThreadPool *pool, SharedImage *shared, const FilterChain *chain, const char *input,
+                          const char *output, BMP_Header *header)
+{
+    BMP_Image *image = loadInputImage(input);
+    if (image == NULL)
+    {
+        return -1;
+    }
+    int result = filterImageToFile(pool, shared, chain, image, output);
+    *header = image->header;
+    freeImage(image);
+    return result;
+}
+
+static int runStreamJobs(const BatchOptions *options, BatchJobList *list)
+{
+    ThreadPool *pool = createThreadPool(options->numThreads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating thread pool\n");
+        return -1;
+    }
+
+    SharedImage shared = SHARED_IMAGE_INIT;
+    struct timespec start;
+    int processed = 0, failed = 0;
+    double megapixels = 0, megabytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        BatchJob *job = &list->jobs[i];
+        char output[PATH_MAX];
+        BMP_Header header;
+        if (outputPathFor(options, job, output, sizeof(output)) != 0)
+        {
+            failed++;
+            continue;
+        }
+        if (isSameFile(job->input, output))
+        {
+            fprintf(stderr, "%s: refusing to overwrite the input\n", job->input);
+            failed++;
+            continue;
+        }
+
+        struct timespec imageStart;
+        clock_gettime(CLOCK_MONOTONIC, &imageStart);
+        int streamed = isStreamable(job->input);
+        if ((streamed ? streamFilterFile(pool, &options->chain, job->input, output, options->bandRows, &header)
+                      : filterInMemory(pool, &shared, &options->chain, job->input, output, &header)) != 0)
+        {
+            failed++;
+            continue;
+        }
+        double pixels = (double)header.width_px * abs(header.height_px);
+        processed++;
+        megapixels += pixels / 1e6;
+        megabytes += pixels * (header.bits_per_pixel / 8) / (1024.0 * 1024.0);
+        printf("%s -> %s (%dx%d, %s, %.1f ms)\n", job->input, output, header.width_px, abs(header.height_px),
+               streamed ? "streamed" : "in memory", elapsedSeconds(&imageStart) * 1e3);
+    }
+
+    double seconds = elapsedSeconds(&start);
+    destroyThreadPool(pool);
+    releaseSharedImage(&shared);
+    printSummary(processed, failed, options->numThreads, seconds, megapixels, megabytes);
+    return failed;
+}
+
+// Waits for the oldest job in flight and reports it
+static int collectDaemonJob(DaemonClient *client, const BatchJobList *list, int *slots, int *jobs, int *inFlight)
+{
+    int result = waitDaemonJob(client, slots[0]);
+    const BatchJob *job = &list->jobs[jobs[0]];
+    if (result == 0)
+    {
+        printf("%s: done\n", job->input);
+    }
+    else
+    {
+        fprintf(stderr, "%s: failed in the daemon\n", job->input);
+    }
+    (*inFlight)--;
+    memmove(slots, slots + 1, *inFlight * sizeof(int));
+    memmove(jobs, jobs + 1, *inFlight * sizeof(int));
+    return result;
+}
+
+// Sends every job to the daemon, keeping as many in flight as it has slots for
+static int runDaemonJobs(const BatchOptions *options, BatchJobList *list)
+{
+    DaemonClient *client = connectDaemon(options->clientName);
+    if (client == NULL)
+    {
+        fprintf(stderr, "No filter daemon named '%s' is running\n", options->clientName);
+        return -1;
+    }
+
+    int slots[DAEMON_JOB_SLOTS], jobs[DAEMON_JOB_SLOTS];
+    int inFlight = 0, processed = 0, failed = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        BatchJob *job = &list->jobs[i];
+        char output[PATH_MAX], input[DAEMON_PATH_BYTES], absoluteOutput[DAEMON_PATH_BYTES];
+        if (outputPathFor(options, job, output, sizeof(output)) != 0 ||
+            absolutePath(job->input, input, sizeof(input)) != 0 ||
+            absolutePath(output, absoluteOutput, sizeof(absoluteOutput)) != 0)
+        {
+            fprintf(stderr, "%s: path too long for the daemon\n", job->input);
+            failed++;
+            continue;
+        }
+        if (isSameFile(input, absoluteOutput))
+        {
+            fprintf(stderr, "%s: refusing to overwrite the input\n", job->input);
+            failed++;
+            continue;
+        }
+
+        int slot;
+        while ((slot = submitDaemonJob(client, DAEMON_FILTER_IMAGE, options->filters, input, absoluteOutput)) < 0)
+        {
+            if (errno != EAGAIN)
+            {
+                perror(job->input);
+                break;
+            }
+            // Every slot is busy: make room by collecting our oldest job
+            if (inFlight > 0)
+            {
+                int result = collectDaemonJob(client, list, slots, jobs, &inFlight);
+                processed += result == 0;
+                failed += result != 0;
+            }
+            else
+            {
+                usleep(1000);
+            }
+        }
+        if (slot < 0)
+        {
+            failed++;
+            continue;
+        }
+        slots[inFlight] = slot;
+        jobs[inFlight++] = i;
+    }
+    while (inFlight > 0)
+    {
+        int result = collectDaemonJob(client, list, slots, jobs, &inFlight);
+        processed += result == 0;
+        failed += result != 0;
+    }
+
+    disconnectDaemon(client);
+    printf("--------------------------------------------------------\n");
+    printf("%d images processed by daemon '%s', %d failed, %.3f s\n", processed, options->clientName, failed,
+           elapsedSeconds(&start));
+    return failed;
+}
+
+static int stopFilterDaemon(const char *name)
+{
+    DaemonClient *client = connectDaemon(name);
+    if (client == NULL)
+    {
+        fprintf(stderr, "No filter daemon named '%s' is running\n", name);
+        return EXIT_FAILURE;
+    }
+    int slot;
+    while ((slot = submitDaemonJob(client, DAEMON_STOP, "", "", "")) < 0 && errno == EAGAIN)
+    {
+        usleep(1000);
+    }
+    int result = slot >= 0 ? waitDaemonJob(client, slot) : -1;
+    disconnectDaemon(client);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Runs every input of the command line through one thread pool (or the
+ * filter daemon) and prints a throughput summary. Returns the exit status.
+ */
+int runBatch(int argc, char **argv)
+{
+    BatchOptions options;
+    BatchJobList list = {NULL, 0, 0};
+
+    if (parseOptions(argc, argv, &options) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (options.daemonName != NULL)
+    {
+        return runFilterDaemon(options.daemonName, options.numThreads);
+    }
+    if (options.stopDaemon)
+    {
+        return stopFilterDaemon(options.clientName);
+    }
+    if (options.fleetSocket != NULL)
+    {
+        return runFleetWorker(options.fleetSocket, options.numThreads);
+    }
+
+    if (options.manifest != NULL && addManifest(&list, options.manifest) != 0)
+    {
+        freeJobs(&list);
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        if (addInput(&list, argv[i]) != 0)
+        {
+            freeJobs(&list);
+            return EXIT_FAILURE;
+        }
+    }
+    if (list.count == 0)
+    {
+        fprintf(stderr, "No input images\n");
+        printUsage(argv[0]);
+        freeJobs(&list);
+        return EXIT_FAILURE;
+    }
+
+    int needsOutputDir = 0;
+    for (int i = 0; i < list.count; i++)
+    {
+        needsOutputDir |= list.jobs[i].output == NULL;
+    }
+    if (needsOutputDir && mkdir(options.outputDir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(options.outputDir);
+        freeJobs(&list);
+        return EXIT_FAILURE;
+    }
+
+    int failed;
+    if (options.clientName != NULL)
+    {
+        failed = runDaemonJobs(&options, &list);
+    }
+    else if (options.fleet != NULL)
+    {
+        failed = runFleetJobs(&options, &list);
+    }
+    else if (options.ioDepth > 0)
+    {
+        failed = runAsyncJobs(&options, &list);
+    }
+    else if (options.sequenceTile > 0)
+    {
+        failed = runSequenceJobs(&options, &list);
+    }
+    else
+    {
+        failed = options.stream ? runStreamJobs(&options, &list) : runLocalJobs(&options, &list);
+    }
+    freeJobs(&list);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
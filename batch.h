@@ -0,0 +1,22 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+#include "bmp.h"
+#include "shm_image.h"
+#include "threadpool.h"
+#include "pipeline.h"
+
+/*
+ * Non-interactive mode of ex7:
+ *   ex7 [-t threads] [-f filter,...] [-o outdir] [-m manifest] [input...]
+ * Inputs are BMP files, directories (every *.bmp inside) or glob patterns.
+ * A manifest lists one "input [output]" pair per line. Every image goes
+ * through the same thread pool while a loader thread reads the next one.
+ */
+int runBatch(int argc, char **argv);
+
+// Per-image steps, shared with the filter daemon
+BMP_Image *loadInputImage(const char *path);
+int filterImageToFile(ThreadPool *pool, SharedImage *shared, const FilterChain *chain, BMP_Image *image,
+                      const char *output);
+
+#endif /* batch.h */
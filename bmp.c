@@ -1,5 +1,14 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "bmp.h"
 /* USE THIS FUNCTION TO PRINT ERROR MESSAGES
@@ -26,10 +35,150 @@ void printError(int error)
   }
 }
 
+/* Returns the in-memory row stride for a row of width pixels: the row size
+ * rounded up to PIXEL_ALIGN so every row starts on a SIMD-aligned boundary.
+ * The stride is never smaller than the 4-byte padded row of the BMP file.
+ */
+int getRowStride(int width, int bytesPerPixel)
+{
+  return (width * bytesPerPixel + PIXEL_ALIGN - 1) & ~(PIXEL_ALIGN - 1);
+}
+
+/* Works out how a file with this header is held in memory. extra holds the
+ * extraSize bytes between the 54-byte header and the pixel data (the rest of
+ * a larger info header, the bit masks and the palette). 24-bit rows are used
+ * as stored and 32-bit rows keep their 4-byte BGRA layout, so every pixel is
+ * aligned for the SIMD kernels; 8-bit indexed rows are expanded to 24-bit BGR
+ * through palette. Returns the in-memory bytes per pixel, 0 if the format is
+ * not supported.
+ */
+static int decodedBytesPerPixel(const BMP_Header *header, const uint8_t *extra, size_t extraSize,
+                                uint8_t palette[256][3])
+{
+  size_t infoExtra = header->header_size > 40 ? header->header_size - 40 : 0;
+  if (header->header_size < 40 || infoExtra > extraSize)
+  {
+    return 0;
+  }
+
+  switch (header->bits_per_pixel)
+  {
+  case 24:
+    return header->compression == 0 ? 3 : 0;
+  case 32:
+    // BI_BITFIELDS is fine as long as the masks describe plain BGRA
+    if (header->compression == 3)
+    {
+      uint32_t masks[3];
+      if (extraSize < sizeof(masks))
+      {
+        return 0;
+      }
+      memcpy(masks, extra, sizeof(masks));
+      return masks[0] == 0x00ff0000 && masks[1] == 0x0000ff00 && masks[2] == 0x000000ff ? 4 : 0;
+    }
+    return header->compression == 0 ? 4 : 0;
+  case 8:
+  {
+    if (header->compression != 0)
+    {
+      return 0;
+    }
+    // BGRX entries right after the info header; missing ones decode as black
+    size_t colours = header->ncolours != 0 && header->ncolours < 256 ? header->ncolours : 256;
+    if (colours > (extraSize - infoExtra) / PALETTE_ENTRY_SIZE)
+    {
+      colours = (extraSize - infoExtra) / PALETTE_ENTRY_SIZE;
+    }
+    memset(palette, 0, 256 * 3);
+    for (size_t i = 0; i < colours; i++)
+    {
+      memcpy(palette[i], extra + infoExtra + PALETTE_ENTRY_SIZE * i, 3);
+    }
+    return 3;
+  }
+  default:
+    return 0;
+  }
+}
+
+// The header of a decoded image describes its in-memory layout, not the file's
+static void setDecodedHeader(BMP_Image *image)
+{
+  if (image->header.bits_per_pixel != image->bytes_per_pixel * 8 || image->header.compression != 0)
+  {
+    image->header.bits_per_pixel = image->bytes_per_pixel * 8;
+    prepareBMPHeader(&image->header);
+  }
+}
+
+// Allocates one aligned block for all rows of image, plus the row view into it. Returns FALSE if out of memory
+static int allocatePixels(BMP_Image *image)
+{
+  image->stride = getRowStride(image->header.width_px, image->bytes_per_pixel);
+  image->mapping = NULL;
+  image->mapping_size = 0;
+  image->pixel_data = (uint8_t *)aligned_alloc(PIXEL_ALIGN, (size_t)image->norm_height * image->stride);
+  image->pixels = (Pixel **)malloc(image->norm_height * sizeof(Pixel *));
+  if (image->pixel_data == NULL || image->pixels == NULL)
+  {
+    printError(MEMORY_ERROR);
+    free(image->pixel_data);
+    free(image->pixels);
+    return FALSE;
+  }
+
+  for (int i = 0; i < image->norm_height; i++)
+  {
+    image->pixels[i] = (Pixel *)(image->pixel_data + (size_t)i * image->stride);
+  }
+  return TRUE;
+}
+
+// Expands one row of 8-bit palette indices into 24-bit BGR
+static void expandIndexedRow(const uint8_t *indices, uint8_t *out, int width, uint8_t palette[256][3])
+{
+  for (int x = 0; x < width; x++)
+  {
+    memcpy(out + 3 * x, palette[indices[x]], 3);
+  }
+}
+
+// Reads the 8-bit rows that follow in fptr into image, which holds 24-bit BGR
+static void readIndexedImageData(FILE *fptr, BMP_Image *image, uint8_t palette[256][3])
+{
+  int width = image->header.width_px;
+  int rowSize = (width + 3) & ~3;
+  int topDown = image->header.height_px < 0;
+  uint8_t *indices = (uint8_t *)malloc(rowSize);
+  if (indices == NULL)
+  {
+    printError(MEMORY_ERROR);
+    free(image->pixels);
+    image->pixels = NULL;
+    return;
+  }
+
+  int i = 0;
+  while (i < image->norm_height && fread(indices, rowSize, 1, fptr) == 1)
+  {
+    expandIndexedRow(indices, (uint8_t *)image->pixels[topDown ? image->norm_height - 1 - i : i], width, palette);
+    i++;
+  }
+  free(indices);
+  if (i < image->norm_height)
+  {
+    printError(FILE_ERROR);
+    free(image->pixels);
+    image->pixels = NULL;
+  }
+}
+
 /* The input argument is the source file pointer. The function will first construct a BMP_Image image by allocating memory to it.
- * Then the function read the header from source image to the image's header.
+ * Then the function read the header from source image to the image's header, and the palette or bit masks that follow it.
  * Compute data size, width, height, and bytes_per_pixel of the image and stores them as image's attributes.
- * Finally, allocate menory for image's data according to the image size.
+ * 24-bit and 32-bit images keep their layout; 8-bit indexed images are expanded to 24-bit and their header says so.
+ * Finally, allocate menory for image's data according to the image size and read the rows, bottom-up whatever the file order.
  * Return image;
  */
 BMP_Image *createBMPImage(FILE *fptr)
@@ -54,69 +203,97 @@ BMP_Image *createBMPImage(FILE *fptr)
     return NULL;
   }
 
+  // Everything up to the pixel data: larger info headers, bit masks, palette
+  uint8_t palette[256][3];
+  size_t extraSize = image->header.offset > sizeof(BMP_Header) ? image->header.offset - sizeof(BMP_Header) : 0;
+  uint8_t *extra = (uint8_t *)malloc(extraSize + 1);
+  if (extra == NULL || fread(extra, 1, extraSize, fptr) != extraSize)
+  {
+    printError(extra == NULL ? MEMORY_ERROR : FILE_ERROR);
+    free(extra);
+    free(image);
+    return NULL;
+  }
+  int bytesPerPixel = decodedBytesPerPixel(&image->header, extra, extraSize, palette);
+  free(extra);
+
   // Compute data size, width, height, and bytes per pixel
   int width = image->header.width_px;
   int height = image->header.height_px;
-  int bytesPerPixel = image->header.bits_per_pixel / 8;
-
-  image->norm_height = abs(height);
-  image->bytes_per_pixel = bytesPerPixel;
-
-  // Allocate memory for image data
-  image->pixels = (Pixel **)malloc(height * sizeof(Pixel *));
-  if (image->pixels == NULL)
+  if (bytesPerPixel == 0 || width <= 0 || height == 0 || image->header.offset < sizeof(BMP_Header))
   {
-    printError(MEMORY_ERROR);
+    printf("  Error: unsupported BMP format (%d bits per pixel, compression %u)!\n", image->header.bits_per_pixel,
+           image->header.compression);
+    printError(VALID_ERROR);
     free(image);
     return NULL;
   }
 
-  for (int i = 0; i < height; i++)
+  image->norm_height = abs(height);
+  image->bytes_per_pixel = bytesPerPixel;
+  if (!allocatePixels(image))
   {
-    image->pixels[i] = (Pixel *)malloc(width * sizeof(Pixel));
-    if (image->pixels[i] == NULL)
-    {
-      printError(MEMORY_ERROR);
-      for (int j = 0; j < i; j++)
-      {
-        free(image->pixels[j]);
-      }
-      free(image->pixels);
-      free(image);
-      return NULL;
-    }
+    free(image);
+    return NULL;
   }
 
   // Read the image data
   printf("  Reading image data\n");
-  readImageData(fptr, image);
+  if (image->header.bits_per_pixel == 8)
+  {
+    readIndexedImageData(fptr, image, palette);
+  }
+  else
+  {
+    readImageData(fptr, image);
+  }
   if (image->pixels == NULL)
   {
     freeImage(image);
     return NULL;
   }
 
+  setDecodedHeader(image);
   return image;
 }
 
 /* The input arguments are the source file pointer, the image data pointer, and the size of image data.
  * The functions reads data from the source into the image data matriz of pixels.
+ * Bottom-up rows are read with a single fread and then spread out to the buffer stride;
+ * top-down rows are read one by one straight into their bottom-up place.
  */
 void readImageData(FILE *fptr, BMP_Image *image)
 {
   int rowSize = (image->header.width_px * image->bytes_per_pixel + 3) & ~3; // Row size is padded to the nearest multiple of 4 bytes
-  for (int i = 0; i < image->header.height_px; i++)
+  if (image->header.height_px < 0)
   {
-    if (fread(image->pixels[i], rowSize, 1, fptr) != 1)
+    for (int i = image->norm_height - 1; i >= 0; i--)
     {
-      printError(FILE_ERROR);
-      for (int j = 0; j <= i; j++)
+      if (fread(image->pixels[i], rowSize, 1, fptr) != 1)
       {
-        free(image->pixels[j]);
+        printError(FILE_ERROR);
+        free(image->pixels);
+        image->pixels = NULL;
+        return;
       }
-      free(image->pixels);
-      image->pixels = NULL;
-      return;
+    }
+    return;
+  }
+
+  if (fread(image->pixel_data, rowSize, image->norm_height, fptr) != (size_t)image->norm_height)
+  {
+    printError(FILE_ERROR);
+    free(image->pixels);
+    image->pixels = NULL;
+    return;
+  }
+
+  // Move rows from last to first so a row never overwrites one not yet moved
+  if (rowSize != image->stride)
+  {
+    for (int i = image->norm_height - 1; i > 0; i--)
+    {
+      memmove(image->pixel_data + (size_t)i * image->stride, image->pixel_data + (size_t)i * rowSize, rowSize);
     }
   }
 }
@@ -134,44 +311,343 @@ void readImage(FILE *srcFile, BMP_Image **dataImage)
   }
 }
 
+/* Points the row view of image at pixel rows laid out as in a BMP file starting at data.
+ * Top-down files store the top row first, so they are walked backwards with a negative stride.
+ */
+static void setFileRows(BMP_Image *image, uint8_t *data, size_t rowSize)
+{
+  if (image->header.height_px > 0)
+  {
+    image->stride = (int)rowSize;
+    image->pixel_data = data;
+  }
+  else
+  {
+    image->stride = -(int)rowSize;
+    image->pixel_data = data + (image->norm_height - 1) * rowSize;
+  }
+  for (int i = 0; i < image->norm_height; i++)
+  {
+    image->pixels[i] = (Pixel *)(image->pixel_data + (ptrdiff_t)i * image->stride);
+  }
+}
+
+/* The input argument is the source file name. The function maps the whole file
+ * read-only and decodes it with decodeBMPMapping, so no 24-bit or 32-bit pixel
+ * is copied. Returns NULL if the file cannot be mapped, is too short for its
+ * header or is in a format only createBMPImage reports on.
+ */
+BMP_Image *mapBMPImage(const char *srcFileName)
+{
+  // Opening and closing a pipe here would drop what its writer already sent
+  struct stat st;
+  if (stat(srcFileName, &st) == -1 || !S_ISREG(st.st_mode))
+  {
+    return NULL;
+  }
+
+  int fd = open(srcFileName, O_RDONLY);
+  if (fd == -1)
+  {
+    return NULL;
+  }
+
+  // Only the size is needed to map the file
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(BMP_Header))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  size_t fileSize = (size_t)st.st_size;
+  uint8_t *mapping = (uint8_t *)mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    return NULL;
+  }
+  return decodeBMPMapping(mapping, fileSize);
+}
+
+/* The input arguments are the mmap'ed bytes of a whole BMP file, from the file
+ * itself or read into anonymous memory, and their length. The function takes
+ * ownership of the mapping and builds a BMP_Image whose rows point straight at
+ * it. Rows start at header.offset, are padded to 4 bytes and are exposed
+ * bottom-up whatever the sign of height_px. 8-bit indexed images are expanded
+ * to 24-bit into their own buffer and the mapping is released. Returns NULL,
+ * after unmapping, if the bytes are too short or in an unsupported format.
+ */
+BMP_Image *decodeBMPMapping(uint8_t *mapping, size_t fileSize)
+{
+  if (fileSize < sizeof(BMP_Header))
+  {
+    munmap(mapping, fileSize);
+    return NULL;
+  }
+
+  BMP_Image *image = (BMP_Image *)malloc(sizeof(BMP_Image));
+  if (image == NULL)
+  {
+    printError(MEMORY_ERROR);
+    munmap(mapping, fileSize);
+    return NULL;
+  }
+  memcpy(&image->header, mapping, sizeof(BMP_Header));
+
+  int width = image->header.width_px;
+  int height = image->header.height_px;
+  image->norm_height = abs(height);
+  image->mapping = mapping;
+  image->mapping_size = fileSize;
+
+  uint8_t palette[256][3];
+  size_t offset = image->header.offset;
+  image->bytes_per_pixel = offset < sizeof(BMP_Header) || offset > fileSize ? 0
+                           : decodedBytesPerPixel(&image->header, mapping + sizeof(BMP_Header),
+                                                  offset - sizeof(BMP_Header), palette);
+  if (image->bytes_per_pixel == 0)
+  {
+    munmap(mapping, fileSize);
+    free(image);
+    return NULL;
+  }
+
+  size_t rowSize = ((size_t)width * (image->header.bits_per_pixel / 8) + 3) & ~(size_t)3;
+  if (width <= 0 || height == 0 || rowSize * image->norm_height > fileSize - offset)
+  {
+    printError(VALID_ERROR);
+    munmap(mapping, fileSize);
+    free(image);
+    return NULL;
+  }
+
+  if (image->header.bits_per_pixel == 8)
+  {
+    if (!allocatePixels(image))
+    {
+      munmap(mapping, fileSize);
+      free(image);
+      return NULL;
+    }
+    int topDown = height < 0;
+    for (int i = 0; i < image->norm_height; i++)
+    {
+      expandIndexedRow(mapping + offset + i * rowSize,
+                       (uint8_t *)image->pixels[topDown ? image->norm_height - 1 - i : i], width, palette);
+    }
+    munmap(mapping, fileSize);
+    setDecodedHeader(image);
+    return image;
+  }
+
+  image->pixels = (Pixel **)malloc(image->norm_height * sizeof(Pixel *));
+  if (image->pixels == NULL)
+  {
+    printError(MEMORY_ERROR);
+    munmap(mapping, fileSize);
+    free(image);
+    return NULL;
+  }
+
+  setFileRows(image, mapping + offset, rowSize);
+  setDecodedHeader(image);
+
+  madvise(mapping, fileSize, MADV_WILLNEED);
+  return image;
+}
+
+/* The input argument is the header of an image about to be written.
+ * The function fills in every field that depends on the pixel layout (offset,
+ * header size, palette, image size and file size) so the header is correct before it is written.
+ * 8-bit images are written with a 256-entry grey ramp palette between the header and the rows.
+ * Beyond 4 GiB the 32-bit fields cannot hold the sizes: imagesize is 0 (allowed for BI_RGB)
+ * and size is UINT32_MAX. Returns the file size in bytes.
+ */
+uint64_t prepareBMPHeader(BMP_Header *header)
+{
+  uint64_t rowSize = ((uint64_t)header->width_px * (header->bits_per_pixel / 8) + 3) & ~(uint64_t)3;
+  int colours = header->bits_per_pixel == 8 ? 256 : 0;
+  header->type = 0x4d42;
+  header->reserved1 = 0;
+  header->reserved2 = 0;
+  header->offset = sizeof(BMP_Header) + PALETTE_ENTRY_SIZE * colours;
+  header->header_size = sizeof(BMP_Header) - 14;
+  header->planes = 1;
+  header->compression = 0;
+  uint64_t imageSize = rowSize * (uint64_t)abs(header->height_px);
+  uint64_t fileSize = header->offset + imageSize;
+  header->imagesize = imageSize <= UINT32_MAX ? (uint32_t)imageSize : 0;
+  header->size = fileSize <= UINT32_MAX ? (uint32_t)fileSize : UINT32_MAX;
+  header->ncolours = colours;
+  header->importantcolours = 0;
+  return fileSize;
+}
+
+// Palette written with 8-bit images: entry i is the grey level i
+static void fillGreyPalette(uint8_t *palette)
+{
+  for (int i = 0; i < 256; i++)
+  {
+    palette[PALETTE_ENTRY_SIZE * i] = (uint8_t)i;
+    palette[PALETTE_ENTRY_SIZE * i + 1] = (uint8_t)i;
+    palette[PALETTE_ENTRY_SIZE * i + 2] = (uint8_t)i;
+    palette[PALETTE_ENTRY_SIZE * i + 3] = 0;
+  }
+}
+
+// Writes every iovec in full, resuming after short writes
+static int writeAllVectors(int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return FALSE;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return TRUE;
+}
+
+/* The input arguments are an open destination file descriptor, and BMP_Image pointer.
+ * The function prepares the header and then writes it together with the rows using writev,
+ * one syscall per IOV_MAX rows (a single one when rows are stored back to back).
+ * Rows are written in the order the header's height sign asks for.
+ * Returns TRUE on success, FALSE on a write error.
+ */
+int writeImageFile(int destFd, BMP_Image *dataImage)
+{
+  prepareBMPHeader(&dataImage->header);
+
+  int rowSize = (dataImage->header.width_px * dataImage->bytes_per_pixel + 3) & ~3;
+  int height = dataImage->norm_height;
+  int topDown = dataImage->header.height_px < 0;
+  uint8_t palette[PALETTE_ENTRY_SIZE * 256];
+  struct iovec iov[IOV_MAX];
+  int count = 0;
+
+  iov[count].iov_base = &dataImage->header;
+  iov[count].iov_len = sizeof(BMP_Header);
+  count++;
+  if (dataImage->header.ncolours != 0)
+  {
+    fillGreyPalette(palette);
+    iov[count].iov_base = palette;
+    iov[count].iov_len = sizeof(palette);
+    count++;
+  }
+
+  // Rows already laid out like the file: one vector for the whole pixel array
+  if (!topDown && dataImage->stride == rowSize)
+  {
+    iov[count].iov_base = dataImage->pixel_data;
+    iov[count].iov_len = (size_t)rowSize * height;
+    return writeAllVectors(destFd, iov, count + 1);
+  }
+
+  for (int i = 0; i < height; i++)
+  {
+    iov[count].iov_base = dataImage->pixels[topDown ? height - 1 - i : i];
+    iov[count].iov_len = rowSize;
+    count++;
+    if (count == IOV_MAX)
+    {
+      if (!writeAllVectors(destFd, iov, count))
+      {
+        return FALSE;
+      }
+      count = 0;
+    }
+  }
+  return writeAllVectors(destFd, iov, count);
+}
+
 /* The input arguments are the destination file name, and BMP_Image pointer.
  * The function write the header and image data into the destination file.
  */
 void writeImage(char *destFileName, BMP_Image *dataImage)
 {
-  FILE *destFile = fopen(destFileName, "wb");
-  if (destFile == NULL)
+  int destFd = open(destFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (destFd == -1)
   {
     printf(" ");
     printError(FILE_ERROR);
     return;
   }
 
-  // Write the header to the destination file
-  if (fwrite(&(dataImage->header), sizeof(BMP_Header), 1, destFile) != 1)
+  if (!writeImageFile(destFd, dataImage))
   {
     printf(" ");
     printError(FILE_ERROR);
-    fclose(destFile);
-    return;
   }
 
-  // Write the image data to the destination file
-  int rowSize = (dataImage->header.width_px * dataImage->bytes_per_pixel + 3) & ~3;
-  dataImage->header.imagesize = rowSize * abs(dataImage->header.height_px);
+  close(destFd);
+}
 
-  for (int i = 0; i < dataImage->header.height_px; i++)
+/* The input arguments are an open, writable destination file descriptor, and the header of the image to produce.
+ * The function sizes the file with ftruncate, maps it shared and writes the prepared header,
+ * then returns a BMP_Image whose rows point into the mapping: pixels stored in it land directly in the file.
+ * With destFd -1 the file is laid out in anonymous memory instead, to be written later from
+ * mapping (mapping_size bytes) in one piece.
+ * Rows are exposed bottom-up like every BMP_Image. freeImage unmaps the file.
+ * Returns NULL if the file cannot be sized or mapped.
+ */
+BMP_Image *mapBMPOutputImage(int destFd, const BMP_Header *header)
+{
+  BMP_Image *image = (BMP_Image *)malloc(sizeof(BMP_Image));
+  if (image == NULL)
   {
-    if (fwrite(dataImage->pixels[i], rowSize, 1, destFile) != 1)
-    {
-      printf(" ");
-      printError(FILE_ERROR);
-      fclose(destFile);
-      return;
-    }
+    printError(MEMORY_ERROR);
+    return NULL;
+  }
+  image->header = *header;
+  size_t fileSize = prepareBMPHeader(&image->header);
+  image->norm_height = abs(header->height_px);
+  image->bytes_per_pixel = header->bits_per_pixel / 8;
+
+  size_t rowSize = ((size_t)header->width_px * image->bytes_per_pixel + 3) & ~(size_t)3;
+  image->pixels = (Pixel **)malloc(image->norm_height * sizeof(Pixel *));
+  if (image->pixels == NULL || (destFd != -1 && ftruncate(destFd, fileSize) == -1))
+  {
+    free(image->pixels);
+    free(image);
+    return NULL;
   }
 
-  fclose(destFile);
+  uint8_t *mapping = (uint8_t *)mmap(NULL, fileSize, PROT_READ | PROT_WRITE,
+                                     destFd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, destFd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    free(image->pixels);
+    free(image);
+    return NULL;
+  }
+  memcpy(mapping, &image->header, sizeof(BMP_Header));
+  if (image->header.ncolours != 0)
+  {
+    fillGreyPalette(mapping + sizeof(BMP_Header));
+  }
+  image->mapping = mapping;
+  image->mapping_size = fileSize;
+
+  setFileRows(image, mapping + image->header.offset, rowSize);
+
+  return image;
 }
 
 /* The input argument is the BMP_Image pointer. The function frees memory of the BMP_Image.
@@ -180,13 +656,14 @@ void freeImage(BMP_Image *image)
 {
   if (image != NULL)
   {
-    if (image->pixels != NULL)
+    free(image->pixels);
+    if (image->mapping != NULL)
     {
-      for (int i = 0; i < image->header.height_px; i++)
-      {
-        free(image->pixels[i]);
-      }
-      free(image->pixels);
+      munmap(image->mapping, image->mapping_size);
+    }
+    else
+    {
+      free(image->pixel_data);
     }
     free(image);
   }
@@ -3,6 +3,7 @@
 #ifndef _BMP_H_
 #define _BMP_H_
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h> // Incluir stdio.h para el tipo FILE
 #define TRUE 1
 #define FALSE 0
@@ -11,6 +12,8 @@
 #define MEMORY_ERROR 3
 #define VALID_ERROR 4
 #define HEADER_SIZE 54
+#define PALETTE_ENTRY_SIZE 4 // Bytes per palette entry: blue, green, red, 0
+#define PIXEL_ALIGN 64 // Row alignment of pixel buffers, enough for any SIMD load
 
 // Set data alignment to 1 byte boundary
 #pragma pack(1)
@@ -57,19 +60,36 @@ typedef struct __attribute__((packed)) Pixel
     uint8_t red;
 } Pixel;
 
+/*
+ * pixels[y] is always in bottom-up order, as stored in a BMP with positive
+ * height: pixels[0] is the bottom row. For a top-down image (negative height)
+ * the stride is negative and pixel_data points at the bottom row.
+ * Rows hold bytes_per_pixel bytes per pixel: 3 (BGR, also used for decoded
+ * 8-bit indexed images) or 4 (BGRA), so Pixel only indexes 24-bit rows.
+ */
 typedef struct BMP_Image
 {
     BMP_Header header;
     int norm_height;     // normalized height
     int bytes_per_pixel; // This amount should be equals to number of bits/8
-    Pixel **pixels;
+    int stride;          // Bytes between the start of consecutive rows
+    uint8_t *pixel_data; // Contiguous pixel buffer, norm_height * stride bytes
+    Pixel **pixels;      // Row view: pixels[y] points into pixel_data
+    void *mapping;       // Whole file when mapped (mapBMPImage, mapBMPOutputImage), else NULL
+    size_t mapping_size; // Length of mapping in bytes
 } BMP_Image;
 
 void printError(int error);
+int getRowStride(int width, int bytesPerPixel);
 BMP_Image *createBMPImage();
 void readImageData(FILE *srcFile, BMP_Image *dataImage);
 void readImage(FILE *srcFile, BMP_Image **dataImage);
+BMP_Image *mapBMPImage(const char *srcFileName);
+BMP_Image *decodeBMPMapping(uint8_t *mapping, size_t fileSize);
+uint64_t prepareBMPHeader(BMP_Header *header);
+int writeImageFile(int destFd, BMP_Image *dataImage);
 void writeImage(char *destFileName, BMP_Image *dataImage);
+BMP_Image *mapBMPOutputImage(int destFd, const BMP_Header *header);
 void freeImage(BMP_Image *image);
 int checkBMPValid(BMP_Header *header);
 void printBMPHeader(BMP_Header *header);
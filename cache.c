@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "trace.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ull
+#define PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define PRIME64_3 0x165667B19E3779F9ull
+#define PRIME64_4 0x85EBCA77C2B2AE63ull
+#define PRIME64_5 0x27D4EB2F165667C5ull
+
+#define COPY_CHUNK (1 << 20) // Bytes per read / write when nothing faster works
+
+typedef struct
+{
+    uint64_t key;
+    uint64_t size;
+    struct timespec used; // Modification time, refreshed on every hit
+} CacheEntry;
+
+struct ResultCache
+{
+    char dir[PATH_MAX];
+    uint64_t maxBytes;
+    pthread_mutex_t lock; // The loader thread looks entries up while results are stored
+    CacheEntry *entries;
+    int count;
+    int capacity;
+    ResultCacheStats stats;
+};
+
+static uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxhRound(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* XXH64 of length bytes at data: four independent 64-bit lanes over
+ * 32-byte stripes, so it runs at memory speed. Little-endian hosts only,
+ * like the BMP code.
+ */
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + length;
+    uint64_t hash;
+
+    if (length >= 32)
+    {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+        }
+        hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        hash = xxhMerge(hash, v1);
+        hash = xxhMerge(hash, v2);
+        hash = xxhMerge(hash, v3);
+        hash = xxhMerge(hash, v4);
+    }
+    else
+    {
+        hash = seed + PRIME64_5;
+    }
+    hash += (uint64_t)length;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        hash ^= xxhRound(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end)
+    {
+        hash ^= (uint64_t)read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* Hashes the whole file at path, header and pixels, with seed. Returns 0,
+ * or -1 if it is not a regular file (a pipe can only be read once).
+ */
+int hashInputFile(const char *path, uint64_t seed, uint64_t *key)
+{
+    struct stat info;
+    if (stat(path, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size == 0)
+    {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+    TRACE_BEGIN(span, "hash");
+    *key = hashBytes(data, (size_t)info.st_size, seed);
+    TRACE_END(span);
+    munmap(data, (size_t)info.st_size);
+    return 0;
+}
+
+static void entryPath(const ResultCache *cache, uint64_t key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.bmp", cache->dir, (unsigned long long)key);
+}
+
+static int findEntry(const ResultCache *cache, uint64_t key)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].key == key)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void removeEntry(ResultCache *cache, int index)
+{
+    cache->stats.bytes -= cache->entries[index].size;
+    cache->entries[index] = cache->entries[--cache->count];
+}
+
+static int addEntry(ResultCache *cache, uint64_t key, uint64_t size, struct timespec used)
+{
+    if (cache->count == cache->capacity)
+    {
+        int capacity = cache->capacity > 0 ? 2 * cache->capacity : 64;
+        CacheEntry *entries = (CacheEntry *)realloc(cache->entries, capacity * sizeof(CacheEntry));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    CacheEntry *entry = &cache->entries[cache->count++];
+    entry->key = key;
+    entry->size = size;
+    entry->used = used;
+    cache->stats.bytes += size;
+    return 0;
+}
+
+static int isOlder(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Removes least recently used entries until the cache fits; call with the lock held
+static void evictEntries(ResultCache *cache)
+{
+    char path[PATH_MAX + 32];
+    while (cache->stats.bytes > cache->maxBytes && cache->count > 0)
+    {
+        int oldest = 0;
+        for (int i = 1; i < cache->count; i++)
+        {
+            if (isOlder(&cache->entries[i].used, &cache->entries[oldest].used))
+            {
+                oldest = i;
+            }
+        }
+        entryPath(cache, cache->entries[oldest].key, path, sizeof(path));
+        if (unlink(path) == -1 && errno != ENOENT)
+        {
+            perror(path);
+            break;
+        }
+        removeEntry(cache, oldest);
+        cache->stats.evictions++;
+    }
+}
+
+/* Opens the cache in dir, creating the directory if needed, and indexes
+ * the entries already there. maxBytes bounds the total size, 0 for
+ * CACHE_DEFAULT_MAX_BYTES. Returns NULL if the directory is unusable.
+ */
+ResultCache *openResultCache(const char *dir, uint64_t maxBytes)
+{
+    if (strlen(dir) >= PATH_MAX)
+    {
+        fprintf(stderr, "Cache path too long\n");
+        return NULL;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        perror(dir);
+        return NULL;
+    }
+    DIR *stream = opendir(dir);
+    if (stream == NULL)
+    {
+        perror(dir);
+        return NULL;
+    }
+    ResultCache *cache = (ResultCache *)calloc(1, sizeof(ResultCache));
+    if (cache == NULL)
+    {
+        closedir(stream);
+        return NULL;
+    }
+    strcpy(cache->dir, dir);
+    cache->maxBytes = maxBytes > 0 ? maxBytes : CACHE_DEFAULT_MAX_BYTES;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL)
+    {
+        unsigned long long key;
+        int length;
+        struct stat info;
+        if (sscanf(entry->d_name, "%16llx.bmp%n", &key, &length) == 1 && length == 20 &&
+            entry->d_name[length] == '\0' && fstatat(dirfd(stream), entry->d_name, &info, 0) == 0 &&
+            S_ISREG(info.st_mode))
+        {
+            addEntry(cache, key, (uint64_t)info.st_size, info.st_mtim);
+        }
+    }
+    closedir(stream);
+
+    pthread_mutex_lock(&cache->lock);
+    evictEntries(cache);
+    pthread_mutex_unlock(&cache->lock);
+    cache->stats.entries = cache->count;
+    return cache;
+}
+
+/* Returns 1 if the cache holds the result for key, else 0, counted as a
+ * miss.
+ */
+int hasCachedResult(ResultCache *cache, uint64_t key)
+{
+    pthread_mutex_lock(&cache->lock);
+    int found = findEntry(cache, key) >= 0;
+    cache->stats.misses += !found;
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+// Copies from to to: a reflink if the file system can, else in the kernel, else by hand
+static int copyFile(const char *from, const char *to)
+{
+    int source = open(from, O_RDONLY | O_CLOEXEC);
+    if (source == -1)
+    {
+        return -1;
+    }
+    int dest = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dest == -1)
+    {
+        perror(to);
+        close(source);
+        return -1;
+    }
+
+    int result = 0;
+    if (ioctl(dest, FICLONE, source) == -1)
+    {
+        ssize_t copied;
+        while ((copied = copy_file_range(source, NULL, dest, NULL, COPY_CHUNK, 0)) > 0)
+        {
+        }
+        if (copied == -1)
+        {
+            // Not supported across these file systems: start over with read / write
+            char *buffer = (char *)malloc(COPY_CHUNK);
+            ssize_t length = 0;
+            result = buffer != NULL && ftruncate(dest, 0) == 0 && lseek(source, 0, SEEK_SET) == 0 &&
+                             lseek(dest, 0, SEEK_SET) == 0
+                         ? 0
+                         : -1;
+            while (result == 0 && (length = read(source, buffer, COPY_CHUNK)) > 0)
+            {
+                result = write(dest, buffer, length) == length ? 0 : -1;
+            }
+            result = length == -1 ? -1 : result;
+            free(buffer);
+        }
+    }
+    close(source);
+    if (close(dest) == -1 || result != 0)
+    {
+        perror(to);
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes the cached result for key to output and marks it as just used.
+ * Returns 0 on a hit, -1 (counted as a miss) if the entry is gone or
+ * cannot be copied; the caller then filters the image itself.
+ */
+int fetchCachedResult(ResultCache *cache, uint64_t key, const char *output)
+{
+    char path[PATH_MAX + 32];
+    entryPath(cache, key, path, sizeof(path));
+    TRACE_BEGIN(span, "cache fetch");
+    int result = copyFile(path, output);
+    TRACE_END(span);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&cache->lock);
+    int index = findEntry(cache, key);
+    if (result == 0)
+    {
+        cache->stats.hits++;
+        utimensat(AT_FDCWD, path, NULL, 0);
+        if (index >= 0)
+        {
+            cache->entries[index].used = now;
+        }
+    }
+    else
+    {
+        cache->stats.misses++;
+        if (index >= 0)
+        {
+            removeEntry(cache, index); // Evicted by another process
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/* Adds output, the result just written for key, to the cache and evicts
+ * what no longer fits. Failures only cost the entry.
+ */
+void storeCachedResult(ResultCache *cache, uint64_t key, const char *output)
+{
+    char path[PATH_MAX + 32];
+    char temporary[PATH_MAX + 64];
+    struct stat info;
+    entryPath(cache, key, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s/.tmp.%d.%016llx", cache->dir, (int)getpid(),
+             (unsigned long long)key);
+    if (stat(output, &info) == -1 || !S_ISREG(info.st_mode) || (uint64_t)info.st_size > cache->maxBytes)
+    {
+        return;
+    }
+
+    TRACE_BEGIN(span, "cache store");
+    if (copyFile(output, temporary) != 0 || rename(temporary, path) == -1)
+    {
+        unlink(temporary);
+        TRACE_END(span);
+        return;
+    }
+    TRACE_END(span);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&cache->lock);
+    int index = findEntry(cache, key);
+    if (index >= 0)
+    {
+        removeEntry(cache, index);
+    }
+    if (addEntry(cache, key, (uint64_t)info.st_size, now) == 0)
+    {
+        cache->stats.stores++;
+    }
+    evictEntries(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void getResultCacheStats(ResultCache *cache, ResultCacheStats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    stats->entries = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void closeResultCache(ResultCache *cache)
+{
+    if (cache != NULL)
+    {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->entries);
+        free(cache);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk cache of filtered results, one BMP file per entry named after its
+ * key: the 64-bit xxHash (XXH64) of the whole input file, seeded with the
+ * hash of the filter parameters. A hit is answered by copying the entry to
+ * the output (a reflink where the file system shares blocks), without
+ * decoding or filtering anything. Entries are written to a temporary name
+ * and renamed, so a reader never sees half an entry. The total size is
+ * bounded: the least recently used entries, by modification time, which
+ * every hit refreshes, are removed first.
+ */
+#define CACHE_DEFAULT_MAX_BYTES (1024ull * 1024 * 1024)
+
+typedef struct ResultCache ResultCache;
+
+typedef struct ResultCacheStats
+{
+    int hits;
+    int misses;
+    int stores;
+    int evictions;
+    uint64_t bytes; // Size of every entry now in the cache
+    int entries;
+} ResultCacheStats;
+
+uint64_t hashBytes(const void *data, size_t length, uint64_t seed);
+int hashInputFile(const char *path, uint64_t seed, uint64_t *key);
+
+ResultCache *openResultCache(const char *dir, uint64_t maxBytes);
+int hasCachedResult(ResultCache *cache, uint64_t key);
+int fetchCachedResult(ResultCache *cache, uint64_t key, const char *output);
+void storeCachedResult(ResultCache *cache, uint64_t key, const char *output);
+void getResultCacheStats(ResultCache *cache, ResultCacheStats *stats);
+void closeResultCache(ResultCache *cache);
+
+#endif /* cache.h */
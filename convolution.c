@@ -0,0 +1,488 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convolution.h"
+#include "trace.h"
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVOLUTION_X86 1
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+typedef struct
+{
+    const KernelDescriptor *kernel;
+    BMP_Image *imageIn;
+    BMP_Image *imageOut;
+    Tile tile;
+} FilterThreadArgs;
+
+static ALWAYS_INLINE int clampByte(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static ALWAYS_INLINE int clampIndex(int index, int limit)
+{
+    return index < 0 ? 0 : (index >= limit ? limit - 1 : index);
+}
+
+static ALWAYS_INLINE int normaliseSum(const KernelDescriptor *kernel, int sum)
+{
+    return clampByte(sum / kernel->divisor + kernel->offset);
+}
+
+/*
+ * Scalar kernels. size and combine are compile-time constants in every
+ * wrapper below, so each one gets its own fully unrolled tap loop.
+ */
+static ALWAYS_INLINE int tapSumInt(const int *weights, const uint8_t *const *rows, int b, int step, int size)
+{
+    int radius = size / 2;
+    int sum = 0;
+    for (int ky = 0; ky < size; ky++)
+    {
+        for (int kx = 0; kx < size; kx++)
+        {
+            sum += weights[ky * size + kx] * rows[ky][b + step * (kx - radius)];
+        }
+    }
+    return sum;
+}
+
+static ALWAYS_INLINE float tapSumFloat(const float *weights, const uint8_t *const *rows, int b, int step,
+                                         int size)
+{
+    int radius = size / 2;
+    float sum = 0;
+    for (int ky = 0; ky < size; ky++)
+    {
+        for (int kx = 0; kx < size; kx++)
+        {
+            sum += rows[ky][b + step * (kx - radius)] * weights[ky * size + kx];
+        }
+    }
+    return sum;
+}
+
+static ALWAYS_INLINE void convolveBytesInt(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out,
+                                           int lo, int hi, int step, int size, KernelCombine combine)
+{
+    for (int b = lo; b < hi; b++)
+    {
+        int sum = tapSumInt(kernel->weights[0], rows, b, step, size);
+        if (combine == COMBINE_MAGNITUDE)
+        {
+            int sumY = tapSumInt(kernel->weights[1], rows, b, step, size);
+            sum = (int)sqrt((double)sum * sum + (double)sumY * sumY);
+        }
+        out[b] = (uint8_t)normaliseSum(kernel, sum);
+    }
+}
+
+static ALWAYS_INLINE void convolveBytesFloat(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out,
+                                             int lo, int hi, int step, int size, KernelCombine combine)
+{
+    for (int b = lo; b < hi; b++)
+    {
+        double sum = tapSumFloat(kernel->floatWeights[0], rows, b, step, size);
+        if (combine == COMBINE_MAGNITUDE)
+        {
+            double sumY = tapSumFloat(kernel->floatWeights[1], rows, b, step, size);
+            sum = sqrt(sum * sum + sumY * sumY);
+        }
+        out[b] = (uint8_t)normaliseSum(kernel, (int)sum);
+    }
+}
+
+#define DEFINE_ROW_FUNCTION(NAME, BODY, SIZE, COMBINE)                                                     \
+    static void NAME(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out, int lo, int hi, \
+                     int step)                                                                             \
+    {                                                                                                      \
+        BODY(kernel, rows, out, lo, hi, step, SIZE, COMBINE);                                              \
+    }
+
+DEFINE_ROW_FUNCTION(convolveRowInt3, convolveBytesInt, 3, COMBINE_SINGLE)
+DEFINE_ROW_FUNCTION(convolveRowInt5, convolveBytesInt, 5, COMBINE_SINGLE)
+DEFINE_ROW_FUNCTION(magnitudeRowInt3, convolveBytesInt, 3, COMBINE_MAGNITUDE)
+DEFINE_ROW_FUNCTION(magnitudeRowInt5, convolveBytesInt, 5, COMBINE_MAGNITUDE)
+DEFINE_ROW_FUNCTION(convolveRowFloat3, convolveBytesFloat, 3, COMBINE_SINGLE)
+DEFINE_ROW_FUNCTION(convolveRowFloat5, convolveBytesFloat, 5, COMBINE_SINGLE)
+DEFINE_ROW_FUNCTION(magnitudeRowFloat3, convolveBytesFloat, 3, COMBINE_MAGNITUDE)
+DEFINE_ROW_FUNCTION(magnitudeRowFloat5, convolveBytesFloat, 5, COMBINE_MAGNITUDE)
+
+#ifdef CONVOLUTION_X86
+/*
+ * AVX2 kernels for integer weights with a power-of-two divisor: 8 bytes per
+ * step in 32-bit lanes, so no kernel can overflow. Results are identical to
+ * the scalar ones: the shift is corrected to truncate toward zero, the
+ * magnitude uses a double sqrt, and the saturating packs do the clamp.
+ */
+__attribute__((target("avx2"))) static ALWAYS_INLINE __m256i tapSumAVX2(const int *weights, const uint8_t *const *rows,
+                                                                        int b, int step, int size)
+{
+    int radius = size / 2;
+    __m256i sum = _mm256_setzero_si256();
+    for (int ky = 0; ky < size; ky++)
+    {
+        for (int kx = 0; kx < size; kx++)
+        {
+            int weight = weights[ky * size + kx];
+            if (weight == 0)
+            {
+                continue;
+            }
+            __m128i bytes = _mm_loadl_epi64((const __m128i *)(rows[ky] + b + step * (kx - radius)));
+            sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(bytes), _mm256_set1_epi32(weight)));
+        }
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE __m256i magnitudeAVX2(__m256i sumX, __m256i sumY)
+{
+    __m256d lo = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sumX)),
+                                             _mm256_cvtepi32_pd(_mm256_castsi256_si128(sumX))),
+                               _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sumY)),
+                                             _mm256_cvtepi32_pd(_mm256_castsi256_si128(sumY))));
+    __m256d hi = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sumX, 1)),
+                                             _mm256_cvtepi32_pd(_mm256_extracti128_si256(sumX, 1))),
+                               _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sumY, 1)),
+                                             _mm256_cvtepi32_pd(_mm256_extracti128_si256(sumY, 1))));
+    __m128i rootLo = _mm256_cvttpd_epi32(_mm256_sqrt_pd(lo));
+    __m128i rootHi = _mm256_cvttpd_epi32(_mm256_sqrt_pd(hi));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(rootLo), rootHi, 1);
+}
+
+__attribute__((target("avx2"))) static ALWAYS_INLINE void convolveBytesAVX2(const KernelDescriptor *kernel,
+                                                                            const uint8_t *const *rows, uint8_t *out,
+                                                                            int lo, int hi, int step, int size,
+                                                                            KernelCombine combine)
+{
+    int shift = __builtin_ctz((unsigned)kernel->divisor);
+    __m256i roundMask = _mm256_set1_epi32(kernel->divisor - 1);
+    __m256i offset = _mm256_set1_epi32(kernel->offset);
+    __m256i lanes = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    int b = lo;
+    for (; b + 8 <= hi; b += 8)
+    {
+        __m256i sum = tapSumAVX2(kernel->weights[0], rows, b, step, size);
+        if (combine == COMBINE_MAGNITUDE)
+        {
+            sum = magnitudeAVX2(sum, tapSumAVX2(kernel->weights[1], rows, b, step, size));
+        }
+        sum = _mm256_add_epi32(sum, _mm256_and_si256(_mm256_srai_epi32(sum, 31), roundMask));
+        sum = _mm256_add_epi32(_mm256_srai_epi32(sum, shift), offset);
+        __m256i packed = _mm256_packs_epi32(sum, sum);
+        packed = _mm256_packus_epi16(packed, packed);
+        packed = _mm256_permutevar8x32_epi32(packed, lanes);
+        _mm_storel_epi64((__m128i *)(out + b), _mm256_castsi256_si128(packed));
+    }
+    convolveBytesInt(kernel, rows, out, b, hi, step, size, combine);
+}
+
+#define DEFINE_AVX2_ROW_FUNCTION(NAME, SIZE, COMBINE)                                                      \
+    __attribute__((target("avx2"))) static void NAME(const KernelDescriptor *kernel,                       \
+                                                     const uint8_t *const *rows, uint8_t *out, int lo, int hi, \
+                                                     int step)                                             \
+    {                                                                                                      \
+        convolveBytesAVX2(kernel, rows, out, lo, hi, step, SIZE, COMBINE);                                 \
+    }
+
+DEFINE_AVX2_ROW_FUNCTION(convolveRowInt3AVX2, 3, COMBINE_SINGLE)
+DEFINE_AVX2_ROW_FUNCTION(convolveRowInt5AVX2, 5, COMBINE_SINGLE)
+DEFINE_AVX2_ROW_FUNCTION(magnitudeRowInt3AVX2, 3, COMBINE_MAGNITUDE)
+DEFINE_AVX2_ROW_FUNCTION(magnitudeRowInt5AVX2, 5, COMBINE_MAGNITUDE)
+#endif
+
+// Hand-tuned 3x3 kernels from kernels.c
+static void binomialRow(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out, int lo, int hi,
+                        int step)
+{
+    (void)kernel;
+    blurRowBytes(rows[0], rows[1], rows[2], out, lo, hi, step);
+}
+
+static void prewittRow(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out, int lo, int hi,
+                       int step)
+{
+    (void)kernel;
+    edgeRowBytes(rows[0], rows[1], rows[2], out, lo, hi, step);
+}
+
+static const int binomial3[9] = {1, 2, 1, 2, 4, 2, 1, 2, 1};
+static const int prewittX3[9] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
+static const int prewittY3[9] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+
+/* Checks kernel and picks its row function. Returns 0 on success, -1 if the
+ * size or the divisor is not supported.
+ */
+int prepareKernel(KernelDescriptor *kernel)
+{
+    if ((kernel->size != 3 && kernel->size != 5) || kernel->divisor == 0)
+    {
+        fprintf(stderr, "Unsupported kernel %s\n", kernel->name != NULL ? kernel->name : "(unnamed)");
+        return -1;
+    }
+
+    int size = kernel->size;
+    int magnitude = kernel->combine == COMBINE_MAGNITUDE;
+    size_t taps = size * size * sizeof(int);
+
+    if (kernel->weightType == KERNEL_FLOAT)
+    {
+        kernel->rowFunction = size == 3 ? (magnitude ? magnitudeRowFloat3 : convolveRowFloat3)
+                                        : (magnitude ? magnitudeRowFloat5 : convolveRowFloat5);
+        return 0;
+    }
+
+    if (size == 3 && !magnitude && kernel->divisor == 16 && kernel->offset == 0 &&
+        memcmp(kernel->weights[0], binomial3, taps) == 0)
+    {
+        kernel->rowFunction = binomialRow;
+        return 0;
+    }
+    if (size == 3 && magnitude && kernel->divisor == 1 && kernel->offset == 0 &&
+        memcmp(kernel->weights[0], prewittX3, taps) == 0 && memcmp(kernel->weights[1], prewittY3, taps) == 0)
+    {
+        kernel->rowFunction = prewittRow;
+        return 0;
+    }
+
+    kernel->rowFunction = size == 3 ? (magnitude ? magnitudeRowInt3 : convolveRowInt3)
+                                    : (magnitude ? magnitudeRowInt5 : convolveRowInt5);
+#ifdef CONVOLUTION_X86
+    int powerOfTwo = kernel->divisor > 0 && (kernel->divisor & (kernel->divisor - 1)) == 0;
+    if (powerOfTwo && getKernelISALevel() >= KERNEL_ISA_AVX2)
+    {
+        kernel->rowFunction = size == 3 ? (magnitude ? magnitudeRowInt3AVX2 : convolveRowInt3AVX2)
+                                        : (magnitude ? magnitudeRowInt5AVX2 : convolveRowInt5AVX2);
+    }
+#endif
+    return 0;
+}
+
+// Built-in kernels, looked up by name with findKernel
+static KernelDescriptor builtinKernels[] = {
+    {.name = "blur", .size = 3, .weightType = KERNEL_INT, .combine = COMBINE_SINGLE, .border = BORDER_BLACK,
+     .weights = {{1, 2, 1, 2, 4, 2, 1, 2, 1}}, .divisor = 16},
+    {.name = "edge", .size = 3, .weightType = KERNEL_INT, .combine = COMBINE_MAGNITUDE, .border = BORDER_BLACK,
+     .weights = {{-1, 0, 1, -1, 0, 1, -1, 0, 1}, {-1, -1, -1, 0, 0, 0, 1, 1, 1}}, .divisor = 1},
+    {.name = "box", .size = 3, .weightType = KERNEL_FLOAT, .combine = COMBINE_SINGLE, .border = BORDER_REPLICATE,
+     .floatWeights = {{1 / 9.0f, 1 / 9.0f, 1 / 9.0f, 1 / 9.0f, 1 / 9.0f, 1 / 9.0f, 1 / 9.0f, 1 / 9.0f, 1 / 9.0f}},
+     .divisor = 1},
+    {.name = "sharpen", .size = 3, .weightType = KERNEL_INT, .combine = COMBINE_SINGLE, .border = BORDER_REPLICATE,
+     .weights = {{0, -1, 0, -1, 5, -1, 0, -1, 0}}, .divisor = 1},
+    {.name = "emboss", .size = 3, .weightType = KERNEL_INT, .combine = COMBINE_SINGLE, .border = BORDER_REPLICATE,
+     .weights = {{-2, -1, 0, -1, 1, 1, 0, 1, 2}}, .divisor = 1},
+    {.name = "gauss5", .size = 5, .weightType = KERNEL_INT, .combine = COMBINE_SINGLE, .border = BORDER_REPLICATE,
+     .weights = {{1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1}}, .divisor = 256},
+    {.name = "sobel", .size = 3, .weightType = KERNEL_INT, .combine = COMBINE_MAGNITUDE, .border = BORDER_BLACK,
+     .weights = {{-1, 0, 1, -2, 0, 2, -1, 0, 1}, {-1, -2, -1, 0, 0, 0, 1, 2, 1}}, .divisor = 1},
+    {.name = "scharr", .size = 3, .weightType = KERNEL_INT, .combine = COMBINE_MAGNITUDE, .border = BORDER_BLACK,
+     .weights = {{-3, 0, 3, -10, 0, 10, -3, 0, 3}, {-3, -10, -3, 0, 0, 0, 3, 10, 3}}, .divisor = 1},
+};
+
+#define NUM_BUILTIN_KERNELS ((int)(sizeof(builtinKernels) / sizeof(builtinKernels[0])))
+
+static pthread_once_t builtinOnce = PTHREAD_ONCE_INIT;
+static char kernelNames[256];
+
+static void prepareBuiltinKernels(void)
+{
+    for (int i = 0; i < NUM_BUILTIN_KERNELS; i++)
+    {
+        prepareKernel(&builtinKernels[i]);
+        strcat(kernelNames, i == 0 ? "" : ", ");
+        strcat(kernelNames, builtinKernels[i].name);
+    }
+}
+
+/* Returns the prepared built-in kernel called name, NULL if there is none.
+ */
+const KernelDescriptor *findKernel(const char *name)
+{
+    pthread_once(&builtinOnce, prepareBuiltinKernels);
+    for (int i = 0; i < NUM_BUILTIN_KERNELS; i++)
+    {
+        if (strcmp(builtinKernels[i].name, name) == 0)
+        {
+            return &builtinKernels[i];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the names of the built-in kernels, comma separated.
+ */
+const char *listKernels(void)
+{
+    pthread_once(&builtinOnce, prepareBuiltinKernels);
+    return kernelNames;
+}
+
+// One output pixel with the neighbourhood clamped to the image (BORDER_REPLICATE)
+static void convolvePixelReplicate(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out,
+                                   int x, int width, int step)
+{
+    int radius = kernel->size / 2;
+    for (int channel = 0; channel < step; channel++)
+    {
+        double sum[2] = {0, 0};
+        int masks = kernel->combine == COMBINE_MAGNITUDE ? 2 : 1;
+        for (int m = 0; m < masks; m++)
+        {
+            int intSum = 0;
+            float floatSum = 0;
+            for (int ky = 0; ky < kernel->size; ky++)
+            {
+                for (int kx = 0; kx < kernel->size; kx++)
+                {
+                    int tap = ky * kernel->size + kx;
+                    int value = rows[ky][step * clampIndex(x + kx - radius, width) + channel];
+                    intSum += kernel->weights[m][tap] * value;
+                    floatSum += value * kernel->floatWeights[m][tap];
+                }
+            }
+            sum[m] = kernel->weightType == KERNEL_INT ? intSum : floatSum;
+        }
+        double result = masks == 2 ? sqrt(sum[0] * sum[0] + sum[1] * sum[1]) : sum[0];
+        out[step * x + channel] = (uint8_t)normaliseSum(kernel, (int)result);
+    }
+}
+
+static void convolveBorderPixel(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out,
+                                int x, int width, int step)
+{
+    if (kernel->border == BORDER_BLACK)
+    {
+        memset(out + step * x, 0, step);
+    }
+    else
+    {
+        convolvePixelReplicate(kernel, rows, out, x, width, step);
+    }
+}
+
+// BGRA rows keep the alpha of the centre input pixel: only colour is filtered
+static void copyAlpha(const uint8_t *row, uint8_t *out, int startCol, int endCol)
+{
+    for (int x = startCol; x < endCol; x++)
+    {
+        out[4 * x + 3] = row[4 * x + 3];
+    }
+}
+
+/* Computes pixels [startCol, endCol) of row y of an image width x height
+ * into out. rows[0..size-1] are the input rows y - size / 2 .. y + size / 2,
+ * already clamped to the image, with bytesPerPixel 3 (BGR) or 4 (BGRA).
+ * Interior pixels go through the kernel's row function; the border follows
+ * the kernel's border policy.
+ */
+void convolveRow(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out,
+                 int y, int width, int height, int startCol, int endCol, int bytesPerPixel)
+{
+    int radius = kernel->size / 2;
+    int step = bytesPerPixel;
+    if (kernel->border == BORDER_BLACK && (y < radius || y >= height - radius))
+    {
+        memset(out + step * startCol, 0, step * (endCol - startCol));
+        if (step == 4)
+        {
+            copyAlpha(rows[radius], out, startCol, endCol);
+        }
+        return;
+    }
+
+    // Columns [interiorStart, interiorEnd) have their whole neighbourhood inside the image
+    int interiorStart = startCol > radius ? startCol : radius;
+    int interiorEnd = endCol < width - radius ? endCol : width - radius;
+    int rightStart = interiorStart > width - radius ? interiorStart : width - radius;
+
+    for (int x = startCol; x < endCol && x < radius; x++)
+    {
+        convolveBorderPixel(kernel, rows, out, x, width, step);
+    }
+    for (int x = rightStart; x < endCol; x++)
+    {
+        convolveBorderPixel(kernel, rows, out, x, width, step);
+    }
+    if (interiorStart < interiorEnd)
+    {
+        kernel->rowFunction(kernel, rows, out, step * interiorStart, step * interiorEnd, step);
+    }
+    if (step == 4)
+    {
+        copyAlpha(rows[radius], out, startCol, endCol);
+    }
+}
+
+/* Applies kernel to the tile of imageIn and stores the result in the same
+ * tile of imageOut.
+ */
+void convolveTile(const KernelDescriptor *kernel, BMP_Image *imageIn, BMP_Image *imageOut, const Tile *tile)
+{
+    int width = imageIn->header.width_px;
+    int height = imageIn->norm_height;
+    int radius = kernel->size / 2;
+    const uint8_t *rows[MAX_KERNEL_SIZE];
+
+    for (int y = tile->startRow; y < tile->endRow; y++)
+    {
+        for (int ky = 0; ky < kernel->size; ky++)
+        {
+            rows[ky] = (const uint8_t *)imageIn->pixels[clampIndex(y + ky - radius, height)];
+        }
+        convolveRow(kernel, rows, (uint8_t *)imageOut->pixels[y], y, width, height, tile->startCol, tile->endCol,
+                    imageIn->bytes_per_pixel);
+    }
+}
+
+// Pool task: one tile of one filter
+static void *convolutionThreadWorker(void *args)
+{
+    FilterThreadArgs *threadArgs = (FilterThreadArgs *)args;
+    TRACE_BEGIN(span, threadArgs->kernel->name);
+    convolveTile(threadArgs->kernel, threadArgs->imageIn, threadArgs->imageOut, &threadArgs->tile);
+    TRACE_END(span);
+    return NULL;
+}
+
+/* Applies kernel to rows [startRow, endRow) of imageIn, writing imageOut.
+ * The rows are cut into tiles that the pool's workers share and steal.
+ * Returns 0, or -1 if memory runs out and nothing is written.
+ */
+int applyParallelFilter(ThreadPool *pool, const KernelDescriptor *kernel, BMP_Image *imageIn, BMP_Image *imageOut,
+                        int startRow, int endRow)
+{
+    Tile *tiles;
+    int numTiles = splitIntoTiles(pool, startRow, endRow, imageIn->header.width_px, imageIn->bytes_per_pixel, &tiles);
+    FilterThreadArgs *threadArgs = (FilterThreadArgs *)malloc(numTiles * sizeof(FilterThreadArgs));
+    if (numTiles < 0 || (numTiles > 0 && threadArgs == NULL))
+    {
+        printError(MEMORY_ERROR);
+        free(tiles);
+        free(threadArgs);
+        return -1;
+    }
+
+    for (int i = 0; i < numTiles; i++)
+    {
+        threadArgs[i].kernel = kernel;
+        threadArgs[i].imageIn = imageIn;
+        threadArgs[i].imageOut = imageOut;
+        threadArgs[i].tile = tiles[i];
+    }
+
+    submitTaskBatch(pool, convolutionThreadWorker, threadArgs, sizeof(FilterThreadArgs), numTiles);
+    waitThreadPool(pool);
+    free(threadArgs);
+    free(tiles);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef _CONVOLUTION_H_
+#define _CONVOLUTION_H_
+#include <stdint.h>
+#include "bmp.h"
+#include "threadpool.h"
+
+/*
+ * Kernel descriptors for the filter engine. A descriptor gives the kernel
+ * size, its integer or float weights, how the sum is normalised, whether one
+ * mask is applied or the magnitude of two, and what happens at the border:
+ *
+ *   out = clamp(sum / divisor + offset)                       COMBINE_SINGLE
+ *   out = clamp((int)sqrt(sumX^2 + sumY^2) / divisor + offset) COMBINE_MAGNITUDE
+ *
+ * The division truncates toward zero. prepareKernel checks a descriptor and
+ * picks the fastest row function for it: a hand-tuned SIMD kernel for the
+ * binomial blur and Prewitt, otherwise code specialised for the kernel size.
+ */
+#define MAX_KERNEL_SIZE 5
+
+typedef enum
+{
+    KERNEL_INT,
+    KERNEL_FLOAT
+} KernelWeights;
+
+typedef enum
+{
+    COMBINE_SINGLE,
+    COMBINE_MAGNITUDE
+} KernelCombine;
+
+typedef enum
+{
+    BORDER_BLACK,    // Pixels closer than size / 2 to the edge are set to 0
+    BORDER_REPLICATE // Pixels outside the image repeat the nearest edge pixel
+} BorderPolicy;
+
+struct KernelDescriptor;
+
+// Computes output bytes [lo, hi) of a row; rows[0..size-1] are centred on it
+// and the same channel of the next pixel is step bytes further
+typedef void (*KernelRowFunction)(const struct KernelDescriptor *kernel, const uint8_t *const *rows,
+                                  uint8_t *out, int lo, int hi, int step);
+
+typedef struct KernelDescriptor
+{
+    const char *name;
+    int size; // 3 or 5
+    KernelWeights weightType;
+    KernelCombine combine;
+    BorderPolicy border;
+    int weights[2][MAX_KERNEL_SIZE * MAX_KERNEL_SIZE];        // Row-major; [1] only for COMBINE_MAGNITUDE
+    float floatWeights[2][MAX_KERNEL_SIZE * MAX_KERNEL_SIZE]; // Same, for KERNEL_FLOAT
+    int divisor;
+    int offset;
+    KernelRowFunction rowFunction; // Set by prepareKernel
+} KernelDescriptor;
+
+int prepareKernel(KernelDescriptor *kernel);
+const KernelDescriptor *findKernel(const char *name);
+const char *listKernels(void);
+void convolveRow(const KernelDescriptor *kernel, const uint8_t *const *rows, uint8_t *out,
+                 int y, int width, int height, int startCol, int endCol, int bytesPerPixel);
+void convolveTile(const KernelDescriptor *kernel, BMP_Image *imageIn, BMP_Image *imageOut, const Tile *tile);
+int applyParallelFilter(ThreadPool *pool, const KernelDescriptor *kernel, BMP_Image *imageIn, BMP_Image *imageOut,
+                        int startRow, int endRow);
+
+#endif /* convolution.h */
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "batch.h"
+#include "trace.h"
+
+#define DAEMON_MAGIC 0x44375845u // "EX7D"
+#define DAEMON_RING_MASK (DAEMON_JOB_SLOTS - 1)
+#define DAEMON_POLL_SECONDS 1 // Liveness checks while waiting
+
+struct DaemonClient
+{
+    DaemonSegment *segment;
+};
+
+static volatile sig_atomic_t stopSignal = 0;
+
+static void handleStopSignal(int signal)
+{
+    (void)signal;
+    stopSignal = 1;
+}
+
+// Blocks while *word == expected, at most DAEMON_POLL_SECONDS. Returns 0 or -1 (errno set)
+static int futexWait(_Atomic uint32_t *word, uint32_t expected)
+{
+    struct timespec timeout = {DAEMON_POLL_SECONDS, 0};
+    return (int)syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+static void futexWake(_Atomic uint32_t *word, int count)
+{
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static int isProcessAlive(pid_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+static int segmentName(const char *name, char *buffer, size_t size)
+{
+    if (name[0] == '\0' || strchr(name, '/') != NULL || snprintf(buffer, size, "/ex7.%s", name) >= (int)size)
+    {
+        fprintf(stderr, "Invalid daemon name '%s'\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// Ring cells carry a sequence number: cell i is free for the push at position
+// p when its sequence is p, and holds the job for the pop at p when it is p + 1
+static int pushJob(DaemonSegment *segment, uint32_t job)
+{
+    uint64_t pos = atomic_load_explicit(&segment->enqueuePos, memory_order_relaxed);
+    DaemonRingCell *cell;
+    for (;;)
+    {
+        cell = &segment->ring[pos & DAEMON_RING_MASK];
+        uint64_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&segment->enqueuePos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return -1; // Full
+        }
+        else
+        {
+            pos = atomic_load_explicit(&segment->enqueuePos, memory_order_relaxed);
+        }
+    }
+    cell->job = job;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+static int popJob(DaemonSegment *segment)
+{
+    uint64_t pos = atomic_load_explicit(&segment->dequeuePos, memory_order_relaxed);
+    DaemonRingCell *cell;
+    for (;;)
+    {
+        cell = &segment->ring[pos & DAEMON_RING_MASK];
+        uint64_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)(sequence - (pos + 1));
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&segment->dequeuePos, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return -1; // Empty
+        }
+        else
+        {
+            pos = atomic_load_explicit(&segment->dequeuePos, memory_order_relaxed);
+        }
+    }
+    int job = (int)cell->job;
+    atomic_store_explicit(&cell->sequence, pos + DAEMON_JOB_SLOTS, memory_order_release);
+    return job;
+}
+
+static void finishJob(DaemonJob *job, int result)
+{
+    job->result = result;
+    atomic_store_explicit(&job->state, DAEMON_JOB_DONE, memory_order_release);
+    futexWake(&job->state, INT_MAX);
+}
+
+// Frees the slots of clients that died before collecting or queueing them
+static void sweepDeadClients(DaemonSegment *segment)
+{
+    for (int i = 0; i < DAEMON_JOB_SLOTS; i++)
+    {
+        DaemonJob *job = &segment->jobs[i];
+        uint32_t state = atomic_load(&job->state);
+        if ((state == DAEMON_JOB_CLAIMED || state == DAEMON_JOB_DONE) && job->owner > 0 &&
+            !isProcessAlive(job->owner))
+        {
+            job->owner = 0;
+            atomic_compare_exchange_strong(&job->state, &state, DAEMON_JOB_FREE);
+        }
+    }
+}
+
+static int runJob(ThreadPool *pool, SharedImage *shared, DaemonJob *job)
+{
+    FilterChain chain = {.numStages = 0};
+    if (job->filters[0] != '\0' && parseFilterChain(job->filters, &chain) != 0)
+    {
+        return -1;
+    }
+
+    BMP_Image *image = loadInputImage(job->input);
+    if (image == NULL)
+    {
+        return -1;
+    }
+    int result = filterImageToFile(pool, shared, &chain, image, job->output);
+    freeImage(image);
+    return result;
+}
+
+// Creates the segment, replacing one left behind by a daemon that died
+static DaemonSegment *createSegment(const char *path)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd != -1)
+        {
+            DaemonSegment *segment = NULL;
+            if (ftruncate(fd, sizeof(DaemonSegment)) == 0)
+            {
+                segment = (DaemonSegment *)mmap(NULL, sizeof(DaemonSegment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                fd, 0);
+            }
+            close(fd);
+            if (segment == NULL || segment == MAP_FAILED)
+            {
+                perror(path);
+                shm_unlink(path);
+                return NULL;
+            }
+            return segment;
+        }
+        if (errno != EEXIST)
+        {
+            perror(path);
+            return NULL;
+        }
+
+        DaemonClient *existing = connectDaemon(path + strlen("/ex7."));
+        if (existing != NULL)
+        {
+            fprintf(stderr, "A daemon named '%s' is already running (pid %d)\n", path + strlen("/ex7."),
+                    (int)existing->segment->daemonPid);
+            disconnectDaemon(existing);
+            return NULL;
+        }
+        shm_unlink(path);
+    }
+    return NULL;
+}
+
+/* Serves jobs from /ex7.<name> with a pool of numThreads workers until a
+ * DAEMON_STOP job, SIGINT or SIGTERM. Returns the process exit status.
+ */
+int runFilterDaemon(const char *name, int numThreads)
+{
+    char path[NAME_MAX];
+    if (segmentName(name, path, sizeof(path)) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    ThreadPool *pool = createThreadPool(numThreads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating thread pool\n");
+        return EXIT_FAILURE;
+    }
+
+    DaemonSegment *segment = createSegment(path);
+    if (segment == NULL)
+    {
+        destroyThreadPool(pool);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < DAEMON_JOB_SLOTS; i++)
+    {
+        atomic_init(&segment->ring[i].sequence, i);
+    }
+    segment->daemonPid = getpid();
+    atomic_store_explicit(&segment->magic, DAEMON_MAGIC, memory_order_release);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Filter daemon '%s' ready (pid %d, %d threads)\n", name, (int)getpid(), numThreads);
+    fflush(stdout);
+
+    SharedImage shared = SHARED_IMAGE_INIT;
+    int stopping = 0;
+    while (!stopping && !stopSignal)
+    {
+        uint32_t bell = atomic_load_explicit(&segment->doorbell, memory_order_acquire);
+        int index = popJob(segment);
+        if (index < 0)
+        {
+            if (futexWait(&segment->doorbell, bell) == -1 && errno == ETIMEDOUT)
+            {
+                sweepDeadClients(segment);
+            }
+            continue;
+        }
+
+        DaemonJob *job = &segment->jobs[index];
+        atomic_store(&job->state, DAEMON_JOB_RUNNING);
+        if (job->type == DAEMON_STOP)
+        {
+            stopping = 1;
+            finishJob(job, 0);
+            continue;
+        }
+        TRACE_BEGIN(span, "daemon job");
+        int result = runJob(pool, &shared, job);
+        TRACE_END(span);
+        printf("%s -> %s: %s\n", job->input, job->output, result == 0 ? "done" : "failed");
+        fflush(stdout);
+        finishJob(job, result);
+    }
+
+    // Refuse new clients, then fail whatever is still queued
+    atomic_store(&segment->magic, 0);
+    shm_unlink(path);
+    for (int index = popJob(segment); index >= 0; index = popJob(segment))
+    {
+        finishJob(&segment->jobs[index], -1);
+    }
+
+    munmap(segment, sizeof(DaemonSegment));
+    destroyThreadPool(pool);
+    releaseSharedImage(&shared);
+    printf("Filter daemon '%s' stopped\n", name);
+    return EXIT_SUCCESS;
+}
+
+/* Attaches to the daemon called name. Returns NULL if it is not running.
+ */
+DaemonClient *connectDaemon(const char *name)
+{
+    char path[NAME_MAX];
+    if (segmentName(name, path, sizeof(path)) != 0)
+    {
+        return NULL;
+    }
+
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    struct stat info;
+    DaemonSegment *segment = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size == sizeof(DaemonSegment))
+    {
+        segment = (DaemonSegment *)mmap(NULL, sizeof(DaemonSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (segment == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (atomic_load_explicit(&segment->magic, memory_order_acquire) != DAEMON_MAGIC ||
+        !isProcessAlive(segment->daemonPid))
+    {
+        munmap(segment, sizeof(DaemonSegment));
+        return NULL;
+    }
+
+    DaemonClient *client = (DaemonClient *)malloc(sizeof(DaemonClient));
+    if (client == NULL)
+    {
+        printError(MEMORY_ERROR);
+        munmap(segment, sizeof(DaemonSegment));
+        return NULL;
+    }
+    client->segment = segment;
+    return client;
+}
+
+/* Queues a job and returns its slot, to be passed to waitDaemonJob.
+ * Returns -1 with errno EAGAIN when every slot is in use, or another errno
+ * when the job cannot be described (paths or filter list too long).
+ */
+int submitDaemonJob(DaemonClient *client, int type, const char *filters, const char *input, const char *output)
+{
+    DaemonSegment *segment = client->segment;
+    if (strlen(filters) >= DAEMON_FILTER_BYTES || strlen(input) >= DAEMON_PATH_BYTES ||
+        strlen(output) >= DAEMON_PATH_BYTES)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (int index = 0; index < DAEMON_JOB_SLOTS; index++)
+    {
+        DaemonJob *job = &segment->jobs[index];
+        uint32_t expected = DAEMON_JOB_FREE;
+        if (!atomic_compare_exchange_strong(&job->state, &expected, DAEMON_JOB_CLAIMED))
+        {
+            continue;
+        }
+
+        job->owner = getpid();
+        job->type = type;
+        job->result = -1;
+        strcpy(job->filters, filters);
+        strcpy(job->input, input);
+        strcpy(job->output, output);
+        atomic_store_explicit(&job->state, DAEMON_JOB_QUEUED, memory_order_release);
+
+        // There are as many ring cells as slots, so the push always fits
+        pushJob(segment, (uint32_t)index);
+        atomic_fetch_add_explicit(&segment->doorbell, 1, memory_order_release);
+        futexWake(&segment->doorbell, 1);
+        return index;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Waits for the job in slot index and frees the slot.
+ * Returns the job result: 0 on success, -1 on failure or if the daemon died.
+ */
+int waitDaemonJob(DaemonClient *client, int index)
+{
+    DaemonSegment *segment = client->segment;
+    DaemonJob *job = &segment->jobs[index];
+    TRACE_BEGIN(span, "job wait");
+
+    for (;;)
+    {
+        uint32_t state = atomic_load_explicit(&job->state, memory_order_acquire);
+        if (state == DAEMON_JOB_DONE)
+        {
+            TRACE_END(span);
+            int result = job->result;
+            job->owner = 0;
+            atomic_store_explicit(&job->state, DAEMON_JOB_FREE, memory_order_release);
+            return result;
+        }
+        if (futexWait(&job->state, state) == -1 && errno == ETIMEDOUT && !isProcessAlive(segment->daemonPid))
+        {
+            fprintf(stderr, "The filter daemon exited\n");
+            return -1;
+        }
+    }
+}
+
+void disconnectDaemon(DaemonClient *client)
+{
+    if (client != NULL)
+    {
+        munmap(client->segment, sizeof(DaemonSegment));
+        free(client);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Resident filter daemon. The daemon owns a POSIX shared memory segment
+ * (/ex7.<name>) holding a table of job slots and a bounded lock-free ring of
+ * queued slot indices:
+ *   --------------------------
+ *   |   header + doorbell    |
+ *   |-------------------------
+ *   |  ring[DAEMON_JOB_SLOTS]|   sequence-numbered cells, any number of
+ *   |-------------------------   producers and consumers
+ *   |  jobs[DAEMON_JOB_SLOTS]|   paths, filters, state word, result
+ *   --------------------------
+ * A client claims a free slot, fills it in and pushes its index; the daemon
+ * pops it, runs it through its thread pool and publishes the result in the
+ * slot's state word, which the client waits on with a futex. No IPC object
+ * is created per image, and the segment is unlinked when the daemon exits.
+ */
+#define DAEMON_JOB_SLOTS 64 // Power of two
+#define DAEMON_PATH_BYTES 1024
+#define DAEMON_FILTER_BYTES 128
+
+enum
+{
+    DAEMON_JOB_FREE,    // Slot available to any client
+    DAEMON_JOB_CLAIMED, // Being filled in by its owner
+    DAEMON_JOB_QUEUED,  // Index pushed to the ring
+    DAEMON_JOB_RUNNING, // Taken by the daemon
+    DAEMON_JOB_DONE     // result is valid, the owner frees the slot
+};
+
+enum
+{
+    DAEMON_FILTER_IMAGE, // Filter input into output
+    DAEMON_STOP          // Ask the daemon to exit
+};
+
+typedef struct DaemonJob
+{
+    _Atomic uint32_t state; // DAEMON_JOB_*, futex word
+    int32_t result;         // 0 on success, -1 on failure
+    pid_t owner;
+    int32_t type;
+    char filters[DAEMON_FILTER_BYTES]; // Kernel list, empty for ex7's default filters
+    char input[DAEMON_PATH_BYTES];     // Absolute paths
+    char output[DAEMON_PATH_BYTES];
+} DaemonJob;
+
+typedef struct DaemonRingCell
+{
+    _Atomic uint64_t sequence;
+    uint32_t job;
+} DaemonRingCell;
+
+typedef struct DaemonSegment
+{
+    _Atomic uint32_t magic; // Set last, once the segment is ready
+    pid_t daemonPid;
+    _Atomic uint32_t doorbell; // Bumped after every push, daemon futex word
+    _Atomic uint64_t enqueuePos __attribute__((aligned(64)));
+    _Atomic uint64_t dequeuePos __attribute__((aligned(64)));
+    DaemonRingCell ring[DAEMON_JOB_SLOTS] __attribute__((aligned(64)));
+    DaemonJob jobs[DAEMON_JOB_SLOTS];
+} DaemonSegment;
+
+int runFilterDaemon(const char *name, int numThreads);
+
+typedef struct DaemonClient DaemonClient;
+
+DaemonClient *connectDaemon(const char *name);
+int submitDaemonJob(DaemonClient *client, int type, const char *filters, const char *input, const char *output);
+int waitDaemonJob(DaemonClient *client, int job);
+void disconnectDaemon(DaemonClient *client);
+
+#endif /* daemon.h */
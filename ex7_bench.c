@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmp.h"
+#include "shm_image.h"
+#include "threadpool.h"
+#include "kernels.h"
+#include "convolution.h"
+#include "batch.h"
+
+/*
+ * Throughput benchmark for the ex7 stages. For every image size it writes a
+ * synthetic BMP, then for every thread count times each stage over a number
+ * of iterations:
+ *   load   map the file and fault its pages in (loadInputImage)
+ *   copy   copy the pixels into the shared memory segment
+ *   blur   blur over the whole image, shared input to shared output
+ *   edge   edge detection over the whole image
+ *   write  write the result to a file
+ * and reports megapixels per second (min, p50, p90, p99, max).
+ */
+
+#define MAX_BENCH_SIZES 16
+#define MAX_BENCH_THREADS 16
+#define NUM_STAGES 5
+
+typedef struct
+{
+    const char *name;
+    int width;
+    int height;
+} BenchSize;
+
+static const BenchSize namedSizes[] = {
+    {"vga", 640, 480}, {"hd", 1280, 720}, {"fhd", 1920, 1080}, {"4k", 3840, 2160}, {"8k", 7680, 4320},
+};
+
+static const char *stageNames[NUM_STAGES] = {"load", "copy", "blur", "edge", "write"};
+
+typedef struct
+{
+    BenchSize sizes[MAX_BENCH_SIZES];
+    int numSizes;
+    int threads[MAX_BENCH_THREADS];
+    int numThreads;
+    int iterations;
+    const char *workDir;
+    const char *jsonPath;
+} BenchOptions;
+
+typedef struct
+{
+    double min, p50, p90, p99, max;
+} BenchStats;
+
+static double nowSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentiles of samples (sorted in place)
+static BenchStats computeStats(double *samples, int count)
+{
+    BenchStats stats;
+    qsort(samples, count, sizeof(double), compareDoubles);
+    stats.min = samples[0];
+    stats.max = samples[count - 1];
+    stats.p50 = samples[(count - 1) * 50 / 100];
+    stats.p90 = samples[(count - 1) * 90 / 100];
+    stats.p99 = samples[(count - 1) * 99 / 100];
+    return stats;
+}
+
+// Writes a width x height 24-bit BMP with gradients and noise, so every filter has edges to find
+static int writeSyntheticBMP(const char *path, int width, int height)
+{
+    BMP_Header header;
+    memset(&header, 0, sizeof(header));
+    header.width_px = width;
+    header.height_px = height;
+    header.bits_per_pixel = 24;
+    prepareBMPHeader(&header);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+    uint8_t *row = (uint8_t *)calloc(rowSize, 1);
+    uint32_t state = 0x9e3779b9u;
+    int result = row != NULL && fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+    for (int y = 0; y < height && result == 0; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            row[3 * x] = (uint8_t)(x * 255 / width + (state & 15));
+            row[3 * x + 1] = (uint8_t)(y * 255 / height + ((state >> 4) & 15));
+            row[3 * x + 2] = (uint8_t)(((x / 32 + y / 32) & 1) * 160 + ((state >> 8) & 63));
+        }
+        if (fwrite(row, 1, rowSize, file) != rowSize)
+        {
+            result = -1;
+        }
+    }
+    free(row);
+    if (fclose(file) != 0 || result != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static int parseSizes(const char *spec, BenchOptions *options)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    options->numSizes = 0;
+    for (char *token = strtok(buffer, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        if (options->numSizes == MAX_BENCH_SIZES)
+        {
+            fprintf(stderr, "At most %d sizes\n", MAX_BENCH_SIZES);
+            return -1;
+        }
+        BenchSize *size = &options->sizes[options->numSizes];
+        int found = 0;
+        for (size_t i = 0; i < sizeof(namedSizes) / sizeof(namedSizes[0]); i++)
+        {
+            if (strcmp(token, namedSizes[i].name) == 0)
+            {
+                *size = namedSizes[i];
+                found = 1;
+            }
+        }
+        if (!found)
+        {
+            if (sscanf(token, "%dx%d", &size->width, &size->height) != 2 || size->width < 3 || size->height < 3)
+            {
+                fprintf(stderr, "Invalid size '%s' (vga, hd, fhd, 4k, 8k or WxH)\n", token);
+                return -1;
+            }
+            size->name = strdup(token);
+        }
+        options->numSizes++;
+    }
+    return options->numSizes > 0 ? 0 : -1;
+}
+
+static int parseThreads(const char *spec, BenchOptions *options)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    options->numThreads = 0;
+    for (char *token = strtok(buffer, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        int threads = atoi(token);
+        if (threads <= 0 || options->numThreads == MAX_BENCH_THREADS)
+        {
+            fprintf(stderr, "Invalid thread list '%s'\n", spec);
+            return -1;
+        }
+        options->threads[options->numThreads++] = threads;
+    }
+    return options->numThreads > 0 ? 0 : -1;
+}
+
+static void printUsage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-s sizes] [-t threads] [-i iterations] [-d workdir] [-j results.json] [-T WxH]\n"
+            "  -s   comma separated sizes: vga, hd, fhd, 4k, 8k or WxH (default: all named)\n"
+            "  -t   comma separated thread counts (default: 1 and the online CPUs)\n"
+            "  -i   iterations per stage (default: 10)\n"
+            "  -d   directory for the synthetic images (default: /tmp)\n"
+            "  -j   also write the results as JSON\n"
+            "  -T   filter tile size in pixels, as ex7's -T (default: full rows of about 256 KiB)\n",
+            program);
+}
+
+// Times every stage of one image size with one thread count. Fills
+// samples[stage * iterations + iteration] with MPixel/s
+static int benchmarkSize(const BenchOptions *options, const char *inputPath, const char *outputPath,
+                         int numThreads, double *samples)
+{
+    ThreadPool *pool = createThreadPool(numThreads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating thread pool\n");
+        return -1;
+    }
+
+    SharedImage shared = SHARED_IMAGE_INIT;
+    int result = 0;
+    // Iteration -1 warms the caches, the segment and the pool up and is not recorded
+    for (int it = -1; it < options->iterations && result == 0; it++)
+    {
+        double times[NUM_STAGES];
+        double start = nowSeconds();
+        BMP_Image *image = loadInputImage(inputPath);
+        times[0] = nowSeconds() - start;
+        if (image == NULL)
+        {
+            result = -1;
+            break;
+        }
+
+        start = nowSeconds();
+        if (acquireSharedImage(&shared, &image->header, SHM_IMAGE_INPUT | SHM_IMAGE_OUTPUT) != 0)
+        {
+            freeImage(image);
+            result = -1;
+            break;
+        }
+        size_t rowBytes = (size_t)image->header.width_px * image->bytes_per_pixel;
+        for (int y = 0; y < image->norm_height; y++)
+        {
+            memcpy(shared.in->pixels[y], image->pixels[y], rowBytes);
+        }
+        times[1] = nowSeconds() - start;
+
+        start = nowSeconds();
+        applyParallelFilter(pool, findKernel("blur"), shared.in, shared.out, 0, image->norm_height);
+        times[2] = nowSeconds() - start;
+
+        start = nowSeconds();
+        applyParallelFilter(pool, findKernel("edge"), shared.in, shared.out, 0, image->norm_height);
+        times[3] = nowSeconds() - start;
+
+        start = nowSeconds();
+        int fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || !writeImageFile(fd, shared.out))
+        {
+            perror(outputPath);
+            result = -1;
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        times[4] = nowSeconds() - start;
+
+        double megapixels = (double)image->header.width_px * image->norm_height / 1e6;
+        for (int stage = 0; stage < NUM_STAGES && it >= 0; stage++)
+        {
+            samples[stage * options->iterations + it] = times[stage] > 0 ? megapixels / times[stage] : 0;
+        }
+        freeImage(image);
+    }
+
+    releaseSharedImage(&shared);
+    destroyThreadPool(pool);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    int opt;
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    options.numSizes = sizeof(namedSizes) / sizeof(namedSizes[0]);
+    memcpy(options.sizes, namedSizes, sizeof(namedSizes));
+    options.numThreads = 0;
+    options.threads[options.numThreads++] = 1;
+    if (cpus > 1)
+    {
+        options.threads[options.numThreads++] = cpus;
+    }
+    options.iterations = 10;
+    options.workDir = "/tmp";
+    options.jsonPath = NULL;
+
+    while ((opt = getopt(argc, argv, "s:t:i:d:j:T:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (parseSizes(optarg, &options) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (parseThreads(optarg, &options) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            options.iterations = atoi(optarg);
+            if (options.iterations <= 0)
+            {
+                fprintf(stderr, "Iterations must be a positive integer.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            options.workDir = optarg;
+            break;
+        case 'j':
+            options.jsonPath = optarg;
+            break;
+        case 'T':
+            if (parseTileSize(optarg) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *json = NULL;
+    if (options.jsonPath != NULL)
+    {
+        json = fopen(options.jsonPath, "w");
+        if (json == NULL)
+        {
+            perror(options.jsonPath);
+            return EXIT_FAILURE;
+        }
+        int tileWidth, tileHeight;
+        getTileSize(&tileWidth, &tileHeight);
+        fprintf(json, "{\n  \"isa\": \"%s\",\n  \"cpus\": %d,\n  \"iterations\": %d,\n  \"tile\": \"%dx%d\",\n  \"results\": [",
+                getKernelISA(), cpus, options.iterations, tileWidth, tileHeight);
+    }
+
+    printf("Kernels: %s, %d CPUs, %d iterations, MPixel/s\n", getKernelISA(), cpus, options.iterations);
+    printf("%-10s %7s %-6s %9s %9s %9s %9s %9s\n", "size", "threads", "stage", "min", "p50", "p90", "p99", "max");
+
+    double *samples = (double *)malloc(NUM_STAGES * options.iterations * sizeof(double));
+    int first = 1, status = EXIT_SUCCESS;
+    for (int s = 0; s < options.numSizes && status == EXIT_SUCCESS; s++)
+    {
+        const BenchSize *size = &options.sizes[s];
+        char inputPath[PATH_MAX], outputPath[PATH_MAX];
+        snprintf(inputPath, sizeof(inputPath), "%s/ex7_bench_%dx%d.bmp", options.workDir, size->width, size->height);
+        snprintf(outputPath, sizeof(outputPath), "%s/ex7_bench_%dx%d_out.bmp", options.workDir, size->width,
+                 size->height);
+        if (samples == NULL || writeSyntheticBMP(inputPath, size->width, size->height) != 0)
+        {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        for (int t = 0; t < options.numThreads; t++)
+        {
+            if (benchmarkSize(&options, inputPath, outputPath, options.threads[t], samples) != 0)
+            {
+                status = EXIT_FAILURE;
+                break;
+            }
+            for (int stage = 0; stage < NUM_STAGES; stage++)
+            {
+                BenchStats stats = computeStats(samples + stage * options.iterations, options.iterations);
+                printf("%-10s %7d %-6s %9.1f %9.1f %9.1f %9.1f %9.1f\n", size->name, options.threads[t],
+                       stageNames[stage], stats.min, stats.p50, stats.p90, stats.p99, stats.max);
+                if (json != NULL)
+                {
+                    fprintf(json,
+                            "%s\n    {\"size\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, "
+                            "\"stage\": \"%s\", \"mpix_per_s\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+                            "\"p99\": %.3f, \"max\": %.3f}}",
+                            first ? "" : ",", size->name, size->width, size->height, options.threads[t],
+                            stageNames[stage], stats.min, stats.p50, stats.p90, stats.p99, stats.max);
+                    first = 0;
+                }
+            }
+        }
+        unlink(inputPath);
+        unlink(outputPath);
+    }
+    free(samples);
+
+    if (json != NULL)
+    {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    return status;
+}
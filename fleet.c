@@ -0,0 +1,821 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fleet.h"
+#include "convolution.h"
+#include "pipeline.h"
+#include "plan.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#define FLEET_MAGIC 0x46375845u // "EX7F"
+
+typedef struct
+{
+    int fd;    // -1 once the worker is gone
+    pid_t pid; // Forked locally, 0 for a -W worker
+    int bands[FLEET_WINDOW]; // Bands sent and not answered yet, oldest first
+    int numBands;
+} FleetWorker;
+
+struct Fleet
+{
+    FleetWorker workers[FLEET_MAX_WORKERS];
+    int numWorkers;
+    int inputFd; // memfds shared with every worker
+    int outputFd;
+    uint8_t *input;
+    uint8_t *output;
+    size_t capacity; // Bytes mapped from each memfd
+};
+
+static volatile sig_atomic_t stopSignal = 0;
+
+static void handleStopSignal(int signal)
+{
+    (void)signal;
+    stopSignal = 1;
+}
+
+// Sends message with fds attached. Returns 0, or -1 (errno set)
+static int sendWithFds(int socketFd, const void *message, size_t size, const int *fds, int numFds)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {(void *)message, size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (numFds > 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+    }
+    return sendmsg(socketFd, &msg, MSG_NOSIGNAL) == (ssize_t)size ? 0 : -1;
+}
+
+/* Receives one message of exactly size bytes and the fds attached to it.
+ * Returns 1, 0 on end of file, -1 on error or a malformed message.
+ */
+static int receiveWithFds(int socketFd, void *message, size_t size, int *fds, int numFds)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {message, size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+    ssize_t received;
+    do
+    {
+        received = recvmsg(socketFd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR && !stopSignal);
+    if (received <= 0)
+    {
+        return received == 0 ? 0 : -1;
+    }
+
+    int got = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (got < numFds)
+                {
+                    fds[got++] = fd;
+                }
+                else
+                {
+                    close(fd);
+                }
+            }
+        }
+    }
+    if ((size_t)received != size || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || got != numFds)
+    {
+        for (int i = 0; i < got; i++)
+        {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return 1;
+}
+
+// Maps bytes [start, end) of fd; *view points at byte start. Returns the mapping or NULL
+static void *mapRange(int fd, size_t start, size_t end, int prot, uint8_t **view, size_t *length)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset = start & ~(pageSize - 1);
+    *length = end - offset;
+    void *mapping = mmap(NULL, *length, prot, MAP_SHARED, fd, (off_t)offset);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *view = (uint8_t *)mapping + (start - offset);
+    return mapping;
+}
+
+// Rows read above and below a band
+static int chainHalo(const FilterChain *chain, const FilterPlan *plan)
+{
+    int halo = 0;
+    for (int s = 0; s < chain->numStages; s++)
+    {
+        halo += chain->stages[s]->size / 2;
+    }
+    for (int i = 0; chain->numStages == 0 && i < plan->numRegions; i++)
+    {
+        int radius = plan->regions[i].kernel->size / 2;
+        halo = radius > halo ? radius : halo;
+    }
+    return halo;
+}
+
+// Filters band with pool; in and out are views of the whole image
+static int filterBand(ThreadPool *pool, const FleetBand *band, BMP_Image *in, BMP_Image *out)
+{
+    FilterChain chain = {.numStages = 0};
+    if (band->filters[0] != '\0')
+    {
+        if (parseFilterChain(band->filters, &chain) != 0)
+        {
+            return -1;
+        }
+        return applyParallelPipeline(pool, chain.stages, chain.numStages, in, out, band->startRow, band->endRow);
+    }
+
+    FilterPlan plan;
+    if (band->plan[0] == '\0')
+    {
+        setDefaultPlan(&plan, band->width, band->height);
+    }
+    else if (parseFilterPlan(band->plan, band->width, band->height, &plan) != 0)
+    {
+        return -1;
+    }
+    if (!planCoversImage(&plan, band->width, band->height))
+    {
+        for (int y = band->startRow; y < band->endRow; y++)
+        {
+            memcpy(out->pixels[y], in->pixels[y], (size_t)band->width * band->bytesPerPixel);
+        }
+    }
+
+    // Keep the part of every region inside the band (plans from a spec have no masks)
+    for (int i = 0; i < plan.numRegions; i++)
+    {
+        FilterRegion *region = &plan.regions[i];
+        region->y0 = region->y0 > band->startRow ? region->y0 : band->startRow;
+        region->y1 = region->y1 < band->endRow ? region->y1 : band->endRow;
+    }
+    return applyFilterPlan(pool, &plan, in, out);
+}
+
+static int checkBand(const FleetBand *band, int inputFd, int outputFd)
+{
+    struct stat inputInfo, outputInfo;
+    size_t size = (size_t)band->height * band->stride;
+    return band->magic == FLEET_MAGIC && band->width > 0 && band->height > 0 &&
+           (band->bytesPerPixel == 3 || band->bytesPerPixel == 4) &&
+           band->stride >= band->width * band->bytesPerPixel && 0 <= band->haloStart &&
+           band->haloStart <= band->startRow && band->startRow < band->endRow && band->endRow <= band->haloEnd &&
+           band->haloEnd <= band->height && memchr(band->filters, '\0', sizeof(band->filters)) != NULL &&
+           memchr(band->plan, '\0', sizeof(band->plan)) != NULL && fstat(inputFd, &inputInfo) == 0 &&
+           fstat(outputFd, &outputInfo) == 0 && (size_t)inputInfo.st_size >= size &&
+           (size_t)outputInfo.st_size >= size;
+}
+
+// Maps the rows of band from the two memfds and filters it
+static int runBand(ThreadPool *pool, const FleetBand *band, int inputFd, int outputFd)
+{
+    if (!checkBand(band, inputFd, outputFd))
+    {
+        fprintf(stderr, "Fleet worker: malformed band request\n");
+        return -1;
+    }
+
+    uint8_t *inRows = NULL, *outRows = NULL;
+    size_t inLength, outLength;
+    size_t stride = (size_t)band->stride;
+    void *inMapping = mapRange(inputFd, band->haloStart * stride, band->haloEnd * stride, PROT_READ, &inRows,
+                               &inLength);
+    void *outMapping = mapRange(outputFd, band->startRow * stride, band->endRow * stride, PROT_READ | PROT_WRITE,
+                                &outRows, &outLength);
+    Pixel **inPixels = (Pixel **)calloc(band->height, sizeof(Pixel *));
+    Pixel **outPixels = (Pixel **)calloc(band->height, sizeof(Pixel *));
+    int result = -1;
+    if (inMapping != NULL && outMapping != NULL && inPixels != NULL && outPixels != NULL)
+    {
+        // Full-height views in which only the mapped rows are valid
+        BMP_Image in = {0};
+        in.header.width_px = band->width;
+        in.header.height_px = band->height;
+        in.header.bits_per_pixel = 8 * band->bytesPerPixel;
+        in.norm_height = band->height;
+        in.bytes_per_pixel = band->bytesPerPixel;
+        in.stride = band->stride;
+        BMP_Image out = in;
+        in.pixels = inPixels;
+        out.pixels = outPixels;
+        for (int y = band->haloStart; y < band->haloEnd; y++)
+        {
+            inPixels[y] = (Pixel *)(inRows + (y - band->haloStart) * stride);
+        }
+        for (int y = band->startRow; y < band->endRow; y++)
+        {
+            outPixels[y] = (Pixel *)(outRows + (y - band->startRow) * stride);
+        }
+        TRACE_BEGIN(span, "fleet band");
+        result = filterBand(pool, band, &in, &out);
+        TRACE_END(span);
+    }
+    else
+    {
+        perror("Fleet worker");
+    }
+
+    free(inPixels);
+    free(outPixels);
+    if (inMapping != NULL)
+    {
+        munmap(inMapping, inLength);
+    }
+    if (outMapping != NULL)
+    {
+        munmap(outMapping, outLength);
+    }
+    return result;
+}
+
+// Answers the band requests of one coordinator until it hangs up
+static void serveConnection(ThreadPool *pool, int socketFd)
+{
+    FleetBand band;
+    int fds[2];
+    int status;
+    while (!stopSignal && (status = receiveWithFds(socketFd, &band, sizeof(band), fds, 2)) != 0)
+    {
+        FleetReply reply = {FLEET_MAGIC, band.startRow, -1};
+        if (status == 1)
+        {
+            reply.result = runBand(pool, &band, fds[0], fds[1]);
+            close(fds[0]);
+            close(fds[1]);
+        }
+        else if (errno != EINTR)
+        {
+            fprintf(stderr, "Fleet worker: bad message\n");
+        }
+        if (sendWithFds(socketFd, &reply, sizeof(reply), NULL, 0) != 0)
+        {
+            break;
+        }
+    }
+}
+
+/* Serves coordinators one after the other on the Unix socket socketPath,
+ * with a pool of numThreads workers, until SIGINT or SIGTERM. Returns the
+ * process exit status.
+ */
+int runFleetWorker(const char *socketPath, int numThreads)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd == -1)
+    {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    // Replace a socket left behind by a worker that died, not a live one
+    if (connect(listenFd, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        fprintf(stderr, "A fleet worker is already listening on %s\n", socketPath);
+        close(listenFd);
+        return EXIT_FAILURE;
+    }
+    if (errno == ECONNREFUSED)
+    {
+        unlink(socketPath);
+    }
+    close(listenFd);
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd == -1 || bind(listenFd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(listenFd, FLEET_MAX_WORKERS) == -1)
+    {
+        perror(socketPath);
+        if (listenFd != -1)
+        {
+            close(listenFd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    ThreadPool *pool = createThreadPool(numThreads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating thread pool\n");
+        close(listenFd);
+        unlink(socketPath);
+        return EXIT_FAILURE;
+    }
+
+    // No SA_RESTART: a signal interrupts accept and recvmsg
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Fleet worker ready on %s (pid %d, %d threads)\n", socketPath, (int)getpid(), numThreads);
+    fflush(stdout);
+
+    while (!stopSignal)
+    {
+        int connectionFd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (connectionFd == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("accept");
+                break;
+            }
+            continue;
+        }
+        serveConnection(pool, connectionFd);
+        close(connectionFd);
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+    destroyThreadPool(pool);
+    printf("Fleet worker on %s stopped\n", socketPath);
+    return EXIT_SUCCESS;
+}
+
+static int connectWorker(const char *socketPath)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        perror(socketPath);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Forks a worker process serving the other end of a socket pair
+static int forkWorker(Fleet *fleet, int numThreads, FleetWorker *worker)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(pair[0]);
+        for (int i = 0; i < fleet->numWorkers; i++)
+        {
+            close(fleet->workers[i].fd);
+        }
+        ThreadPool *pool = createThreadPool(numThreads);
+        if (pool != NULL)
+        {
+            serveConnection(pool, pair[1]);
+            destroyThreadPool(pool);
+        }
+        _exit(pool != NULL ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(pair[1]);
+    worker->fd = pair[0];
+    worker->pid = pid;
+    worker->numBands = 0;
+    return 0;
+}
+
+/* Starts a fleet. spec is either a number of workers to fork, which share
+ * numThreads threads, or a comma separated list of sockets of workers
+ * started with -W. Returns NULL if no worker could be reached.
+ */
+Fleet *createFleet(const char *spec, int numThreads)
+{
+    Fleet *fleet = (Fleet *)calloc(1, sizeof(Fleet));
+    if (fleet == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return NULL;
+    }
+    fleet->inputFd = memfd_create("ex7-fleet-in", MFD_CLOEXEC);
+    fleet->outputFd = memfd_create("ex7-fleet-out", MFD_CLOEXEC);
+    if (fleet->inputFd == -1 || fleet->outputFd == -1)
+    {
+        perror("memfd_create");
+        destroyFleet(fleet);
+        return NULL;
+    }
+
+    char *end;
+    long count = strtol(spec, &end, 10);
+    if (*end == '\0' && end != spec)
+    {
+        if (count < 1 || count > FLEET_MAX_WORKERS)
+        {
+            fprintf(stderr, "A fleet has 1 to %d workers\n", FLEET_MAX_WORKERS);
+            destroyFleet(fleet);
+            return NULL;
+        }
+        int threads = numThreads / count > 0 ? numThreads / (int)count : 1;
+        for (int i = 0; i < count; i++)
+        {
+            if (forkWorker(fleet, threads, &fleet->workers[fleet->numWorkers]) == 0)
+            {
+                fleet->numWorkers++;
+            }
+        }
+    }
+    else
+    {
+        char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+        while (*spec != '\0' && fleet->numWorkers < FLEET_MAX_WORKERS)
+        {
+            size_t length = strcspn(spec, ",");
+            if (length > 0 && length < sizeof(path))
+            {
+                memcpy(path, spec, length);
+                path[length] = '\0';
+                FleetWorker *worker = &fleet->workers[fleet->numWorkers];
+                worker->fd = connectWorker(path);
+                worker->pid = 0;
+                fleet->numWorkers += worker->fd != -1;
+            }
+            spec += length + (spec[length] == ',');
+        }
+    }
+    if (fleet->numWorkers == 0)
+    {
+        fprintf(stderr, "No fleet worker available\n");
+        destroyFleet(fleet);
+        return NULL;
+    }
+    return fleet;
+}
+
+// Grows both memfds and their mappings to hold size bytes
+static int reserveBuffers(Fleet *fleet, size_t size)
+{
+    if (size <= fleet->capacity)
+    {
+        return 0;
+    }
+    if (fleet->capacity > 0)
+    {
+        munmap(fleet->input, fleet->capacity);
+        munmap(fleet->output, fleet->capacity);
+        fleet->capacity = 0;
+    }
+    if (ftruncate(fleet->inputFd, (off_t)size) == -1 || ftruncate(fleet->outputFd, (off_t)size) == -1)
+    {
+        perror("ftruncate");
+        return -1;
+    }
+    fleet->input = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fleet->inputFd, 0);
+    fleet->output = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fleet->outputFd, 0);
+    if (fleet->input == MAP_FAILED || fleet->output == MAP_FAILED)
+    {
+        perror("mmap");
+        if (fleet->input != MAP_FAILED)
+        {
+            munmap(fleet->input, size);
+        }
+        if (fleet->output != MAP_FAILED)
+        {
+            munmap(fleet->output, size);
+        }
+        return -1;
+    }
+    fleet->capacity = size;
+    return 0;
+}
+
+static void dropWorker(FleetWorker *worker, int *pending, int *numPending)
+{
+    fprintf(stderr, "Fleet worker lost, %d band(s) handed to the others\n", worker->numBands);
+    for (int i = 0; i < worker->numBands; i++)
+    {
+        pending[(*numPending)++] = worker->bands[i];
+    }
+    worker->numBands = 0;
+    close(worker->fd);
+    worker->fd = -1;
+}
+
+// Runs every band of request through the fleet. Returns 0, or -1 if a band failed
+static int dispatchBands(Fleet *fleet, FleetBand *request, int numBands, int halo)
+{
+    int height = request->height;
+    int *pending = (int *)malloc(numBands * sizeof(int));
+    if (pending == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+    // Popped from the back, so band 0 goes first
+    int numPending = numBands;
+    for (int i = 0; i < numBands; i++)
+    {
+        pending[i] = numBands - 1 - i;
+    }
+
+    int failed = 0, remaining = numBands;
+    int fds[2] = {fleet->inputFd, fleet->outputFd};
+    struct pollfd polls[FLEET_MAX_WORKERS];
+    int polled[FLEET_MAX_WORKERS];
+    while (remaining > 0)
+    {
+        // Top up every live worker's window
+        int live = 0, numPolls = 0;
+        for (int w = 0; w < fleet->numWorkers; w++)
+        {
+            FleetWorker *worker = &fleet->workers[w];
+            while (worker->fd != -1 && worker->numBands < FLEET_WINDOW && numPending > 0)
+            {
+                int band = pending[--numPending];
+                request->startRow = (int)((long long)height * band / numBands);
+                request->endRow = (int)((long long)height * (band + 1) / numBands);
+                request->haloStart = request->startRow - halo > 0 ? request->startRow - halo : 0;
+                request->haloEnd = request->endRow + halo < height ? request->endRow + halo : height;
+                if (sendWithFds(worker->fd, request, sizeof(*request), fds, 2) != 0)
+                {
+                    pending[numPending++] = band;
+                    dropWorker(worker, pending, &numPending);
+                    break;
+                }
+                worker->bands[worker->numBands++] = band;
+            }
+            if (worker->fd != -1)
+            {
+                live++;
+                if (worker->numBands > 0)
+                {
+                    polls[numPolls].fd = worker->fd;
+                    polls[numPolls].events = POLLIN;
+                    polled[numPolls++] = w;
+                }
+            }
+        }
+        if (live == 0)
+        {
+            fprintf(stderr, "Every fleet worker is gone\n");
+            failed = 1;
+            break;
+        }
+        if (poll(polls, numPolls, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            failed = 1;
+            break;
+        }
+
+        for (int p = 0; p < numPolls; p++)
+        {
+            FleetWorker *worker = &fleet->workers[polled[p]];
+            if (polls[p].revents == 0)
+            {
+                continue;
+            }
+            FleetReply reply;
+            if (receiveWithFds(worker->fd, &reply, sizeof(reply), NULL, 0) != 1 || reply.magic != FLEET_MAGIC)
+            {
+                dropWorker(worker, pending, &numPending);
+                continue;
+            }
+            // A worker answers its bands in order
+            failed |= reply.result != 0;
+            worker->numBands--;
+            memmove(worker->bands, worker->bands + 1, worker->numBands * sizeof(int));
+            remaining--;
+        }
+    }
+    free(pending);
+
+    // Drain what is still queued so the next image starts clean
+    for (int w = 0; failed && w < fleet->numWorkers; w++)
+    {
+        FleetWorker *worker = &fleet->workers[w];
+        FleetReply reply;
+        while (worker->fd != -1 && worker->numBands > 0)
+        {
+            if (receiveWithFds(worker->fd, &reply, sizeof(reply), NULL, 0) != 1)
+            {
+                close(worker->fd);
+                worker->fd = -1;
+                break;
+            }
+            worker->numBands--;
+        }
+        worker->numBands = 0;
+    }
+    return failed ? -1 : 0;
+}
+
+/* Filters image with the fleet and writes the result to output: filters
+ * is a kernel list, or empty for the plan selected with setFilterPlanSpec.
+ * Returns 0 on success, -1 on failure.
+ */
+int fleetFilterImage(Fleet *fleet, const char *filters, BMP_Image *image, const char *output)
+{
+    FleetBand request;
+    memset(&request, 0, sizeof(request));
+    const char *planSpec = getFilterPlanSpec() != NULL ? getFilterPlanSpec() : "";
+    if (strlen(filters) >= sizeof(request.filters) || strlen(planSpec) >= sizeof(request.plan))
+    {
+        fprintf(stderr, "%s: filter list too long for the fleet\n", output);
+        return -1;
+    }
+    request.magic = FLEET_MAGIC;
+    request.width = image->header.width_px;
+    request.height = image->norm_height;
+    request.bytesPerPixel = image->bytes_per_pixel;
+    request.stride = (request.width * request.bytesPerPixel + 3) & ~3; // Rows laid out like the file
+    strcpy(request.filters, filters);
+    strcpy(request.plan, planSpec);
+
+    // Parsed here only to size the halo
+    FilterChain chain = {.numStages = 0};
+    FilterPlan plan = {.numRegions = 0};
+    if (filters[0] != '\0')
+    {
+        if (parseFilterChain(filters, &chain) != 0)
+        {
+            return -1;
+        }
+    }
+    else if (planSpec[0] == '\0')
+    {
+        setDefaultPlan(&plan, request.width, request.height);
+    }
+    else if (parseFilterPlan(planSpec, request.width, request.height, &plan) != 0)
+    {
+        return -1;
+    }
+
+    size_t rowBytes = (size_t)request.width * request.bytesPerPixel;
+    if (reserveBuffers(fleet, (size_t)request.height * request.stride) != 0)
+    {
+        return -1;
+    }
+    TRACE_BEGIN(copySpan, "fleet copy");
+    for (int y = 0; y < request.height; y++)
+    {
+        memcpy(fleet->input + (size_t)y * request.stride, image->pixels[y], rowBytes);
+    }
+    TRACE_END(copySpan);
+
+    int live = 0;
+    for (int w = 0; w < fleet->numWorkers; w++)
+    {
+        live += fleet->workers[w].fd != -1;
+    }
+    int numBands = live * FLEET_BANDS_PER_WORKER;
+    numBands = numBands < request.height ? numBands : request.height;
+    TRACE_BEGIN(dispatchSpan, "fleet bands");
+    int result = dispatchBands(fleet, &request, numBands, chainHalo(&chain, &plan));
+    TRACE_END(dispatchSpan);
+    if (result != 0)
+    {
+        fprintf(stderr, "%s: the fleet failed to filter the image\n", output);
+        return -1;
+    }
+
+    // View of the result memfd, written like any other image
+    Pixel **rows = (Pixel **)malloc(request.height * sizeof(Pixel *));
+    if (rows == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+    BMP_Image resultImage = *image;
+    resultImage.stride = request.stride;
+    resultImage.pixel_data = fleet->output;
+    resultImage.pixels = rows;
+    resultImage.mapping = NULL;
+    for (int y = 0; y < request.height; y++)
+    {
+        // The buffers outlive the image: clear what an earlier, wider one left in the row padding
+        rows[y] = (Pixel *)(fleet->output + (size_t)y * request.stride);
+        memset((uint8_t *)rows[y] + rowBytes, 0, request.stride - rowBytes);
+    }
+
+    TRACE_BEGIN(writeSpan, "write");
+    int destFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destFd == -1 || !writeImageFile(destFd, &resultImage))
+    {
+        perror(output);
+        result = -1;
+    }
+    if (destFd != -1 && close(destFd) == -1)
+    {
+        perror(output);
+        result = -1;
+    }
+    TRACE_END(writeSpan);
+    free(rows);
+    return result;
+}
+
+// Hangs up on every worker, reaps the forked ones and frees the buffers
+void destroyFleet(Fleet *fleet)
+{
+    if (fleet == NULL)
+    {
+        return;
+    }
+    for (int w = 0; w < fleet->numWorkers; w++)
+    {
+        if (fleet->workers[w].fd != -1)
+        {
+            close(fleet->workers[w].fd);
+        }
+    }
+    for (int w = 0; w < fleet->numWorkers; w++)
+    {
+        if (fleet->workers[w].pid > 0)
+        {
+            waitpid(fleet->workers[w].pid, NULL, 0);
+        }
+    }
+    if (fleet->capacity > 0)
+    {
+        munmap(fleet->input, fleet->capacity);
+        munmap(fleet->output, fleet->capacity);
+    }
+    if (fleet->inputFd != -1)
+    {
+        close(fleet->inputFd);
+    }
+    if (fleet->outputFd != -1)
+    {
+        close(fleet->outputFd);
+    }
+    free(fleet);
+}
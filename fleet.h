@@ -0,0 +1,58 @@
+#ifndef _FLEET_H_
+#define _FLEET_H_
+#include <stdint.h>
+#include "bmp.h"
+#include "daemon.h"
+
+/*
+ * Worker fleet over Unix domain sockets (SOCK_SEQPACKET). The coordinator
+ * copies each image once into a memfd, keeps a second memfd for the result
+ * and cuts the rows into bands:
+ *   coordinator                              worker k
+ *   image -> input memfd  --- FleetBand --->  maps rows [haloStart, haloEnd)
+ *            output memfd     + both fds      of the input, [startRow, endRow)
+ *                             (SCM_RIGHTS)    of the output, filters the band
+ *                         <-- FleetReply ---  with its own pool
+ * Pixels never travel through the socket: a band request only carries the
+ * two descriptors and the rows, padded with the halo its kernels read. Each
+ * worker holds at most FLEET_WINDOW bands; the next band goes to the first
+ * worker that answers, and the bands of a worker that dies are handed to
+ * the others. Workers are either forked locally or started separately with
+ * -W, e.g. in other cgroups or containers sharing the socket directory.
+ */
+#define FLEET_MAX_WORKERS 64
+#define FLEET_BANDS_PER_WORKER 4
+#define FLEET_WINDOW 2 // Bands queued on a worker at once
+#define FLEET_PLAN_BYTES 256
+
+typedef struct FleetBand
+{
+    uint32_t magic;
+    int32_t width;
+    int32_t height;
+    int32_t bytesPerPixel;
+    int32_t stride;
+    int32_t startRow; // Rows written
+    int32_t endRow;
+    int32_t haloStart; // Rows read
+    int32_t haloEnd;
+    char filters[DAEMON_FILTER_BYTES]; // Kernel list, empty for the plan
+    char plan[FLEET_PLAN_BYTES];       // Plan spec, empty for ex7's halves
+} FleetBand;
+
+typedef struct FleetReply
+{
+    uint32_t magic;
+    int32_t startRow; // Band answered
+    int32_t result;   // 0 on success, -1 on failure
+} FleetReply;
+
+int runFleetWorker(const char *socketPath, int numThreads);
+
+typedef struct Fleet Fleet;
+
+Fleet *createFleet(const char *spec, int numThreads);
+int fleetFilterImage(Fleet *fleet, const char *filters, BMP_Image *image, const char *output);
+void destroyFleet(Fleet *fleet);
+
+#endif /* fleet.h */
@@ -0,0 +1,265 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+typedef void (*RowBytesFunction)(const uint8_t *a, const uint8_t *r, const uint8_t *c,
+                                 uint8_t *out, int lo, int hi, int step);
+
+// Vertical [1 2 1] then horizontal [1 2 1] over the bytes step apart, / 16
+static void blurBytesScalar(const uint8_t *a, const uint8_t *r, const uint8_t *c,
+                            uint8_t *out, int lo, int hi, int step)
+{
+    for (int b = lo; b < hi; b++)
+    {
+        int left = a[b - step] + 2 * r[b - step] + c[b - step];
+        int mid = a[b] + 2 * r[b] + c[b];
+        int right = a[b + step] + 2 * r[b + step] + c[b + step];
+        out[b] = (uint8_t)((left + 2 * mid + right) >> 4);
+    }
+}
+
+/* Prewitt is separable too: Gx is the difference of the column sums one
+ * pixel right and left, Gy the difference of the row sums below and above.
+ * Past 255 the magnitude saturates, so only sqrt of values below 65536 matters.
+ */
+static void edgeBytesScalar(const uint8_t *a, const uint8_t *r, const uint8_t *c,
+                            uint8_t *out, int lo, int hi, int step)
+{
+    for (int b = lo; b < hi; b++)
+    {
+        int gx = (a[b + step] + r[b + step] + c[b + step]) - (a[b - step] + r[b - step] + c[b - step]);
+        int gy = (c[b - step] + c[b] + c[b + step]) - (a[b - step] + a[b] + a[b + step]);
+        int magnitude = gx * gx + gy * gy;
+        out[b] = magnitude >= 255 * 255 ? 255 : (uint8_t)sqrtf((float)magnitude);
+    }
+}
+
+#ifdef KERNELS_X86
+// Vertical [1 2 1] sum of 16 bytes at p as two vectors of 16-bit lanes
+static inline void columnSumSSE2(const uint8_t *a, const uint8_t *r, const uint8_t *c, __m128i *lo, __m128i *hi)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vr = _mm_loadu_si128((const __m128i *)r);
+    __m128i vc = _mm_loadu_si128((const __m128i *)c);
+    *lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vc, zero)),
+                        _mm_slli_epi16(_mm_unpacklo_epi8(vr, zero), 1));
+    *hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vc, zero)),
+                        _mm_slli_epi16(_mm_unpackhi_epi8(vr, zero), 1));
+}
+
+static void blurBytesSSE2(const uint8_t *a, const uint8_t *r, const uint8_t *c, uint8_t *out, int lo, int hi, int step)
+{
+    int b = lo;
+    for (; b + 16 <= hi; b += 16)
+    {
+        __m128i leftLo, leftHi, midLo, midHi, rightLo, rightHi;
+        columnSumSSE2(a + b - step, r + b - step, c + b - step, &leftLo, &leftHi);
+        columnSumSSE2(a + b, r + b, c + b, &midLo, &midHi);
+        columnSumSSE2(a + b + step, r + b + step, c + b + step, &rightLo, &rightHi);
+        __m128i sumLo = _mm_add_epi16(_mm_add_epi16(leftLo, rightLo), _mm_slli_epi16(midLo, 1));
+        __m128i sumHi = _mm_add_epi16(_mm_add_epi16(leftHi, rightHi), _mm_slli_epi16(midHi, 1));
+        __m128i result = _mm_packus_epi16(_mm_srli_epi16(sumLo, 4), _mm_srli_epi16(sumHi, 4));
+        _mm_storeu_si128((__m128i *)(out + b), result);
+    }
+    blurBytesScalar(a, r, c, out, b, hi, step);
+}
+
+__attribute__((target("avx2"))) static inline void columnSumAVX2(const uint8_t *a, const uint8_t *r, const uint8_t *c,
+                                                                 __m256i *lo, __m256i *hi)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i va = _mm256_loadu_si256((const __m256i *)a);
+    __m256i vr = _mm256_loadu_si256((const __m256i *)r);
+    __m256i vc = _mm256_loadu_si256((const __m256i *)c);
+    *lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(va, zero), _mm256_unpacklo_epi8(vc, zero)),
+                           _mm256_slli_epi16(_mm256_unpacklo_epi8(vr, zero), 1));
+    *hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(va, zero), _mm256_unpackhi_epi8(vc, zero)),
+                           _mm256_slli_epi16(_mm256_unpackhi_epi8(vr, zero), 1));
+}
+
+// Unpack and pack both work per 128-bit lane, so the byte order is preserved
+__attribute__((target("avx2"))) static void blurBytesAVX2(const uint8_t *a, const uint8_t *r, const uint8_t *c,
+                                                          uint8_t *out, int lo, int hi, int step)
+{
+    int b = lo;
+    for (; b + 32 <= hi; b += 32)
+    {
+        __m256i leftLo, leftHi, midLo, midHi, rightLo, rightHi;
+        columnSumAVX2(a + b - step, r + b - step, c + b - step, &leftLo, &leftHi);
+        columnSumAVX2(a + b, r + b, c + b, &midLo, &midHi);
+        columnSumAVX2(a + b + step, r + b + step, c + b + step, &rightLo, &rightHi);
+        __m256i sumLo = _mm256_add_epi16(_mm256_add_epi16(leftLo, rightLo), _mm256_slli_epi16(midLo, 1));
+        __m256i sumHi = _mm256_add_epi16(_mm256_add_epi16(leftHi, rightHi), _mm256_slli_epi16(midHi, 1));
+        __m256i result = _mm256_packus_epi16(_mm256_srli_epi16(sumLo, 4), _mm256_srli_epi16(sumHi, 4));
+        _mm256_storeu_si256((__m256i *)(out + b), result);
+    }
+    blurBytesSSE2(a, r, c, out, b, hi, step);
+}
+#endif
+
+#ifdef KERNELS_X86
+/* Gx and Gy fit in 16 bits. Interleaving them lets madd produce Gx^2 + Gy^2
+ * in 32-bit lanes; the float sqrt of these exact integers truncates to the
+ * same value as the double sqrt, and the saturating packs do the clamp.
+ */
+static inline __m128i magnitudeSSE2(__m128i gx, __m128i gy)
+{
+    __m128i pairsLo = _mm_unpacklo_epi16(gx, gy);
+    __m128i pairsHi = _mm_unpackhi_epi16(gx, gy);
+    __m128i sqLo = _mm_madd_epi16(pairsLo, pairsLo);
+    __m128i sqHi = _mm_madd_epi16(pairsHi, pairsHi);
+    __m128i rootLo = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(sqLo)));
+    __m128i rootHi = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(sqHi)));
+    return _mm_packs_epi32(rootLo, rootHi);
+}
+
+static inline void sumOf3SSE2(const uint8_t *p, const uint8_t *q, const uint8_t *s, __m128i *lo, __m128i *hi)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vp = _mm_loadu_si128((const __m128i *)p);
+    __m128i vq = _mm_loadu_si128((const __m128i *)q);
+    __m128i vs = _mm_loadu_si128((const __m128i *)s);
+    *lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(vp, zero), _mm_unpacklo_epi8(vq, zero)), _mm_unpacklo_epi8(vs, zero));
+    *hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(vp, zero), _mm_unpackhi_epi8(vq, zero)), _mm_unpackhi_epi8(vs, zero));
+}
+
+static void edgeBytesSSE2(const uint8_t *a, const uint8_t *r, const uint8_t *c, uint8_t *out, int lo, int hi, int step)
+{
+    int b = lo;
+    for (; b + 16 <= hi; b += 16)
+    {
+        __m128i leftLo, leftHi, rightLo, rightHi, aboveLo, aboveHi, belowLo, belowHi;
+        sumOf3SSE2(a + b - step, r + b - step, c + b - step, &leftLo, &leftHi);
+        sumOf3SSE2(a + b + step, r + b + step, c + b + step, &rightLo, &rightHi);
+        sumOf3SSE2(a + b - step, a + b, a + b + step, &aboveLo, &aboveHi);
+        sumOf3SSE2(c + b - step, c + b, c + b + step, &belowLo, &belowHi);
+        __m128i resultLo = magnitudeSSE2(_mm_sub_epi16(rightLo, leftLo), _mm_sub_epi16(belowLo, aboveLo));
+        __m128i resultHi = magnitudeSSE2(_mm_sub_epi16(rightHi, leftHi), _mm_sub_epi16(belowHi, aboveHi));
+        _mm_storeu_si128((__m128i *)(out + b), _mm_packus_epi16(resultLo, resultHi));
+    }
+    edgeBytesScalar(a, r, c, out, b, hi, step);
+}
+
+__attribute__((target("avx2"))) static inline __m256i magnitudeAVX2(__m256i gx, __m256i gy)
+{
+    __m256i pairsLo = _mm256_unpacklo_epi16(gx, gy);
+    __m256i pairsHi = _mm256_unpackhi_epi16(gx, gy);
+    __m256i sqLo = _mm256_madd_epi16(pairsLo, pairsLo);
+    __m256i sqHi = _mm256_madd_epi16(pairsHi, pairsHi);
+    __m256i rootLo = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(sqLo)));
+    __m256i rootHi = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(sqHi)));
+    return _mm256_packs_epi32(rootLo, rootHi);
+}
+
+__attribute__((target("avx2"))) static inline void sumOf3AVX2(const uint8_t *p, const uint8_t *q, const uint8_t *s,
+                                                              __m256i *lo, __m256i *hi)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vp = _mm256_loadu_si256((const __m256i *)p);
+    __m256i vq = _mm256_loadu_si256((const __m256i *)q);
+    __m256i vs = _mm256_loadu_si256((const __m256i *)s);
+    *lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(vp, zero), _mm256_unpacklo_epi8(vq, zero)),
+                           _mm256_unpacklo_epi8(vs, zero));
+    *hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(vp, zero), _mm256_unpackhi_epi8(vq, zero)),
+                           _mm256_unpackhi_epi8(vs, zero));
+}
+
+__attribute__((target("avx2"))) static void edgeBytesAVX2(const uint8_t *a, const uint8_t *r, const uint8_t *c,
+                                                          uint8_t *out, int lo, int hi, int step)
+{
+    int b = lo;
+    for (; b + 32 <= hi; b += 32)
+    {
+        __m256i leftLo, leftHi, rightLo, rightHi, aboveLo, aboveHi, belowLo, belowHi;
+        sumOf3AVX2(a + b - step, r + b - step, c + b - step, &leftLo, &leftHi);
+        sumOf3AVX2(a + b + step, r + b + step, c + b + step, &rightLo, &rightHi);
+        sumOf3AVX2(a + b - step, a + b, a + b + step, &aboveLo, &aboveHi);
+        sumOf3AVX2(c + b - step, c + b, c + b + step, &belowLo, &belowHi);
+        __m256i resultLo = magnitudeAVX2(_mm256_sub_epi16(rightLo, leftLo), _mm256_sub_epi16(belowLo, aboveLo));
+        __m256i resultHi = magnitudeAVX2(_mm256_sub_epi16(rightHi, leftHi), _mm256_sub_epi16(belowHi, aboveHi));
+        _mm256_storeu_si256((__m256i *)(out + b), _mm256_packus_epi16(resultLo, resultHi));
+    }
+    edgeBytesSSE2(a, r, c, out, b, hi, step);
+}
+#endif
+
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+static RowBytesFunction blurBytes = blurBytesScalar;
+static RowBytesFunction edgeBytes = edgeBytesScalar;
+static int kernelISALevel = KERNEL_ISA_SCALAR;
+
+static const char *isaNames[] = {"scalar", "sse2", "avx2"};
+
+/* Returns the highest KERNEL_ISA_* level that EX7_KERNEL_ISA allows (every
+ * level when unset). The planar converters follow it too: sse2 also covers
+ * their SSSE3 versions.
+ */
+int getKernelISALimit(void)
+{
+    const char *limit = getenv("EX7_KERNEL_ISA");
+    for (int level = KERNEL_ISA_SCALAR; limit != NULL && level < KERNEL_ISA_AVX2; level++)
+    {
+        if (strcmp(limit, isaNames[level]) == 0)
+        {
+            return level;
+        }
+    }
+    return KERNEL_ISA_AVX2;
+}
+
+static void selectKernels(void)
+{
+#ifdef KERNELS_X86
+    int limit = getKernelISALimit();
+    __builtin_cpu_init();
+    if (limit >= KERNEL_ISA_AVX2 && __builtin_cpu_supports("avx2"))
+    {
+        blurBytes = blurBytesAVX2;
+        edgeBytes = edgeBytesAVX2;
+        kernelISALevel = KERNEL_ISA_AVX2;
+        return;
+    }
+    if (limit >= KERNEL_ISA_SSE2)
+    {
+        blurBytes = blurBytesSSE2;
+        edgeBytes = edgeBytesSSE2;
+        kernelISALevel = KERNEL_ISA_SSE2;
+    }
+#endif
+}
+
+/* Returns the instruction set the kernels run with, one of KERNEL_ISA_*.
+ */
+int getKernelISALevel(void)
+{
+    pthread_once(&kernelsOnce, selectKernels);
+    return kernelISALevel;
+}
+
+const char *getKernelISA(void)
+{
+    return isaNames[getKernelISALevel()];
+}
+
+void blurRowBytes(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                  uint8_t *out, int lo, int hi, int step)
+{
+    pthread_once(&kernelsOnce, selectKernels);
+    blurBytes(above, row, below, out, lo, hi, step);
+}
+
+void edgeRowBytes(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                  uint8_t *out, int lo, int hi, int step)
+{
+    pthread_once(&kernelsOnce, selectKernels);
+    edgeBytes(above, row, below, out, lo, hi, step);
+}
@@ -0,0 +1,38 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+#include <stdint.h>
+
+/*
+ * Row kernels shared by the filter workers. They work on the raw bytes of
+ * packed BGR or BGRA rows: the same channel of the neighbouring pixel is
+ * always step (3 or 4) bytes away, so one pass covers every channel.
+ *
+ * Each kernel has a scalar, an SSE2 and an AVX2 version; the fastest one the
+ * CPU supports is picked at run time the first time a kernel is called.
+ * EX7_KERNEL_ISA=scalar|sse2|avx2 caps the choice, so the slower versions
+ * can be checked against the fastest on the same machine.
+ */
+
+/* The kernels compute the output bytes [lo, hi) of a row from the rows
+ * above and below it. They read input bytes lo - step .. hi + step - 1, so
+ * the caller keeps lo >= step and hi <= step * (width - 1) and handles the
+ * border columns.
+ */
+
+// Binomial blur [1 2 1]/4 x [1 2 1]/4
+void blurRowBytes(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                  uint8_t *out, int lo, int hi, int step);
+
+// Prewitt edge magnitude clamp(sqrt(Gx^2 + Gy^2))
+void edgeRowBytes(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                  uint8_t *out, int lo, int hi, int step);
+
+#define KERNEL_ISA_SCALAR 0
+#define KERNEL_ISA_SSE2 1
+#define KERNEL_ISA_AVX2 2
+
+int getKernelISALimit(void);
+int getKernelISALevel(void);
+const char *getKernelISA(void);
+
+#endif /* kernels.h */
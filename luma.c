@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luma.h"
+#include "convolution.h"
+#include "planar.h"
+#include "trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUMA_X86 1
+#endif
+
+#define LUMA_CHUNK 256 // Pixels deinterleaved at a time, kept in L1
+
+typedef struct
+{
+    BMP_Image *imageIn;
+    BMP_Image *imageOut;
+    int startRow;
+    int endRow;
+    int failed; // Set by the worker when its row buffer cannot be allocated
+} LumaThreadArgs;
+
+static int lumaEdgeOutput = 0;
+
+/* Selects the luma edge mode: 8 or 24 writes the edge map with that many
+ * bits per pixel, 0 (the default) keeps the per-channel filters.
+ */
+void setLumaEdgeOutput(int bitsPerPixel)
+{
+    lumaEdgeOutput = bitsPerPixel == 8 || bitsPerPixel == 24 ? bitsPerPixel : 0;
+}
+
+int getLumaEdgeOutput(void)
+{
+    return lumaEdgeOutput;
+}
+
+/* Luma of width pixels given as B, G and R planes. The weighted sum is at
+ * most 255 * 256 + 128, so 16-bit lanes hold it exactly.
+ */
+static void lumaFromPlanes(const uint8_t *b, const uint8_t *g, const uint8_t *r, uint8_t *out, int width)
+{
+    int x = 0;
+#ifdef LUMA_X86
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weightB = _mm_set1_epi16(29);
+    const __m128i weightG = _mm_set1_epi16(150);
+    const __m128i weightR = _mm_set1_epi16(77);
+    const __m128i round = _mm_set1_epi16(128);
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+        __m128i vg = _mm_loadu_si128((const __m128i *)(g + x));
+        __m128i vr = _mm_loadu_si128((const __m128i *)(r + x));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(round, _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), weightB)),
+                                   _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(vg, zero), weightG),
+                                                 _mm_mullo_epi16(_mm_unpacklo_epi8(vr, zero), weightR)));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(round, _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), weightB)),
+                                   _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(vg, zero), weightG),
+                                                 _mm_mullo_epi16(_mm_unpackhi_epi8(vr, zero), weightR)));
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; x < width; x++)
+    {
+        out[x] = (uint8_t)((29 * b[x] + 150 * g[x] + 77 * r[x] + 128) >> 8);
+    }
+}
+
+/* Converts width BGR (bytesPerPixel 3) or BGRA (4) pixels to luma, a chunk
+ * at a time through the planar row converters.
+ */
+void lumaRow(const uint8_t *in, uint8_t *out, int width, int bytesPerPixel)
+{
+    uint8_t chunk[MAX_PLANES][LUMA_CHUNK];
+    uint8_t *planes[MAX_PLANES] = {chunk[0], chunk[1], chunk[2], chunk[3]};
+    for (int x = 0; x < width; x += LUMA_CHUNK)
+    {
+        int count = width - x < LUMA_CHUNK ? width - x : LUMA_CHUNK;
+        splitPlanarRow(in + (size_t)bytesPerPixel * x, planes, count, bytesPerPixel);
+        lumaFromPlanes(planes[0], planes[1], planes[2], out + x, count);
+    }
+}
+
+// Pool task: edge map of rows [startRow, endRow)
+static void *lumaEdgeThreadWorker(void *args)
+{
+    LumaThreadArgs *threadArgs = (LumaThreadArgs *)args;
+    BMP_Image *imageIn = threadArgs->imageIn;
+    BMP_Image *imageOut = threadArgs->imageOut;
+    const KernelDescriptor *edge = findKernel("edge");
+    int width = imageIn->header.width_px;
+    int height = imageIn->norm_height;
+    int stride = getRowStride(width, 1);
+
+    // Three luma rows, plus the magnitude row when it is replicated to BGR
+    uint8_t *buffer = (uint8_t *)aligned_alloc(PIXEL_ALIGN, 4 * (size_t)stride);
+    if (buffer == NULL)
+    {
+        printError(MEMORY_ERROR);
+        threadArgs->failed = 1;
+        return NULL;
+    }
+    uint8_t *magnitude = buffer + 3 * (size_t)stride;
+
+    TRACE_BEGIN(span, "luma edge");
+    int nextRow = threadArgs->startRow > 0 ? threadArgs->startRow - 1 : 0;
+    for (int y = threadArgs->startRow; y < threadArgs->endRow; y++)
+    {
+        // Luma rows y - 1 .. y + 1, each converted once per strip
+        int last = y + 1 < height ? y + 1 : height - 1;
+        for (; nextRow <= last; nextRow++)
+        {
+            lumaRow((const uint8_t *)imageIn->pixels[nextRow], buffer + (size_t)(nextRow % 3) * stride, width,
+                    imageIn->bytes_per_pixel);
+        }
+        const uint8_t *rows[3];
+        for (int ky = 0; ky < 3; ky++)
+        {
+            int row = y + ky - 1;
+            row = row < 0 ? 0 : (row >= height ? height - 1 : row);
+            rows[ky] = buffer + (size_t)(row % 3) * stride;
+        }
+
+        uint8_t *out = (uint8_t *)imageOut->pixels[y];
+        if (imageOut->bytes_per_pixel == 1)
+        {
+            convolveRow(edge, rows, out, y, width, height, 0, width, 1);
+            continue;
+        }
+        convolveRow(edge, rows, magnitude, y, width, height, 0, width, 1);
+        const uint8_t *grey[3] = {magnitude, magnitude, magnitude};
+        mergePlanarRow(grey, out, width, 3);
+    }
+    TRACE_END(span);
+
+    free(buffer);
+    return NULL;
+}
+
+/* Writes the luma edge map of rows [startRow, endRow) of imageIn (24-bit or
+ * 32-bit) to imageOut, which has bytes_per_pixel 1 (the magnitude itself)
+ * or 3 (the magnitude in every channel). Rows are cut into full-width
+ * strips; a strip converts its rows, and the one above and below it, once.
+ * Returns 0, or -1 if memory runs out and rows are left unwritten.
+ */
+int applyLumaEdge(ThreadPool *pool, BMP_Image *imageIn, BMP_Image *imageOut, int startRow, int endRow)
+{
+    int stripRows = getTileRows(pool, endRow - startRow, imageIn->header.width_px * imageIn->bytes_per_pixel, 1);
+
+    int numStrips = endRow > startRow ? (endRow - startRow + stripRows - 1) / stripRows : 0;
+    if (numStrips == 0)
+    {
+        return 0;
+    }
+    LumaThreadArgs *threadArgs = (LumaThreadArgs *)malloc(numStrips * sizeof(LumaThreadArgs));
+    if (threadArgs == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+
+    for (int i = 0; i < numStrips; i++)
+    {
+        threadArgs[i].imageIn = imageIn;
+        threadArgs[i].imageOut = imageOut;
+        threadArgs[i].startRow = startRow + i * stripRows;
+        threadArgs[i].endRow = threadArgs[i].startRow + stripRows < endRow ? threadArgs[i].startRow + stripRows : endRow;
+        threadArgs[i].failed = 0;
+    }
+
+    submitTaskBatch(pool, lumaEdgeThreadWorker, threadArgs, sizeof(LumaThreadArgs), numStrips);
+    waitThreadPool(pool);
+    int result = 0;
+    for (int i = 0; i < numStrips; i++)
+    {
+        result = threadArgs[i].failed ? -1 : result;
+    }
+    free(threadArgs);
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef _LUMA_H_
+#define _LUMA_H_
+#include <stdint.h>
+#include "bmp.h"
+#include "threadpool.h"
+
+/*
+ * Single-channel edge map. Every worker converts the rows it needs to luma
+ * on the fly with the integer BT.601 weights
+ *
+ *   Y = (77 R + 150 G + 29 B + 128) >> 8
+ *
+ * keeping only a ring of three luma rows, and runs one Prewitt pass (the
+ * "edge" kernel, same border) over them instead of one per channel. The
+ * magnitude is written either as an 8-bit image, saved with a grey palette,
+ * or replicated into the three channels of a 24-bit one.
+ */
+void setLumaEdgeOutput(int bitsPerPixel);
+int getLumaEdgeOutput(void);
+
+void lumaRow(const uint8_t *in, uint8_t *out, int width, int bytesPerPixel);
+int applyLumaEdge(ThreadPool *pool, BMP_Image *imageIn, BMP_Image *imageOut, int startRow, int endRow);
+
+#endif /* luma.h */
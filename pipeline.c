@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+#include "trace.h"
+
+typedef struct
+{
+    const KernelDescriptor *const *stages;
+    int numStages;
+    BMP_Image *imageIn;
+    BMP_Image *imageOut;
+    int startRow;
+    int endRow;
+    int failed; // Set by the worker when its rings cannot be allocated
+} PipelineThreadArgs;
+
+// Streaming state of one strip
+typedef struct
+{
+    const KernelDescriptor *const *stages;
+    int numStages;
+    BMP_Image *imageIn;
+    int width;
+    int height;
+    int bytesPerPixel;
+    int stride;
+    uint8_t *rings[MAX_PIPELINE_STAGES]; // Output ring of every stage but the last
+    int ringRows[MAX_PIPELINE_STAGES];
+    int nextRow[MAX_PIPELINE_STAGES]; // Next row each stage will produce
+} PipelineState;
+
+static int clampRow(int row, int height)
+{
+    return row < 0 ? 0 : (row >= height ? height - 1 : row);
+}
+
+static uint8_t *ringRow(PipelineState *state, int stage, int row)
+{
+    return state->rings[stage] + (size_t)(row % state->ringRows[stage]) * state->stride;
+}
+
+// Points rows at the input of stage around row y
+static void gatherRows(PipelineState *state, int stage, int y, const uint8_t **rows)
+{
+    const KernelDescriptor *kernel = state->stages[stage];
+    int radius = kernel->size / 2;
+    for (int ky = 0; ky < kernel->size; ky++)
+    {
+        int row = clampRow(y + ky - radius, state->height);
+        rows[ky] = stage == 0 ? (const uint8_t *)state->imageIn->pixels[row] : ringRow(state, stage - 1, row);
+    }
+}
+
+// Makes stage (not the last one) produce its rows up to upTo into its ring
+static void produceRows(PipelineState *state, int stage, int upTo)
+{
+    const KernelDescriptor *kernel = state->stages[stage];
+    const uint8_t *rows[MAX_KERNEL_SIZE];
+
+    while (state->nextRow[stage] <= upTo)
+    {
+        int y = state->nextRow[stage];
+        if (stage > 0)
+        {
+            produceRows(state, stage - 1, clampRow(y + kernel->size / 2, state->height));
+        }
+        gatherRows(state, stage, y, rows);
+        convolveRow(kernel, rows, ringRow(state, stage, y), y, state->width, state->height, 0, state->width,
+                    state->bytesPerPixel);
+        state->nextRow[stage]++;
+    }
+}
+
+// Pool task: streams rows [startRow, endRow) through every stage
+static void *pipelineThreadWorker(void *args)
+{
+    PipelineThreadArgs *threadArgs = (PipelineThreadArgs *)args;
+    PipelineState state = {0};
+    int last = threadArgs->numStages - 1;
+    const uint8_t *rows[MAX_KERNEL_SIZE];
+
+    state.stages = threadArgs->stages;
+    state.numStages = threadArgs->numStages;
+    state.imageIn = threadArgs->imageIn;
+    state.width = threadArgs->imageIn->header.width_px;
+    state.height = threadArgs->imageIn->norm_height;
+    state.bytesPerPixel = threadArgs->imageIn->bytes_per_pixel;
+    state.stride = getRowStride(state.width, state.bytesPerPixel);
+
+    // Stage s starts early enough to feed the halo of every later stage
+    int halo = 0;
+    for (int s = last - 1; s >= 0; s--)
+    {
+        halo += state.stages[s + 1]->size / 2;
+        state.nextRow[s] = clampRow(threadArgs->startRow - halo, state.height);
+        state.ringRows[s] = state.stages[s + 1]->size + 1;
+        state.rings[s] = (uint8_t *)aligned_alloc(PIXEL_ALIGN, (size_t)state.ringRows[s] * state.stride);
+        if (state.rings[s] == NULL)
+        {
+            printError(MEMORY_ERROR);
+            for (int t = s + 1; t < last; t++)
+            {
+                free(state.rings[t]);
+            }
+            threadArgs->failed = 1;
+            return NULL;
+        }
+    }
+
+    TRACE_BEGIN(span, "pipeline strip");
+    const KernelDescriptor *kernel = state.stages[last];
+    for (int y = threadArgs->startRow; y < threadArgs->endRow; y++)
+    {
+        if (last > 0)
+        {
+            produceRows(&state, last - 1, clampRow(y + kernel->size / 2, state.height));
+        }
+        gatherRows(&state, last, y, rows);
+        convolveRow(kernel, rows, (uint8_t *)threadArgs->imageOut->pixels[y], y, state.width, state.height, 0,
+                    state.width, state.bytesPerPixel);
+    }
+
+    TRACE_END(span);
+
+    for (int s = 0; s < last; s++)
+    {
+        free(state.rings[s]);
+    }
+    return NULL;
+}
+
+/* Applies stages[0], then stages[1], ... to rows [startRow, endRow) of
+ * imageIn and writes the final result to imageOut, in one fused pass.
+ * Rows are cut into full-width strips of the configured tile height; each
+ * strip recomputes the few halo rows its stages need from its neighbours.
+ * Returns 0, or -1 if memory runs out and rows are left unwritten.
+ */
+int applyParallelPipeline(ThreadPool *pool, const KernelDescriptor *const *stages, int numStages,
+                          BMP_Image *imageIn, BMP_Image *imageOut, int startRow, int endRow)
+{
+    if (numStages <= 0 || numStages > MAX_PIPELINE_STAGES)
+    {
+        fprintf(stderr, "A pipeline needs between 1 and %d stages\n", MAX_PIPELINE_STAGES);
+        return -1;
+    }
+    if (numStages == 1)
+    {
+        return applyParallelFilter(pool, stages[0], imageIn, imageOut, startRow, endRow);
+    }
+
+    // Full-width strips of the configured tile height (tile widths are ignored)
+    int stripRows = getTileRows(pool, endRow - startRow, imageIn->header.width_px * imageIn->bytes_per_pixel, 1);
+
+    int numStrips = endRow > startRow ? (endRow - startRow + stripRows - 1) / stripRows : 0;
+    if (numStrips == 0)
+    {
+        return 0;
+    }
+    PipelineThreadArgs *threadArgs = (PipelineThreadArgs *)malloc(numStrips * sizeof(PipelineThreadArgs));
+    if (threadArgs == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+
+    for (int i = 0; i < numStrips; i++)
+    {
+        threadArgs[i].stages = stages;
+        threadArgs[i].numStages = numStages;
+        threadArgs[i].imageIn = imageIn;
+        threadArgs[i].imageOut = imageOut;
+        threadArgs[i].startRow = startRow + i * stripRows;
+        threadArgs[i].endRow = threadArgs[i].startRow + stripRows < endRow ? threadArgs[i].startRow + stripRows : endRow;
+        threadArgs[i].failed = 0;
+    }
+
+    submitTaskBatch(pool, pipelineThreadWorker, threadArgs, sizeof(PipelineThreadArgs), numStrips);
+    waitThreadPool(pool);
+    int result = 0;
+    for (int i = 0; i < numStrips; i++)
+    {
+        result = threadArgs[i].failed ? -1 : result;
+    }
+    free(threadArgs);
+    return result;
+}
+
+/* Parses a comma separated list of kernel names, e.g. "gauss5,sobel".
+ * Returns 0 on success, -1 (with a message) on an unknown name or too many
+ * stages.
+ */
+int parseFilterChain(const char *spec, FilterChain *chain)
+{
+    char name[64];
+    chain->numStages = 0;
+
+    while (*spec != '\0')
+    {
+        size_t length = strcspn(spec, ",");
+        if (length == 0 || length >= sizeof(name))
+        {
+            fprintf(stderr, "Invalid filter list, expected names separated by commas\n");
+            return -1;
+        }
+        memcpy(name, spec, length);
+        name[length] = '\0';
+
+        const KernelDescriptor *kernel = findKernel(name);
+        if (kernel == NULL)
+        {
+            fprintf(stderr, "Unknown filter '%s' (available: %s)\n", name, listKernels());
+            return -1;
+        }
+        if (chain->numStages == MAX_PIPELINE_STAGES)
+        {
+            fprintf(stderr, "At most %d filters can be chained\n", MAX_PIPELINE_STAGES);
+            return -1;
+        }
+        chain->stages[chain->numStages++] = kernel;
+
+        spec += length;
+        if (*spec == ',')
+        {
+            spec++;
+        }
+    }
+    if (chain->numStages == 0)
+    {
+        fprintf(stderr, "Empty filter list\n");
+        return -1;
+    }
+    return 0;
+}
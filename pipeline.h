@@ -0,0 +1,28 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+#include "bmp.h"
+#include "convolution.h"
+#include "threadpool.h"
+
+/*
+ * Fused filter chains. Instead of one full-image pass per stage, every
+ * worker streams a strip of rows through all the stages: each intermediate
+ * stage keeps only a ring of (next kernel size + 1) rows, produced just
+ * before the next stage reads them. The result is identical to running the
+ * stages one after the other over the whole image.
+ */
+#define MAX_PIPELINE_STAGES 8
+
+// Stages of a chain, in application order
+typedef struct FilterChain
+{
+    const KernelDescriptor *stages[MAX_PIPELINE_STAGES];
+    int numStages;
+} FilterChain;
+
+int parseFilterChain(const char *spec, FilterChain *chain);
+
+int applyParallelPipeline(ThreadPool *pool, const KernelDescriptor *const *stages, int numStages,
+                          BMP_Image *imageIn, BMP_Image *imageOut, int startRow, int endRow);
+
+#endif /* pipeline.h */
@@ -0,0 +1,445 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "plan.h"
+#include "trace.h"
+
+#define CALIBRATION_WIDTH 512 // Pixels per row timed when a kernel is first costed
+#define CALIBRATION_ROWS 16
+#define CALIBRATION_RUNS 3 // The fastest run is kept
+#define MAX_COSTED_KERNELS 32
+
+typedef struct
+{
+    const KernelDescriptor *kernel;
+    BMP_Image *imageIn;
+    BMP_Image *imageOut;
+    Tile tile;
+    const uint8_t *mask; // Mask byte of (tile.startCol, maskRow), NULL without mask
+    int maskStride;
+    int maskRow;
+} PlanThreadArgs;
+
+typedef struct
+{
+    const KernelDescriptor *kernel;
+    double cost;
+} KernelCost;
+
+static const char *filterPlanSpec = NULL;
+
+static pthread_mutex_t costLock = PTHREAD_MUTEX_INITIALIZER;
+static KernelCost kernelCosts[MAX_COSTED_KERNELS];
+static int numKernelCosts = 0;
+
+/* Selects the plan applied by the batch mode instead of ex7's halves, in
+ * the syntax of parseFilterPlan, or NULL for the default split.
+ */
+void setFilterPlanSpec(const char *spec)
+{
+    filterPlanSpec = spec;
+}
+
+const char *getFilterPlanSpec(void)
+{
+    return filterPlanSpec;
+}
+
+/* Appends a region to plan. Returns 0, or -1 if the plan is full or the
+ * kernel is missing.
+ */
+int addPlanRegion(FilterPlan *plan, const KernelDescriptor *kernel, int x0, int y0, int x1, int y1,
+                  const uint8_t *mask, int maskStride)
+{
+    if (kernel == NULL || plan->numRegions == MAX_PLAN_REGIONS)
+    {
+        fprintf(stderr, "A plan holds at most %d regions, each with a filter\n", MAX_PLAN_REGIONS);
+        return -1;
+    }
+    FilterRegion *region = &plan->regions[plan->numRegions++];
+    region->kernel = kernel;
+    region->x0 = x0;
+    region->y0 = y0;
+    region->x1 = x1;
+    region->y1 = y1;
+    region->mask = mask;
+    region->maskStride = maskStride;
+    return 0;
+}
+
+// ex7's split: blur on rows [height / 2, height), edge on rows [0, height / 2)
+void setDefaultPlan(FilterPlan *plan, int width, int height)
+{
+    plan->numRegions = 0;
+    addPlanRegion(plan, findKernel("blur"), 0, height / 2, width, height, NULL, 0);
+    addPlanRegion(plan, findKernel("edge"), 0, 0, width, height / 2, NULL, 0);
+}
+
+// Reads a number of pixels, or a percentage of extent when followed by '%'
+static int parseCoordinate(const char **text, int extent, int *value)
+{
+    char *end;
+    long number = strtol(*text, &end, 10);
+    if (end == *text || number < 0 || number > 1000000)
+    {
+        return -1;
+    }
+    if (*end == '%')
+    {
+        number = number * extent / 100;
+        end++;
+    }
+    *value = (int)number;
+    *text = end;
+    return 0;
+}
+
+/* Builds the plan given by spec for an image of width x height pixels.
+ * Regions are separated by ';', each a filter name optionally followed by
+ * ":x,y,w,h", its rectangle measured from the top left corner of the
+ * picture in pixels or, with a '%' suffix, percent of the image size. A
+ * name alone covers the whole image. Returns 0, or -1 on a syntax error.
+ */
+int parseFilterPlan(const char *spec, int width, int height, FilterPlan *plan)
+{
+    char name[64];
+    plan->numRegions = 0;
+
+    while (*spec != '\0')
+    {
+        size_t length = strcspn(spec, ":;");
+        if (length == 0 || length >= sizeof(name))
+        {
+            fprintf(stderr, "Invalid plan, expected filter[:x,y,w,h] regions separated by ';'\n");
+            return -1;
+        }
+        memcpy(name, spec, length);
+        name[length] = '\0';
+        spec += length;
+
+        const KernelDescriptor *kernel = findKernel(name);
+        if (kernel == NULL)
+        {
+            fprintf(stderr, "Unknown filter '%s' (available: %s)\n", name, listKernels());
+            return -1;
+        }
+
+        int x = 0, y = 0, w = width, h = height;
+        if (*spec == ':')
+        {
+            spec++;
+            if (parseCoordinate(&spec, width, &x) != 0 || *spec++ != ',' ||
+                parseCoordinate(&spec, height, &y) != 0 || *spec++ != ',' ||
+                parseCoordinate(&spec, width, &w) != 0 || *spec++ != ',' ||
+                parseCoordinate(&spec, height, &h) != 0 || (*spec != ';' && *spec != '\0'))
+            {
+                fprintf(stderr, "Invalid rectangle for '%s', expected x,y,w,h\n", name);
+                return -1;
+            }
+        }
+
+        // pixels[0] is the bottom row of the picture
+        if (addPlanRegion(plan, kernel, x, height - y - h, x + w, height - y, NULL, 0) != 0)
+        {
+            return -1;
+        }
+        if (*spec == ';')
+        {
+            spec++;
+        }
+    }
+    if (plan->numRegions == 0)
+    {
+        fprintf(stderr, "Empty plan\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Intersects region with the image; returns 0 if nothing is left
+static int clipRegion(const FilterRegion *region, int width, int height, FilterRegion *clipped)
+{
+    *clipped = *region;
+    clipped->x0 = region->x0 < 0 ? 0 : region->x0;
+    clipped->y0 = region->y0 < 0 ? 0 : region->y0;
+    clipped->x1 = region->x1 > width ? width : region->x1;
+    clipped->y1 = region->y1 > height ? height : region->y1;
+    if (clipped->x0 >= clipped->x1 || clipped->y0 >= clipped->y1)
+    {
+        return 0;
+    }
+    if (region->mask != NULL)
+    {
+        clipped->mask = region->mask + (size_t)(clipped->y0 - region->y0) * region->maskStride +
+                        (clipped->x0 - region->x0);
+    }
+    return 1;
+}
+
+/* Returns 1 if the unmasked regions of plan, clipped to the image, cover
+ * every pixel, so the output needs no copy of the input first.
+ */
+int planCoversImage(const FilterPlan *plan, int width, int height)
+{
+    long long covered = 0;
+    for (int i = 0; i < plan->numRegions; i++)
+    {
+        FilterRegion clipped;
+        if (plan->regions[i].mask == NULL && clipRegion(&plan->regions[i], width, height, &clipped))
+        {
+            covered += (long long)(clipped.x1 - clipped.x0) * (clipped.y1 - clipped.y0);
+        }
+    }
+    return covered == (long long)width * height;
+}
+
+static double elapsedNanoseconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Times kernel on interior rows of noise, in nanoseconds per 24-bit pixel
+static double measureKernelCost(const KernelDescriptor *kernel)
+{
+    size_t rowBytes = (size_t)CALIBRATION_WIDTH * 3;
+    uint8_t *data = (uint8_t *)malloc((MAX_KERNEL_SIZE + 1) * rowBytes);
+    if (data == NULL)
+    {
+        return kernel->size * kernel->size * (kernel->combine == COMBINE_MAGNITUDE ? 2.0 : 1.0);
+    }
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < MAX_KERNEL_SIZE * rowBytes; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    const uint8_t *rows[MAX_KERNEL_SIZE];
+    for (int ky = 0; ky < kernel->size; ky++)
+    {
+        rows[ky] = data + ky * rowBytes;
+    }
+    uint8_t *out = data + MAX_KERNEL_SIZE * rowBytes;
+
+    // Row MAX_KERNEL_SIZE of a 2 * MAX_KERNEL_SIZE + 1 row image is away from every border
+    double best = 0.0;
+    for (int run = 0; run < CALIBRATION_RUNS; run++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < CALIBRATION_ROWS; i++)
+        {
+            convolveRow(kernel, rows, out, MAX_KERNEL_SIZE, CALIBRATION_WIDTH, 2 * MAX_KERNEL_SIZE + 1, 0,
+                        CALIBRATION_WIDTH, 3);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = elapsedNanoseconds(&start, &end);
+        best = run == 0 || elapsed < best ? elapsed : best;
+    }
+    free(data);
+    best = best < 1.0 ? 1.0 : best;
+    return best / ((double)CALIBRATION_ROWS * CALIBRATION_WIDTH);
+}
+
+/* Estimated cost of kernel, in nanoseconds per 24-bit pixel. Each kernel
+ * is timed once on this machine, the first time it is asked for, so the
+ * SIMD kernels are weighed as they actually run.
+ */
+double estimateKernelCost(const KernelDescriptor *kernel)
+{
+    pthread_mutex_lock(&costLock);
+    for (int i = 0; i < numKernelCosts; i++)
+    {
+        if (kernelCosts[i].kernel == kernel)
+        {
+            double cost = kernelCosts[i].cost;
+            pthread_mutex_unlock(&costLock);
+            return cost;
+        }
+    }
+    double cost = measureKernelCost(kernel);
+    if (numKernelCosts < MAX_COSTED_KERNELS)
+    {
+        kernelCosts[numKernelCosts].kernel = kernel;
+        kernelCosts[numKernelCosts].cost = cost;
+        numKernelCosts++;
+    }
+    pthread_mutex_unlock(&costLock);
+    return cost;
+}
+
+// Filters a tile row by row into scratch and keeps the pixels the mask selects
+static void convolveMaskedTile(const PlanThreadArgs *args)
+{
+    BMP_Image *imageIn = args->imageIn;
+    int width = imageIn->header.width_px;
+    int height = imageIn->norm_height;
+    int bpp = imageIn->bytes_per_pixel;
+    int radius = args->kernel->size / 2;
+    const Tile *tile = &args->tile;
+
+    uint8_t *scratch = (uint8_t *)malloc((size_t)width * bpp);
+    if (scratch == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return;
+    }
+    const uint8_t *rows[MAX_KERNEL_SIZE];
+    for (int y = tile->startRow; y < tile->endRow; y++)
+    {
+        for (int ky = 0; ky < args->kernel->size; ky++)
+        {
+            int row = y + ky - radius;
+            row = row < 0 ? 0 : (row >= height ? height - 1 : row);
+            rows[ky] = (const uint8_t *)imageIn->pixels[row];
+        }
+        convolveRow(args->kernel, rows, scratch, y, width, height, tile->startCol, tile->endCol, bpp);
+
+        const uint8_t *mask = args->mask + (size_t)(y - args->maskRow) * args->maskStride;
+        uint8_t *out = (uint8_t *)args->imageOut->pixels[y];
+        for (int x = tile->startCol; x < tile->endCol; x++)
+        {
+            if (mask[x - tile->startCol] != 0)
+            {
+                memcpy(out + (size_t)x * bpp, scratch + (size_t)x * bpp, bpp);
+            }
+        }
+    }
+    free(scratch);
+}
+
+// Pool task: one tile of one region
+static void *planThreadWorker(void *args)
+{
+    PlanThreadArgs *threadArgs = (PlanThreadArgs *)args;
+    TRACE_BEGIN(span, threadArgs->kernel->name);
+    if (threadArgs->mask == NULL)
+    {
+        convolveTile(threadArgs->kernel, threadArgs->imageIn, threadArgs->imageOut, &threadArgs->tile);
+    }
+    else
+    {
+        convolveMaskedTile(threadArgs);
+    }
+    TRACE_END(span);
+    return NULL;
+}
+
+static int regionsOverlap(const FilterRegion *a, const FilterRegion *b)
+{
+    return a->x0 < b->x1 && b->x0 < a->x1 && a->y0 < b->y1 && b->y0 < a->y1;
+}
+
+/* Applies every region of plan to imageIn, writing imageOut, in a single
+ * pool batch. Region i gets about threads * TASKS_PER_THREAD * cost(i) /
+ * cost(all) bands of rows, cut further to a configured tile size, and the
+ * bands of the regions with the costliest tasks are queued first. Returns
+ * 0, or -1 if two unmasked regions overlap or memory runs out.
+ */
+int applyFilterPlan(ThreadPool *pool, const FilterPlan *plan, BMP_Image *imageIn, BMP_Image *imageOut)
+{
+    int width = imageIn->header.width_px;
+    int height = imageIn->norm_height;
+    FilterRegion regions[MAX_PLAN_REGIONS];
+    double costs[MAX_PLAN_REGIONS];
+    int bands[MAX_PLAN_REGIONS];
+    int columns[MAX_PLAN_REGIONS];
+    int order[MAX_PLAN_REGIONS];
+    int numRegions = 0;
+    double totalCost = 0.0;
+
+    for (int i = 0; i < plan->numRegions; i++)
+    {
+        FilterRegion *region = &regions[numRegions];
+        if (!clipRegion(&plan->regions[i], width, height, region))
+        {
+            continue;
+        }
+        for (int j = 0; j < numRegions; j++)
+        {
+            if (region->mask == NULL && regions[j].mask == NULL && regionsOverlap(region, &regions[j]))
+            {
+                fprintf(stderr, "Plan regions %s and %s overlap\n", regions[j].kernel->name, region->kernel->name);
+                return -1;
+            }
+        }
+        costs[numRegions] = (double)(region->x1 - region->x0) * (region->y1 - region->y0) *
+                            estimateKernelCost(region->kernel) * imageIn->bytes_per_pixel / 3;
+        totalCost += costs[numRegions];
+        numRegions++;
+    }
+    if (numRegions == 0)
+    {
+        return 0;
+    }
+
+    // Share out the thread budget by estimated work
+    int tileWidth, tileHeight;
+    getTileSize(&tileWidth, &tileHeight);
+    int budget = getThreadPoolSize(pool) * TASKS_PER_THREAD;
+    int numTasks = 0;
+    for (int i = 0; i < numRegions; i++)
+    {
+        int rows = regions[i].y1 - regions[i].y0;
+        int cols = regions[i].x1 - regions[i].x0;
+        int share = (int)(budget * costs[i] / totalCost + 0.5);
+        if (tileHeight > 0 && share < (rows + tileHeight - 1) / tileHeight)
+        {
+            share = (rows + tileHeight - 1) / tileHeight;
+        }
+        bands[i] = share < 1 ? 1 : (share > rows ? rows : share);
+        columns[i] = tileWidth > 0 ? (cols + tileWidth - 1) / tileWidth : 1;
+        numTasks += bands[i] * columns[i];
+
+        // Insertion by cost per task, costliest first
+        int j = i;
+        while (j > 0 && costs[order[j - 1]] / (bands[order[j - 1]] * columns[order[j - 1]]) <
+                            costs[i] / (bands[i] * columns[i]))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    PlanThreadArgs *threadArgs = (PlanThreadArgs *)malloc(numTasks * sizeof(PlanThreadArgs));
+    if (threadArgs == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+
+    int task = 0;
+    for (int k = 0; k < numRegions; k++)
+    {
+        const FilterRegion *region = &regions[order[k]];
+        int rows = region->y1 - region->y0;
+        int cols = region->x1 - region->x0;
+        for (int b = 0; b < bands[order[k]]; b++)
+        {
+            for (int c = 0; c < columns[order[k]]; c++)
+            {
+                PlanThreadArgs *args = &threadArgs[task++];
+                args->kernel = region->kernel;
+                args->imageIn = imageIn;
+                args->imageOut = imageOut;
+                args->tile.startRow = region->y0 + (int)((long long)rows * b / bands[order[k]]);
+                args->tile.endRow = region->y0 + (int)((long long)rows * (b + 1) / bands[order[k]]);
+                args->tile.startCol = region->x0 + (int)((long long)cols * c / columns[order[k]]);
+                args->tile.endCol = region->x0 + (int)((long long)cols * (c + 1) / columns[order[k]]);
+                args->mask = region->mask != NULL ? region->mask + (args->tile.startCol - region->x0) : NULL;
+                args->maskStride = region->maskStride;
+                args->maskRow = region->y0;
+            }
+        }
+    }
+    TRACE_COUNT("plan tasks", numTasks);
+
+    submitTaskBatch(pool, planThreadWorker, threadArgs, sizeof(PlanThreadArgs), numTasks);
+    waitThreadPool(pool);
+    free(threadArgs);
+    return 0;
+}
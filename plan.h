@@ -0,0 +1,50 @@
+#ifndef _PLAN_H_
+#define _PLAN_H_
+#include <stdint.h>
+#include "bmp.h"
+#include "convolution.h"
+#include "threadpool.h"
+
+/*
+ * Filter plans: any kernel on any rectangle of the image, optionally
+ * restricted by a mask. Rectangles are in pixels[] coordinates, columns
+ * [x0, x1) and rows [y0, y1) counted from pixels[0]. A mask holds one byte
+ * per pixel of its rectangle, row y0 first; only pixels whose byte is not 0
+ * are written. Pixels outside every region are left as they are in the
+ * output, and regions without a mask must not overlap.
+ *
+ * All regions are filtered in one pool batch. The work of a region is
+ * estimated from its area and the measured cost of its kernel, and every
+ * region gets its share of the thread budget (threads * TASKS_PER_THREAD
+ * tasks) in proportion to it, so tasks cost about the same whatever the
+ * kernel and all regions finish together.
+ */
+#define MAX_PLAN_REGIONS 16
+
+typedef struct FilterRegion
+{
+    const KernelDescriptor *kernel;
+    int x0, y0, x1, y1;
+    const uint8_t *mask; // NULL: the whole rectangle
+    int maskStride;      // Bytes between mask rows
+} FilterRegion;
+
+typedef struct FilterPlan
+{
+    FilterRegion regions[MAX_PLAN_REGIONS];
+    int numRegions;
+} FilterPlan;
+
+void setFilterPlanSpec(const char *spec);
+const char *getFilterPlanSpec(void);
+
+int addPlanRegion(FilterPlan *plan, const KernelDescriptor *kernel, int x0, int y0, int x1, int y1,
+                  const uint8_t *mask, int maskStride);
+void setDefaultPlan(FilterPlan *plan, int width, int height);
+int parseFilterPlan(const char *spec, int width, int height, FilterPlan *plan);
+int planCoversImage(const FilterPlan *plan, int width, int height);
+
+double estimateKernelCost(const KernelDescriptor *kernel);
+int applyFilterPlan(ThreadPool *pool, const FilterPlan *plan, BMP_Image *imageIn, BMP_Image *imageOut);
+
+#endif /* plan.h */
@@ -0,0 +1,434 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "planar.h"
+#include "plan.h"
+#include "convolution.h"
+#include "kernels.h"
+#include "shm_image.h"
+#include "trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PLANAR_X86 1
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define ROWS_PER_TASK 16
+
+typedef void (*SplitFunction)(const uint8_t *in, uint8_t *const *out, int width);
+typedef void (*MergeFunction)(const uint8_t *const *in, uint8_t *out, int width);
+
+typedef struct
+{
+    BMP_Image *image;
+    PlanarImage *planar;
+    int startRow;
+    int endRow;
+} PlanarThreadArgs;
+
+static int planarLayout = 0;
+
+/* Makes the engine filter a planar copy of every image (1) or the
+ * interleaved pixels in place (0, the default).
+ */
+void setPlanarLayout(int enable)
+{
+    planarLayout = enable != 0;
+}
+
+int getPlanarLayout(void)
+{
+    return planarLayout;
+}
+
+/* Allocates planes for every channel of image (same size, bytes_per_pixel
+ * planes). Returns 0 on success, -1 if out of memory.
+ */
+int createPlanarImage(PlanarImage *planar, const BMP_Image *image)
+{
+    int width = image->header.width_px;
+    int height = image->norm_height;
+    int stride = getRowStride(width, 1);
+
+    planar->numPlanes = image->bytes_per_pixel;
+    if (planar->numPlanes < 3 || planar->numPlanes > MAX_PLANES)
+    {
+        fprintf(stderr, "No planar layout for %d bytes per pixel\n", planar->numPlanes);
+        return -1;
+    }
+    planar->data = (uint8_t *)allocPixelBuffer((size_t)planar->numPlanes * height * stride);
+    planar->rows = (Pixel **)malloc((size_t)planar->numPlanes * height * sizeof(Pixel *));
+    if (planar->data == NULL || planar->rows == NULL)
+    {
+        printError(MEMORY_ERROR);
+        free(planar->data);
+        free(planar->rows);
+        return -1;
+    }
+
+    for (int c = 0; c < planar->numPlanes; c++)
+    {
+        BMP_Image *plane = &planar->planes[c];
+        plane->header = image->header;
+        plane->header.bits_per_pixel = 8;
+        plane->norm_height = height;
+        plane->bytes_per_pixel = 1;
+        plane->stride = stride;
+        plane->pixel_data = planar->data + (size_t)c * height * stride;
+        plane->pixels = planar->rows + (size_t)c * height;
+        plane->mapping = NULL;
+        plane->mapping_size = 0;
+        for (int y = 0; y < height; y++)
+        {
+            plane->pixels[y] = (Pixel *)(plane->pixel_data + (size_t)y * stride);
+        }
+    }
+    return 0;
+}
+
+void freePlanarImage(PlanarImage *planar)
+{
+    free(planar->data);
+    free(planar->rows);
+    planar->data = NULL;
+    planar->rows = NULL;
+}
+
+// numPlanes is a constant in every caller, so each gets its own unrolled loop
+static ALWAYS_INLINE void splitPixels(const uint8_t *in, uint8_t *const *out, int from, int width, int numPlanes)
+{
+    for (int x = from; x < width; x++)
+    {
+        for (int c = 0; c < numPlanes; c++)
+        {
+            out[c][x] = in[numPlanes * x + c];
+        }
+    }
+}
+
+static ALWAYS_INLINE void mergePixels(const uint8_t *const *in, uint8_t *out, int from, int width, int numPlanes)
+{
+    for (int x = from; x < width; x++)
+    {
+        for (int c = 0; c < numPlanes; c++)
+        {
+            out[numPlanes * x + c] = in[c][x];
+        }
+    }
+}
+
+static void splitRow3Scalar(const uint8_t *in, uint8_t *const *out, int width)
+{
+    splitPixels(in, out, 0, width, 3);
+}
+
+static void splitRow4Scalar(const uint8_t *in, uint8_t *const *out, int width)
+{
+    splitPixels(in, out, 0, width, 4);
+}
+
+static void mergeRow3Scalar(const uint8_t *const *in, uint8_t *out, int width)
+{
+    mergePixels(in, out, 0, width, 3);
+}
+
+static void mergeRow4Scalar(const uint8_t *const *in, uint8_t *out, int width)
+{
+    mergePixels(in, out, 0, width, 4);
+}
+
+#ifdef PLANAR_X86
+/* 16 pixels per step. A BGR block is 48 bytes in three vectors: every plane
+ * vector is the OR of one byte shuffle of each (shuffle indices with the top
+ * bit set give 0), and the merge runs the same masks' inverse. BGRA groups
+ * each channel into one 32-bit lane per vector and transposes the lanes.
+ */
+static uint8_t splitMasks[3][3][16]; // [input vector][plane][output byte]
+static uint8_t mergeMasks[3][3][16]; // [output vector][plane][output byte]
+
+static void buildShuffleMasks(void)
+{
+    for (int v = 0; v < 3; v++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                int source = 3 * i + c; // Byte of the block holding pixel i of plane c
+                int target = 16 * v + i; // Byte of the block written from the planes
+                splitMasks[v][c][i] = source / 16 == v ? source % 16 : 0x80;
+                mergeMasks[v][c][i] = target % 3 == c ? target / 3 : 0x80;
+            }
+        }
+    }
+}
+
+__attribute__((target("ssse3"))) static void splitRow3SSSE3(const uint8_t *in, uint8_t *const *out, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i v[3];
+        for (int i = 0; i < 3; i++)
+        {
+            v[i] = _mm_loadu_si128((const __m128i *)(in + 3 * x + 16 * i));
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            __m128i plane = _mm_shuffle_epi8(v[0], _mm_loadu_si128((const __m128i *)splitMasks[0][c]));
+            plane = _mm_or_si128(plane, _mm_shuffle_epi8(v[1], _mm_loadu_si128((const __m128i *)splitMasks[1][c])));
+            plane = _mm_or_si128(plane, _mm_shuffle_epi8(v[2], _mm_loadu_si128((const __m128i *)splitMasks[2][c])));
+            _mm_storeu_si128((__m128i *)(out[c] + x), plane);
+        }
+    }
+    splitPixels(in, out, x, width, 3);
+}
+
+__attribute__((target("ssse3"))) static void mergeRow3SSSE3(const uint8_t *const *in, uint8_t *out, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i planes[3];
+        for (int c = 0; c < 3; c++)
+        {
+            planes[c] = _mm_loadu_si128((const __m128i *)(in[c] + x));
+        }
+        for (int v = 0; v < 3; v++)
+        {
+            const __m128i *masks = (const __m128i *)mergeMasks[v];
+            __m128i block = _mm_shuffle_epi8(planes[0], _mm_loadu_si128(&masks[0]));
+            block = _mm_or_si128(block, _mm_shuffle_epi8(planes[1], _mm_loadu_si128(&masks[1])));
+            block = _mm_or_si128(block, _mm_shuffle_epi8(planes[2], _mm_loadu_si128(&masks[2])));
+            _mm_storeu_si128((__m128i *)(out + 3 * x + 16 * v), block);
+        }
+    }
+    mergePixels(in, out, x, width, 3);
+}
+
+__attribute__((target("ssse3"))) static void splitRow4SSSE3(const uint8_t *in, uint8_t *const *out, int width)
+{
+    const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i v[4];
+        for (int i = 0; i < 4; i++)
+        {
+            v[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 4 * x + 16 * i)), group);
+        }
+        __m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+        __m128i t1 = _mm_unpackhi_epi32(v[0], v[1]);
+        __m128i t2 = _mm_unpacklo_epi32(v[2], v[3]);
+        __m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+        _mm_storeu_si128((__m128i *)(out[0] + x), _mm_unpacklo_epi64(t0, t2));
+        _mm_storeu_si128((__m128i *)(out[1] + x), _mm_unpackhi_epi64(t0, t2));
+        _mm_storeu_si128((__m128i *)(out[2] + x), _mm_unpacklo_epi64(t1, t3));
+        _mm_storeu_si128((__m128i *)(out[3] + x), _mm_unpackhi_epi64(t1, t3));
+    }
+    splitPixels(in, out, x, width, 4);
+}
+
+static void mergeRow4SSE2(const uint8_t *const *in, uint8_t *out, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)(in[0] + x));
+        __m128i g = _mm_loadu_si128((const __m128i *)(in[1] + x));
+        __m128i r = _mm_loadu_si128((const __m128i *)(in[2] + x));
+        __m128i a = _mm_loadu_si128((const __m128i *)(in[3] + x));
+        __m128i bgLo = _mm_unpacklo_epi8(b, g), bgHi = _mm_unpackhi_epi8(b, g);
+        __m128i raLo = _mm_unpacklo_epi8(r, a), raHi = _mm_unpackhi_epi8(r, a);
+        _mm_storeu_si128((__m128i *)(out + 4 * x), _mm_unpacklo_epi16(bgLo, raLo));
+        _mm_storeu_si128((__m128i *)(out + 4 * x + 16), _mm_unpackhi_epi16(bgLo, raLo));
+        _mm_storeu_si128((__m128i *)(out + 4 * x + 32), _mm_unpacklo_epi16(bgHi, raHi));
+        _mm_storeu_si128((__m128i *)(out + 4 * x + 48), _mm_unpackhi_epi16(bgHi, raHi));
+    }
+    mergePixels(in, out, x, width, 4);
+}
+#endif
+
+static pthread_once_t convertersOnce = PTHREAD_ONCE_INIT;
+static SplitFunction splitRow3 = splitRow3Scalar;
+static SplitFunction splitRow4 = splitRow4Scalar;
+static MergeFunction mergeRow3 = mergeRow3Scalar;
+static MergeFunction mergeRow4 = mergeRow4Scalar;
+
+static void selectConverters(void)
+{
+#ifdef PLANAR_X86
+    if (getKernelISALimit() < KERNEL_ISA_SSE2)
+    {
+        return;
+    }
+    mergeRow4 = mergeRow4SSE2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        buildShuffleMasks();
+        splitRow3 = splitRow3SSSE3;
+        splitRow4 = splitRow4SSSE3;
+        mergeRow3 = mergeRow3SSSE3;
+    }
+#endif
+}
+
+/* Deinterleaves width pixels of numPlanes (3 or 4) channels from in into
+ * the rows planes[0..numPlanes-1].
+ */
+void splitPlanarRow(const uint8_t *in, uint8_t *const *planes, int width, int numPlanes)
+{
+    pthread_once(&convertersOnce, selectConverters);
+    (numPlanes == 4 ? splitRow4 : splitRow3)(in, planes, width);
+}
+
+/* Interleaves width pixels from the rows planes[0..numPlanes-1] into out.
+ */
+void mergePlanarRow(const uint8_t *const *planes, uint8_t *out, int width, int numPlanes)
+{
+    pthread_once(&convertersOnce, selectConverters);
+    (numPlanes == 4 ? mergeRow4 : mergeRow3)(planes, out, width);
+}
+
+// Pool task: deinterleaves rows [startRow, endRow)
+static void *splitThreadWorker(void *args)
+{
+    PlanarThreadArgs *threadArgs = (PlanarThreadArgs *)args;
+    PlanarImage *planar = threadArgs->planar;
+    int width = threadArgs->image->header.width_px;
+    uint8_t *out[MAX_PLANES];
+
+    for (int y = threadArgs->startRow; y < threadArgs->endRow; y++)
+    {
+        const uint8_t *in = (const uint8_t *)threadArgs->image->pixels[y];
+        for (int c = 0; c < planar->numPlanes; c++)
+        {
+            out[c] = (uint8_t *)planar->planes[c].pixels[y];
+        }
+        (planar->numPlanes == 4 ? splitRow4 : splitRow3)(in, out, width);
+    }
+    return NULL;
+}
+
+// Pool task: interleaves rows [startRow, endRow)
+static void *mergeThreadWorker(void *args)
+{
+    PlanarThreadArgs *threadArgs = (PlanarThreadArgs *)args;
+    PlanarImage *planar = threadArgs->planar;
+    int width = threadArgs->image->header.width_px;
+    const uint8_t *in[MAX_PLANES];
+
+    for (int y = threadArgs->startRow; y < threadArgs->endRow; y++)
+    {
+        uint8_t *out = (uint8_t *)threadArgs->image->pixels[y];
+        for (int c = 0; c < planar->numPlanes; c++)
+        {
+            in[c] = (const uint8_t *)planar->planes[c].pixels[y];
+        }
+        (planar->numPlanes == 4 ? mergeRow4 : mergeRow3)(in, out, width);
+    }
+    return NULL;
+}
+
+// Runs worker over every row of image in blocks of ROWS_PER_TASK rows. Returns 0, or -1 if out of memory
+static int convertRowsParallel(ThreadPool *pool, TaskFunction worker, BMP_Image *image, PlanarImage *planar)
+{
+    int height = image->norm_height;
+    int numTasks = (height + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+    PlanarThreadArgs *threadArgs = (PlanarThreadArgs *)malloc(numTasks * sizeof(PlanarThreadArgs));
+    if (threadArgs == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+
+    for (int i = 0; i < numTasks; i++)
+    {
+        threadArgs[i].image = image;
+        threadArgs[i].planar = planar;
+        threadArgs[i].startRow = i * ROWS_PER_TASK;
+        threadArgs[i].endRow = (i + 1) * ROWS_PER_TASK < height ? (i + 1) * ROWS_PER_TASK : height;
+    }
+    submitTaskBatch(pool, worker, threadArgs, sizeof(PlanarThreadArgs), numTasks);
+    waitThreadPool(pool);
+    free(threadArgs);
+    return 0;
+}
+
+/* Copies the interleaved pixels of image into the planes of planar.
+ * Returns 0, or -1 if memory runs out and the planes are left unwritten.
+ */
+int splitPlanes(ThreadPool *pool, BMP_Image *image, PlanarImage *planar)
+{
+    pthread_once(&convertersOnce, selectConverters);
+    TRACE_BEGIN(span, "planar split");
+    int result = convertRowsParallel(pool, splitThreadWorker, image, planar);
+    TRACE_END(span);
+    return result;
+}
+
+/* Interleaves the planes of planar back into the pixels of image.
+ * Returns 0, or -1 if memory runs out and image is left unwritten.
+ */
+int mergePlanes(ThreadPool *pool, PlanarImage *planar, BMP_Image *image)
+{
+    pthread_once(&convertersOnce, selectConverters);
+    TRACE_BEGIN(span, "planar merge");
+    int result = convertRowsParallel(pool, mergeThreadWorker, image, planar);
+    TRACE_END(span);
+    return result;
+}
+
+/* Filters imageIn into imageOut through the planar layout: the input is
+ * split once, chain (or ex7's default blur / edge split when it has no
+ * stages) runs on the B, G and R planes, and the result is merged into
+ * imageOut. Alpha is not filtered: the output reuses the input's alpha
+ * plane. Returns 0 on success, -1 if the planes cannot be allocated or a
+ * conversion or filter runs out of memory.
+ */
+int applyPlanarChain(ThreadPool *pool, const FilterChain *chain, BMP_Image *imageIn, BMP_Image *imageOut)
+{
+    PlanarImage in, out;
+    if (createPlanarImage(&in, imageIn) != 0)
+    {
+        return -1;
+    }
+    if (createPlanarImage(&out, imageIn) != 0)
+    {
+        freePlanarImage(&in);
+        return -1;
+    }
+
+    int height = imageIn->norm_height;
+    int result = splitPlanes(pool, imageIn, &in);
+    for (int c = 0; c < 3 && result == 0; c++)
+    {
+        if (chain->numStages == 0)
+        {
+            FilterPlan plan;
+            setDefaultPlan(&plan, imageIn->header.width_px, height);
+            result = applyFilterPlan(pool, &plan, &in.planes[c], &out.planes[c]);
+        }
+        else
+        {
+            result = applyParallelPipeline(pool, chain->stages, chain->numStages, &in.planes[c], &out.planes[c], 0,
+                                           height);
+        }
+    }
+    if (in.numPlanes == 4)
+    {
+        out.planes[3] = in.planes[3];
+    }
+
+    if (result == 0)
+    {
+        result = mergePlanes(pool, &out, imageOut);
+    }
+    freePlanarImage(&out);
+    freePlanarImage(&in);
+    return result;
+}
@@ -0,0 +1,45 @@
+#ifndef _PLANAR_H_
+#define _PLANAR_H_
+#include "bmp.h"
+#include "threadpool.h"
+#include "pipeline.h"
+
+/*
+ * Planar (structure of arrays) layout for the filter engine. An interleaved
+ * BGR or BGRA image is split once into one 8-bit plane per channel:
+ *   --------------------------
+ *   |   B rows   |   stride  |
+ *   |-------------------------
+ *   |   G rows   |           |   every plane row starts on a PIXEL_ALIGN
+ *   |-------------------------   boundary, so a kernel sees plain 1-byte
+ *   |   R rows   |           |   pixels with no channel interleaving
+ *   |-------------------------
+ *   |   A rows   |           |   32-bit images only
+ *   --------------------------
+ * Each plane is exposed as an ordinary BMP_Image with bytes_per_pixel 1, so
+ * the kernels and the pipeline run on it unchanged, and the result is
+ * merged back into the interleaved output once.
+ */
+#define MAX_PLANES 4
+
+typedef struct PlanarImage
+{
+    int numPlanes;                // 3 (BGR) or 4 (BGRA)
+    BMP_Image planes[MAX_PLANES]; // 8-bit views, one per channel
+    uint8_t *data;                // Pixels of every plane, one allocation
+    Pixel **rows;                 // Row tables of every plane
+} PlanarImage;
+
+void setPlanarLayout(int enable);
+int getPlanarLayout(void);
+
+void splitPlanarRow(const uint8_t *in, uint8_t *const *planes, int width, int numPlanes);
+void mergePlanarRow(const uint8_t *const *planes, uint8_t *out, int width, int numPlanes);
+
+int createPlanarImage(PlanarImage *planar, const BMP_Image *image);
+void freePlanarImage(PlanarImage *planar);
+int splitPlanes(ThreadPool *pool, BMP_Image *image, PlanarImage *planar);
+int mergePlanes(ThreadPool *pool, PlanarImage *planar, BMP_Image *image);
+int applyPlanarChain(ThreadPool *pool, const FilterChain *chain, BMP_Image *imageIn, BMP_Image *imageOut);
+
+#endif /* planar.h */
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sequence.h"
+#include "convolution.h"
+#include "shm_image.h"
+#include "trace.h"
+
+struct FrameSequence
+{
+    int tileSize;
+    BMP_Image *previous; // Last frame, kept to compare the next one with
+    BMP_Image *output;   // Its result, in anonymous memory
+    uint8_t *dirty;      // One flag per tile, row by row
+    uint8_t *columns;    // One flag per tile column, scratch of the strip walk
+    int tilesX;
+    int tilesY;
+    SequenceStats stats;
+};
+
+// Pool task: compares one row of tiles with the previous frame
+typedef struct
+{
+    const FrameSequence *sequence;
+    const BMP_Image *frame;
+    int tileRow;
+} DiffThreadArgs;
+
+// Pool task: filters one rectangle of one region
+typedef struct
+{
+    const KernelDescriptor *kernel;
+    BMP_Image *imageIn;
+    BMP_Image *imageOut;
+    Tile tile;
+} RefilterThreadArgs;
+
+// Growable list of refilter tasks
+typedef struct
+{
+    RefilterThreadArgs *tasks;
+    int count;
+    int capacity;
+} RefilterList;
+
+/* Creates the state of a frame sequence compared in tiles of tileSize
+ * pixels square (DEFAULT_SEQUENCE_TILE if 0). Returns NULL on failure.
+ */
+FrameSequence *createFrameSequence(int tileSize)
+{
+    FrameSequence *sequence = (FrameSequence *)calloc(1, sizeof(FrameSequence));
+    if (sequence == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return NULL;
+    }
+    sequence->tileSize = tileSize > 0 ? tileSize : DEFAULT_SEQUENCE_TILE;
+    sequence->tileSize = sequence->tileSize < MIN_SEQUENCE_TILE ? MIN_SEQUENCE_TILE : sequence->tileSize;
+    return sequence;
+}
+
+static void *diffThreadWorker(void *args)
+{
+    DiffThreadArgs *threadArgs = (DiffThreadArgs *)args;
+    const FrameSequence *sequence = threadArgs->sequence;
+    const BMP_Image *frame = threadArgs->frame;
+    int bpp = frame->bytes_per_pixel;
+    int width = frame->header.width_px;
+    int startRow = threadArgs->tileRow * sequence->tileSize;
+    int endRow = startRow + sequence->tileSize < frame->norm_height ? startRow + sequence->tileSize
+                                                                     : frame->norm_height;
+    uint8_t *dirty = sequence->dirty + (size_t)threadArgs->tileRow * sequence->tilesX;
+
+    for (int tx = 0; tx < sequence->tilesX; tx++)
+    {
+        int startCol = tx * sequence->tileSize;
+        int endCol = startCol + sequence->tileSize < width ? startCol + sequence->tileSize : width;
+        size_t offset = (size_t)startCol * bpp;
+        size_t length = (size_t)(endCol - startCol) * bpp;
+        dirty[tx] = 0;
+        for (int y = startRow; y < endRow && !dirty[tx]; y++)
+        {
+            dirty[tx] = memcmp((const uint8_t *)frame->pixels[y] + offset,
+                               (const uint8_t *)sequence->previous->pixels[y] + offset, length) != 0;
+        }
+    }
+    return NULL;
+}
+
+static void *refilterThreadWorker(void *args)
+{
+    RefilterThreadArgs *threadArgs = (RefilterThreadArgs *)args;
+    TRACE_BEGIN(span, threadArgs->kernel->name);
+    convolveTile(threadArgs->kernel, threadArgs->imageIn, threadArgs->imageOut, &threadArgs->tile);
+    TRACE_END(span);
+    return NULL;
+}
+
+static int addRefilterTask(RefilterList *list, const KernelDescriptor *kernel, const Tile *tile)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity > 0 ? 2 * list->capacity : 64;
+        RefilterThreadArgs *tasks =
+            (RefilterThreadArgs *)realloc(list->tasks, capacity * sizeof(RefilterThreadArgs));
+        if (tasks == NULL)
+        {
+            printError(MEMORY_ERROR);
+            return -1;
+        }
+        list->tasks = tasks;
+        list->capacity = capacity;
+    }
+    list->tasks[list->count].kernel = kernel;
+    list->tasks[list->count].tile = *tile;
+    list->count++;
+    return 0;
+}
+
+// Queues the part of rectangle rect inside each region of plan
+static int addRectangle(RefilterList *list, const FilterPlan *plan, const Tile *rect)
+{
+    for (int i = 0; i < plan->numRegions; i++)
+    {
+        const FilterRegion *region = &plan->regions[i];
+        Tile part;
+        part.startRow = rect->startRow > region->y0 ? rect->startRow : region->y0;
+        part.endRow = rect->endRow < region->y1 ? rect->endRow : region->y1;
+        part.startCol = rect->startCol > region->x0 ? rect->startCol : region->x0;
+        part.endCol = rect->endCol < region->x1 ? rect->endCol : region->x1;
+        if (part.startRow < part.endRow && part.startCol < part.endCol && addRefilterTask(list, region->kernel, &part))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Cuts the changed tiles, grown by halo pixels, into disjoint rectangles
+ * and queues them. The rows are split into strips at every tile edge plus
+ * and minus the halo; inside a strip the same tile rows reach every row,
+ * so the union of their flags gives the strip's column runs. Returns the
+ * number of pixels queued, or -1 when out of memory.
+ */
+static long long collectRectangles(FrameSequence *sequence, const FilterPlan *plan, int width, int height, int halo,
+                                   RefilterList *list)
+{
+    int tile = sequence->tileSize;
+    long long area = 0;
+    int top = 0;
+    while (top < height)
+    {
+        // The strip ends at the next tile edge plus or minus the halo
+        int edge = top / tile * tile;
+        int bottom = height;
+        for (int candidate = edge - tile; candidate <= edge + 2 * tile; candidate += tile)
+        {
+            int cut = candidate > height ? height : candidate;
+            if (cut - halo > top && cut - halo < bottom)
+            {
+                bottom = cut - halo;
+            }
+            if (cut + halo > top && cut + halo < bottom)
+            {
+                bottom = cut + halo;
+            }
+        }
+
+        // Tile rows whose grown rows cover the strip
+        memset(sequence->columns, 0, sequence->tilesX);
+        int any = 0;
+        for (int ty = (top - halo) / tile - 1; ty <= (top + halo) / tile + 1; ty++)
+        {
+            if (ty < 0 || ty >= sequence->tilesY || ty * tile - halo > top ||
+                (ty + 1) * tile + halo < bottom)
+            {
+                continue;
+            }
+            const uint8_t *dirty = sequence->dirty + (size_t)ty * sequence->tilesX;
+            for (int tx = 0; tx < sequence->tilesX; tx++)
+            {
+                sequence->columns[tx] |= dirty[tx];
+                any |= dirty[tx];
+            }
+        }
+
+        // Grown runs of changed tiles, kept apart by tiles wider than twice the halo
+        for (int tx = 0; any && tx < sequence->tilesX;)
+        {
+            if (!sequence->columns[tx])
+            {
+                tx++;
+                continue;
+            }
+            int end = tx;
+            while (end < sequence->tilesX && sequence->columns[end])
+            {
+                end++;
+            }
+            Tile rect = {top, bottom, tx * tile - halo, end * tile + halo};
+            rect.startCol = rect.startCol < 0 ? 0 : rect.startCol;
+            rect.endCol = rect.endCol > width ? width : rect.endCol;
+            area += (long long)(rect.endCol - rect.startCol) * (rect.endRow - rect.startRow);
+            if (addRectangle(list, plan, &rect) != 0)
+            {
+                return -1;
+            }
+            tx = end;
+        }
+        top = bottom;
+    }
+    return area;
+}
+
+// Copies the changed tiles of frame to the output, for the pixels outside every region
+static void copyDirtyTiles(FrameSequence *sequence, BMP_Image *frame)
+{
+    int width = frame->header.width_px;
+    int bpp = frame->bytes_per_pixel;
+    int tile = sequence->tileSize;
+    for (int ty = 0; ty < sequence->tilesY; ty++)
+    {
+        int endRow = (ty + 1) * tile < frame->norm_height ? (ty + 1) * tile : frame->norm_height;
+        for (int tx = 0; tx < sequence->tilesX; tx++)
+        {
+            if (!sequence->dirty[(size_t)ty * sequence->tilesX + tx])
+            {
+                continue;
+            }
+            int endCol = (tx + 1) * tile < width ? (tx + 1) * tile : width;
+            size_t offset = (size_t)tx * tile * bpp;
+            for (int y = ty * tile; y < endRow; y++)
+            {
+                memcpy((uint8_t *)sequence->output->pixels[y] + offset, (const uint8_t *)frame->pixels[y] + offset,
+                       (size_t)(endCol - tx * tile) * bpp);
+            }
+        }
+    }
+}
+
+// Filters frame in full, into a new output laid out like its file unless reuse is set
+static int filterWholeFrame(ThreadPool *pool, FrameSequence *sequence, const FilterPlan *plan, BMP_Image *frame,
+                            int reuse)
+{
+    int width = frame->header.width_px;
+    int height = frame->norm_height;
+    if (sequence->output == NULL || !reuse)
+    {
+        freeImage(sequence->output);
+        sequence->output = mapBMPOutputImage(-1, &frame->header);
+        if (sequence->output == NULL)
+        {
+            printError(MEMORY_ERROR);
+            return -1;
+        }
+        adviseHugePages(sequence->output->mapping, sequence->output->mapping_size);
+    }
+    if (!planCoversImage(plan, width, height))
+    {
+        size_t rowBytes = (size_t)width * frame->bytes_per_pixel;
+        for (int y = 0; y < height; y++)
+        {
+            memcpy(sequence->output->pixels[y], frame->pixels[y], rowBytes);
+        }
+    }
+    return applyFilterPlan(pool, plan, frame, sequence->output);
+}
+
+/* Filters frame, the next one of the sequence, with plan and sets output
+ * to the result, which stays valid until the next call. Tiles that did not
+ * change since the previous frame keep their previous result. share, unless
+ * NULL, is set to the part of the frame filtered again. The sequence takes
+ * frame over in every case and frees it with the next frame. Returns 0, or
+ * -1 on failure, after which the next frame is filtered in full.
+ */
+int filterFrame(ThreadPool *pool, FrameSequence *sequence, const FilterPlan *plan, BMP_Image *frame,
+                BMP_Image **output, double *share)
+{
+    int width = frame->header.width_px;
+    int height = frame->norm_height;
+    int tile = sequence->tileSize;
+    int halo = 0;
+    int masked = 0;
+    for (int i = 0; i < plan->numRegions; i++)
+    {
+        int radius = plan->regions[i].kernel->size / 2;
+        halo = radius > halo ? radius : halo;
+        masked |= plan->regions[i].mask != NULL;
+    }
+
+    int sameHeader = sequence->previous != NULL &&
+                     memcmp(&sequence->previous->header, &frame->header, sizeof(BMP_Header)) == 0;
+    int comparable = sameHeader && sequence->output != NULL && sequence->dirty != NULL &&
+                     sequence->columns != NULL && !masked;
+    long long area = (long long)width * height;
+    long long refiltered = area;
+    int result = 0;
+    sequence->stats.frames++;
+
+    if (comparable)
+    {
+        TRACE_BEGIN(diffSpan, "diff");
+        DiffThreadArgs *diffArgs = (DiffThreadArgs *)malloc(sequence->tilesY * sizeof(DiffThreadArgs));
+        if (diffArgs == NULL)
+        {
+            printError(MEMORY_ERROR);
+            comparable = 0;
+        }
+        for (int ty = 0; comparable && ty < sequence->tilesY; ty++)
+        {
+            diffArgs[ty].sequence = sequence;
+            diffArgs[ty].frame = frame;
+            diffArgs[ty].tileRow = ty;
+        }
+        if (comparable)
+        {
+            submitTaskBatch(pool, diffThreadWorker, diffArgs, sizeof(DiffThreadArgs), sequence->tilesY);
+            waitThreadPool(pool);
+        }
+        free(diffArgs);
+        TRACE_END(diffSpan);
+    }
+
+    if (comparable)
+    {
+        int tiles = sequence->tilesX * sequence->tilesY;
+        int dirtyTiles = 0;
+        for (int i = 0; i < tiles; i++)
+        {
+            dirtyTiles += sequence->dirty[i];
+        }
+        RefilterList list = {NULL, 0, 0};
+        refiltered = collectRectangles(sequence, plan, width, height, halo, &list);
+        if (refiltered >= 0 && refiltered <= area * FULL_REFILTER_SHARE)
+        {
+            if (!planCoversImage(plan, width, height))
+            {
+                copyDirtyTiles(sequence, frame);
+            }
+            for (int i = 0; i < list.count; i++)
+            {
+                list.tasks[i].imageIn = frame;
+                list.tasks[i].imageOut = sequence->output;
+            }
+            TRACE_COUNT("refilter tasks", list.count);
+            if (list.count > 0)
+            {
+                submitTaskBatch(pool, refilterThreadWorker, list.tasks, sizeof(RefilterThreadArgs), list.count);
+                waitThreadPool(pool);
+            }
+        }
+        else
+        {
+            comparable = 0; // Changed almost everywhere
+            refiltered = area;
+        }
+        free(list.tasks);
+        sequence->stats.tiles += tiles;
+        sequence->stats.dirtyTiles += dirtyTiles;
+        sequence->stats.pixels += area;
+        sequence->stats.refiltered += refiltered;
+    }
+    else if (!sameHeader)
+    {
+        // New frame size: new tile grid
+        sequence->tilesX = (width + tile - 1) / tile;
+        sequence->tilesY = (height + tile - 1) / tile;
+        free(sequence->dirty);
+        free(sequence->columns);
+        sequence->dirty = (uint8_t *)malloc((size_t)sequence->tilesX * sequence->tilesY);
+        sequence->columns = (uint8_t *)malloc(sequence->tilesX);
+        if (sequence->dirty == NULL || sequence->columns == NULL)
+        {
+            printError(MEMORY_ERROR);
+            result = -1;
+        }
+    }
+
+    if (result == 0 && !comparable)
+    {
+        sequence->stats.fullFrames++;
+        result = filterWholeFrame(pool, sequence, plan, frame, sameHeader);
+    }
+
+    freeImage(sequence->previous);
+    sequence->previous = frame;
+    if (result != 0)
+    {
+        // Start over with the next frame
+        freeImage(sequence->output);
+        sequence->output = NULL;
+    }
+    *output = sequence->output;
+    if (share != NULL)
+    {
+        *share = area > 0 ? (double)refiltered / area : 0.0;
+    }
+    return result;
+}
+
+void getSequenceStats(const FrameSequence *sequence, SequenceStats *stats)
+{
+    *stats = sequence->stats;
+}
+
+void destroyFrameSequence(FrameSequence *sequence)
+{
+    if (sequence != NULL)
+    {
+        freeImage(sequence->previous);
+        freeImage(sequence->output);
+        free(sequence->dirty);
+        free(sequence->columns);
+        free(sequence);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef _SEQUENCE_H_
+#define _SEQUENCE_H_
+#include "bmp.h"
+#include "plan.h"
+#include "threadpool.h"
+
+/*
+ * Incremental filtering of frame sequences, such as the frames of a fixed
+ * camera. Each frame is compared with the previous one tile by tile; only
+ * the tiles that changed, grown by the kernel radius (the halo whose
+ * output reads them), are filtered again, and the previous output is kept
+ * everywhere else:
+ *
+ *   +---+---+---+---+      changed tile X, refiltered area #
+ *   |   |  #|###|#  |
+ *   +---+---+---+---+      The result is the same as filtering the whole
+ *   |   |  #| X |#  |      frame, for any plan without masks.
+ *   +---+---+---+---+
+ *   |   |  #|###|#  |
+ *
+ * The first frame, a frame whose header differs from the previous one and
+ * a frame that changed almost everywhere are filtered in full.
+ */
+#define DEFAULT_SEQUENCE_TILE 32
+#define MIN_SEQUENCE_TILE 8     // More than twice the largest halo
+#define FULL_REFILTER_SHARE 0.5 // Above this share of the pixels, filter the whole frame
+
+typedef struct FrameSequence FrameSequence;
+
+typedef struct SequenceStats
+{
+    int frames;
+    int fullFrames;       // Filtered in full
+    long long tiles;      // Tiles compared, over every frame after the first
+    long long dirtyTiles; // Of those, tiles that changed
+    long long pixels;     // Pixels of the same frames
+    long long refiltered; // Of those, pixels filtered again
+} SequenceStats;
+
+FrameSequence *createFrameSequence(int tileSize);
+int filterFrame(ThreadPool *pool, FrameSequence *sequence, const FilterPlan *plan, BMP_Image *frame,
+                BMP_Image **output, double *share);
+void getSequenceStats(const FrameSequence *sequence, SequenceStats *stats);
+void destroyFrameSequence(FrameSequence *sequence);
+
+#endif /* sequence.h */
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+
+#include "shm_image.h"
+#include "trace.h"
+
+// Segments smaller than this are rounded up to it
+#define SHM_IMAGE_MIN_CLASS (64 * 1024)
+
+// Huge page size assumed when /proc/meminfo does not tell
+#define DEFAULT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// See setSharedImageHugePages
+static int useHugePages = 0;
+
+static size_t alignUp(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+/* Computes the exact segment layout needed to hold the images selected by
+ * flags (SHM_IMAGE_INPUT, SHM_IMAGE_OUTPUT) for the image described by header.
+ * Blocks that are not selected take no space and have offset 0.
+ * Returns 0 on success, -1 if the header is unusable.
+ */
+int computeSharedImageLayout(const BMP_Header *header, int flags, SharedImageLayout *layout)
+{
+    int bytesPerPixel = header->bits_per_pixel / 8;
+    if (header->width_px <= 0 || header->height_px == 0 || bytesPerPixel <= 0)
+    {
+        return -1;
+    }
+
+    size_t height = (size_t)abs(header->height_px);
+    size_t offset = alignUp(sizeof(SharedImageControl), SHM_IMAGE_ALIGN);
+    int hasIn = (flags & SHM_IMAGE_INPUT) != 0;
+    int hasOut = (flags & SHM_IMAGE_OUTPUT) != 0;
+
+    memset(layout, 0, sizeof(SharedImageLayout));
+    layout->flags = flags;
+    layout->rowBytes = getRowStride(header->width_px, bytesPerPixel);
+    if (hasIn)
+    {
+        layout->inOffset = offset;
+        offset = alignUp(offset + sizeof(BMP_Image), SHM_IMAGE_ALIGN);
+    }
+    if (hasOut)
+    {
+        layout->outOffset = offset;
+        offset = alignUp(offset + sizeof(BMP_Image), SHM_IMAGE_ALIGN);
+    }
+    if (hasIn)
+    {
+        layout->inRowTable = offset;
+        offset = alignUp(offset + height * sizeof(Pixel *), SHM_IMAGE_ALIGN);
+    }
+    if (hasOut)
+    {
+        layout->outRowTable = offset;
+        offset = alignUp(offset + height * sizeof(Pixel *), SHM_IMAGE_ALIGN);
+    }
+    if (hasIn)
+    {
+        layout->inPixels = offset;
+        offset = alignUp(offset + height * layout->rowBytes, SHM_IMAGE_ALIGN);
+    }
+    if (hasOut)
+    {
+        layout->outPixels = offset;
+        offset = alignUp(offset + height * layout->rowBytes, SHM_IMAGE_ALIGN);
+    }
+    layout->totalBytes = offset;
+    return 0;
+}
+
+/* Rounds bytes up to its size class. Classes are four evenly spaced steps per
+ * power of two, so a reused segment never wastes more than a quarter of itself.
+ */
+size_t sharedImageSizeClass(size_t bytes)
+{
+    if (bytes <= SHM_IMAGE_MIN_CLASS)
+    {
+        return SHM_IMAGE_MIN_CLASS;
+    }
+    size_t power = SHM_IMAGE_MIN_CLASS;
+    while (power <= bytes / 2)
+    {
+        power *= 2;
+    }
+    return alignUp(bytes, power / 4);
+}
+
+// Points image at its row table and pixel rows inside the segment
+static BMP_Image *placeImage(SharedImage *shared, size_t imageOffset, size_t tableOffset,
+                             size_t pixelsOffset, const BMP_Header *header)
+{
+    char *base = (char *)shared->base;
+    BMP_Image *image = (BMP_Image *)(base + imageOffset);
+    image->header = *header;
+    image->norm_height = abs(header->height_px);
+    image->bytes_per_pixel = header->bits_per_pixel / 8;
+    image->stride = (int)shared->layout.rowBytes;
+    image->pixel_data = (uint8_t *)(base + pixelsOffset);
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    image->pixels = (Pixel **)(base + tableOffset);
+    for (int i = 0; i < image->norm_height; i++)
+    {
+        image->pixels[i] = (Pixel *)(image->pixel_data + i * shared->layout.rowBytes);
+    }
+    return image;
+}
+
+/* Backs the segments created from now on with huge pages when enable is
+ * non-zero. Creation falls back to normal pages when the system has no free
+ * huge pages (see /proc/sys/vm/nr_hugepages) or refuses SHM_HUGETLB. The
+ * pixel buffers of allocPixelBuffer and adviseHugePages get transparent
+ * huge pages instead, which need no reserved pool.
+ */
+void setSharedImageHugePages(int enable)
+{
+    useHugePages = enable != 0;
+}
+
+static size_t hugePageSize(void)
+{
+    static size_t cached = 0;
+    if (cached != 0)
+    {
+        return cached;
+    }
+    size_t size = DEFAULT_HUGE_PAGE_SIZE;
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo != NULL)
+    {
+        char line[128];
+        unsigned long kib;
+        while (fgets(line, sizeof(line), meminfo) != NULL)
+        {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kib) == 1)
+            {
+                size = kib * 1024;
+                break;
+            }
+        }
+        fclose(meminfo);
+    }
+    cached = size;
+    return size;
+}
+
+/* With huge pages enabled, asks the kernel to back the whole huge pages
+ * inside [addr, addr + length) of an anonymous mapping with transparent
+ * huge pages (MADV_HUGEPAGE). Does nothing otherwise.
+ */
+void adviseHugePages(void *addr, size_t length)
+{
+    if (!useHugePages)
+    {
+        return;
+    }
+    size_t pageSize = hugePageSize();
+    uintptr_t start = alignUp((uintptr_t)addr, pageSize);
+    uintptr_t end = ((uintptr_t)addr + length) & ~(uintptr_t)(pageSize - 1);
+    if (end > start && madvise((void *)start, end - start, MADV_HUGEPAGE) == -1)
+    {
+        static int warned = 0;
+        if (!warned)
+        {
+            perror("Transparent huge pages unavailable, using normal pages");
+            warned = 1;
+        }
+    }
+}
+
+/* Allocates size bytes of pixel rows aligned to PIXEL_ALIGN. With huge
+ * pages enabled, a buffer of at least one huge page is aligned to it and
+ * advised, so every page of it can be huge. Free with free().
+ */
+void *allocPixelBuffer(size_t size)
+{
+    size_t pageSize = useHugePages ? hugePageSize() : 0;
+    if (pageSize == 0 || size < pageSize)
+    {
+        return aligned_alloc(PIXEL_ALIGN, alignUp(size, PIXEL_ALIGN));
+    }
+    void *buffer = aligned_alloc(pageSize, alignUp(size, pageSize));
+    if (buffer != NULL)
+    {
+        adviseHugePages(buffer, alignUp(size, pageSize));
+    }
+    return buffer;
+}
+
+// Creates a segment of at least capacity bytes, on huge pages if requested and possible
+static int createSegment(size_t capacity)
+{
+    if (useHugePages)
+    {
+        size_t pageSize = hugePageSize();
+        int shmid = shmget(IPC_PRIVATE, alignUp(capacity, pageSize), 0600 | IPC_CREAT | SHM_HUGETLB);
+        if (shmid != -1)
+        {
+            return shmid;
+        }
+
+        static int warned = 0;
+        if (!warned)
+        {
+            perror("Huge pages unavailable, using normal pages");
+            warned = 1;
+        }
+    }
+    return shmget(IPC_PRIVATE, capacity, 0600 | IPC_CREAT);
+}
+
+/* Makes shared hold a segment laid out for header, with the empty images
+ * selected by flags placed in it. The attached segment is reused when the new job falls
+ * in the same size class; otherwise it is replaced by a right-sized one.
+ * Returns 0 on success, -1 on failure (shared is left released).
+ */
+int acquireSharedImage(SharedImage *shared, const BMP_Header *header, int flags)
+{
+    SharedImageLayout layout;
+    if (computeSharedImageLayout(header, flags, &layout) != 0)
+    {
+        fprintf(stderr, "Invalid BMP header for shared memory layout\n");
+        return -1;
+    }
+
+    TRACE_BEGIN(span, "shm acquire");
+    size_t capacity = sharedImageSizeClass(layout.totalBytes);
+    if (shared->shmid != -1 && shared->capacity != capacity)
+    {
+        releaseSharedImage(shared);
+    }
+
+    if (shared->shmid == -1)
+    {
+        int shmid = createSegment(capacity);
+        if (shmid == -1)
+        {
+            perror("Error al obtener memoria compartida");
+            return -1;
+        }
+        void *base = shmat(shmid, NULL, 0);
+        if (base == (void *)-1)
+        {
+            perror("Error al adjuntar memoria compartida");
+            shmctl(shmid, IPC_RMID, NULL);
+            return -1;
+        }
+        // Mark it for removal right away: it stays usable while attached and the
+        // kernel frees it on the last detach, even if the process crashes
+        shmctl(shmid, IPC_RMID, NULL);
+        shared->shmid = shmid;
+        shared->capacity = capacity;
+        shared->base = base;
+    }
+
+    shared->layout = layout;
+    shared->control = (SharedImageControl *)shared->base;
+    memset(shared->control, 0, sizeof(SharedImageControl));
+    shared->in = NULL;
+    shared->out = NULL;
+    if (flags & SHM_IMAGE_INPUT)
+    {
+        shared->in = placeImage(shared, layout.inOffset, layout.inRowTable, layout.inPixels, header);
+    }
+    if (flags & SHM_IMAGE_OUTPUT)
+    {
+        shared->out = placeImage(shared, layout.outOffset, layout.outRowTable, layout.outPixels, header);
+    }
+    TRACE_END(span);
+    return 0;
+}
+
+/* Detaches the segment held by shared, if any, which frees it.
+ */
+void releaseSharedImage(SharedImage *shared)
+{
+    if (shared->shmid == -1)
+    {
+        return;
+    }
+    shmdt(shared->base);
+    shared->shmid = -1;
+    shared->capacity = 0;
+    shared->base = NULL;
+    shared->control = NULL;
+    shared->in = NULL;
+    shared->out = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef _SHM_IMAGE_H_
+#define _SHM_IMAGE_H_
+#include <stddef.h>
+#include "bmp.h"
+
+/*
+ * A shared image segment holds the input and the output image of one job:
+ *   --------------------------
+ *   |   SharedImageControl   |
+ *   |-------------------------
+ *   |  BMP_Image in / out    |
+ *   |-------------------------
+ *   |  Row tables in / out   |   norm_height pointers each
+ *   |-------------------------
+ *   |     Input pixel rows   |   norm_height * stride
+ *   |-------------------------
+ *   |    Output pixel rows   |   norm_height * stride
+ *   --------------------------
+ * Every block starts on a SHM_IMAGE_ALIGN boundary. A job whose input (or
+ * output) lives elsewhere, e.g. in a file mapping inherited by the workers,
+ * leaves that image out of the segment entirely.
+ */
+#define SHM_IMAGE_ALIGN 64
+
+#define SHM_IMAGE_INPUT 0x1  // Reserve the input image and its pixel rows
+#define SHM_IMAGE_OUTPUT 0x2 // Reserve the output image and its pixel rows
+
+typedef struct SharedImageControl
+{
+    int numThreads; // Threads requested for this job
+} SharedImageControl;
+
+typedef struct SharedImageLayout
+{
+    size_t rowBytes;    // Row stride, as returned by getRowStride
+    int flags;          // SHM_IMAGE_INPUT and/or SHM_IMAGE_OUTPUT
+    size_t inOffset;    // Offset of the input BMP_Image
+    size_t outOffset;   // Offset of the output BMP_Image
+    size_t inRowTable;  // Offset of the input row table
+    size_t outRowTable; // Offset of the output row table
+    size_t inPixels;    // Offset of the input pixel rows
+    size_t outPixels;   // Offset of the output pixel rows
+    size_t totalBytes;  // Exact bytes needed by the job
+} SharedImageLayout;
+
+typedef struct SharedImage
+{
+    int shmid;        // -1 when no segment is attached
+    size_t capacity;  // Size class of the attached segment
+    void *base;       // Attach address
+    SharedImageControl *control;
+    BMP_Image *in;    // NULL unless SHM_IMAGE_INPUT was requested
+    BMP_Image *out;   // NULL unless SHM_IMAGE_OUTPUT was requested
+    SharedImageLayout layout;
+} SharedImage;
+
+#define SHARED_IMAGE_INIT {-1, 0, NULL, NULL, NULL, NULL, {0}}
+
+int computeSharedImageLayout(const BMP_Header *header, int flags, SharedImageLayout *layout);
+size_t sharedImageSizeClass(size_t bytes);
+void setSharedImageHugePages(int enable);
+void adviseHugePages(void *addr, size_t length);
+void *allocPixelBuffer(size_t size);
+int acquireSharedImage(SharedImage *shared, const BMP_Header *header, int flags);
+void releaseSharedImage(SharedImage *shared);
+
+#endif /* shm_image.h */
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "streaming.h"
+#include "bmp.h"
+#include "convolution.h"
+#include "shm_image.h"
+#include "trace.h"
+
+// Rows of one band, seen through a BMP_Image whose row table spans the whole
+// image: only the rows of the current band (and its halo) are valid
+typedef struct
+{
+    uint8_t *pixels;
+    Pixel **table;
+    struct iovec *iov;
+    BMP_Image view;
+} BandBuffer;
+
+typedef struct
+{
+    int inFd;
+    int outFd;
+    BMP_Header header; // Input header
+    uint32_t outOffset; // Pixel offset in the output file
+    int width;
+    int height;
+    int topDown;
+    int bytesPerPixel; // 3 (BGR) or 4 (BGRA)
+    size_t rowSize; // Row size in the files
+    int stride;     // Row stride in the band buffers
+    int halo;       // Rows needed above and below a band
+    int bandRows;
+    int numBands;
+    const FilterChain *chain;
+    ThreadPool *pool;
+    BandBuffer in[2];
+    BandBuffer out[2];
+} StreamState;
+
+// Work of the I/O thread while a band is filtered
+typedef struct
+{
+    StreamState *state;
+    int writeBand; // -1: nothing to write
+    int readBand;  // -1: nothing to read
+    int result;
+} StreamIO;
+
+static void bandRange(const StreamState *state, int band, int *first, int *last)
+{
+    *first = band * state->bandRows;
+    *last = *first + state->bandRows < state->height ? *first + state->bandRows : state->height;
+}
+
+// preadv/pwritev until every iovec is transferred
+static int transferAll(int fd, struct iovec *iov, int count, off_t offset, int writing)
+{
+    while (count > 0)
+    {
+        int batch = count < IOV_MAX ? count : IOV_MAX;
+        ssize_t done = writing ? pwritev(fd, iov, batch, offset) : preadv(fd, iov, batch, offset);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            if (done == 0)
+            {
+                errno = EIO; // The file is shorter than its header says
+            }
+            return -1;
+        }
+        offset += done;
+        while (count > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0 && done > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+// Transfers image rows [first, last) of buffer from or to the file, in file order
+static int transferRows(StreamState *state, BandBuffer *buffer, int fd, int first, int last, int writing)
+{
+    int count = last - first;
+    for (int i = 0; i < count; i++)
+    {
+        int y = state->topDown ? last - 1 - i : first + i;
+        buffer->iov[i].iov_base = buffer->table[y];
+        buffer->iov[i].iov_len = state->rowSize;
+    }
+    int firstFileRow = state->topDown ? state->height - last : first;
+    off_t offset = (off_t)(writing ? state->outOffset : state->header.offset) + (off_t)firstFileRow * state->rowSize;
+    if (transferAll(fd, buffer->iov, count, offset, writing) != 0)
+    {
+        perror(writing ? "Error writing band" : "Error reading band");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads band and its halo into buffer
+static int readBand(StreamState *state, BandBuffer *buffer, int band)
+{
+    int first, last;
+    bandRange(state, band, &first, &last);
+    first = first - state->halo > 0 ? first - state->halo : 0;
+    last = last + state->halo < state->height ? last + state->halo : state->height;
+    for (int y = first; y < last; y++)
+    {
+        buffer->table[y] = (Pixel *)(buffer->pixels + (size_t)(y - first) * state->stride);
+    }
+    TRACE_BEGIN(span, "band read");
+    int result = transferRows(state, buffer, state->inFd, first, last, 0);
+    TRACE_END(span);
+    return result;
+}
+
+static int writeBand(StreamState *state, BandBuffer *buffer, int band)
+{
+    int first, last;
+    bandRange(state, band, &first, &last);
+    TRACE_BEGIN(span, "band write");
+    int result = transferRows(state, buffer, state->outFd, first, last, 1);
+    TRACE_END(span);
+    return result;
+}
+
+static void *streamIOThread(void *args)
+{
+    StreamIO *io = (StreamIO *)args;
+    io->result = 0;
+    if (io->writeBand >= 0 && writeBand(io->state, &io->state->out[io->writeBand % 2], io->writeBand) != 0)
+    {
+        io->result = -1;
+    }
+    if (io->readBand >= 0 && readBand(io->state, &io->state->in[io->readBand % 2], io->readBand) != 0)
+    {
+        io->result = -1;
+    }
+    return NULL;
+}
+
+// Filters band from in into out, with ex7's split when the chain is empty; returns 0 or -1
+static int filterBand(StreamState *state, BandBuffer *in, BandBuffer *out, int band)
+{
+    int first, last;
+    bandRange(state, band, &first, &last);
+    for (int y = first; y < last; y++)
+    {
+        out->table[y] = (Pixel *)(out->pixels + (size_t)(y - first) * state->stride);
+    }
+
+    const FilterChain *chain = state->chain;
+    if (chain->numStages > 0)
+    {
+        return applyParallelPipeline(state->pool, chain->stages, chain->numStages, &in->view, &out->view, first,
+                                     last);
+    }
+    int middle = state->height / 2;
+    int result = 0;
+    if (first < middle)
+    {
+        result = applyParallelFilter(state->pool, findKernel("edge"), &in->view, &out->view, first,
+                                     last < middle ? last : middle);
+    }
+    if (last > middle && result == 0)
+    {
+        result = applyParallelFilter(state->pool, findKernel("blur"), &in->view, &out->view,
+                                     first > middle ? first : middle, last);
+    }
+    return result;
+}
+
+static int initBandBuffer(StreamState *state, BandBuffer *buffer, int rows)
+{
+    buffer->pixels = (uint8_t *)allocPixelBuffer((size_t)rows * state->stride);
+    buffer->table = (Pixel **)calloc(state->height, sizeof(Pixel *));
+    buffer->iov = (struct iovec *)malloc(rows * sizeof(struct iovec));
+    if (buffer->pixels == NULL || buffer->table == NULL || buffer->iov == NULL)
+    {
+        printError(MEMORY_ERROR);
+        return -1;
+    }
+    // Keeps the row padding written to the output at zero
+    memset(buffer->pixels, 0, (size_t)rows * state->stride);
+
+    buffer->view.header = state->header;
+    buffer->view.norm_height = state->height;
+    buffer->view.bytes_per_pixel = state->bytesPerPixel;
+    buffer->view.stride = state->stride;
+    buffer->view.pixel_data = buffer->pixels;
+    buffer->view.pixels = buffer->table;
+    buffer->view.mapping = NULL;
+    buffer->view.mapping_size = 0;
+    return 0;
+}
+
+static void freeBandBuffer(BandBuffer *buffer)
+{
+    free(buffer->pixels);
+    free(buffer->table);
+    free(buffer->iov);
+}
+
+// Opens both files and checks the input header. Returns 0 or -1
+static int openStream(StreamState *state, const char *input, const char *output)
+{
+    state->inFd = open(input, O_RDONLY);
+    if (state->inFd == -1)
+    {
+        perror(input);
+        return -1;
+    }
+    if (pread(state->inFd, &state->header, sizeof(BMP_Header), 0) != sizeof(BMP_Header) ||
+        !checkBMPValid(&state->header) || (state->header.bits_per_pixel != 24 && state->header.bits_per_pixel != 32) ||
+        state->header.width_px <= 0 || state->header.height_px == 0)
+    {
+        fprintf(stderr, "%s: ", input);
+        printError(VALID_ERROR);
+        return -1;
+    }
+    posix_fadvise(state->inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    state->outFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (state->outFd == -1)
+    {
+        perror(output);
+        return -1;
+    }
+
+    // The output keeps the input's orientation; rows land at their own offsets
+    BMP_Header outHeader = state->header;
+    off_t outSize = (off_t)prepareBMPHeader(&outHeader);
+    if (ftruncate(state->outFd, outSize) == -1 ||
+        pwrite(state->outFd, &outHeader, sizeof(BMP_Header), 0) != sizeof(BMP_Header))
+    {
+        perror(output);
+        return -1;
+    }
+    state->outOffset = outHeader.offset;
+    return 0;
+}
+
+/* Filters input into output band by band, with chain (or ex7's default split
+ * when it has no stages). bandRows <= 0 picks bands of about
+ * DEFAULT_BAND_BYTES. header, unless NULL, receives the input header.
+ * Returns 0 on success, -1 on failure.
+ */
+int streamFilterFile(ThreadPool *pool, const FilterChain *chain, const char *input, const char *output,
+                     int bandRows, BMP_Header *header)
+{
+    StreamState state;
+    memset(&state, 0, sizeof(state));
+    state.inFd = -1;
+    state.outFd = -1;
+    state.pool = pool;
+    state.chain = chain;
+
+    int result = openStream(&state, input, output);
+    if (result == 0)
+    {
+        if (header != NULL)
+        {
+            *header = state.header;
+        }
+        state.width = state.header.width_px;
+        state.height = abs(state.header.height_px);
+        state.topDown = state.header.height_px < 0;
+        state.bytesPerPixel = state.header.bits_per_pixel / 8;
+        state.rowSize = ((size_t)state.width * state.bytesPerPixel + 3) & ~(size_t)3;
+        state.stride = getRowStride(state.width, state.bytesPerPixel);
+        state.halo = 1;
+        if (chain->numStages > 0)
+        {
+            state.halo = 0;
+            for (int s = 0; s < chain->numStages; s++)
+            {
+                state.halo += chain->stages[s]->size / 2;
+            }
+        }
+        state.bandRows = bandRows > 0 ? bandRows : (int)(DEFAULT_BAND_BYTES / state.stride);
+        state.bandRows = state.bandRows < 1 ? 1 : (state.bandRows > state.height ? state.height : state.bandRows);
+        state.numBands = (state.height + state.bandRows - 1) / state.bandRows;
+
+        int inRows = state.bandRows + 2 * state.halo;
+        for (int i = 0; i < 2 && result == 0; i++)
+        {
+            if (initBandBuffer(&state, &state.in[i], inRows) != 0 ||
+                initBandBuffer(&state, &state.out[i], state.bandRows) != 0)
+            {
+                result = -1;
+            }
+        }
+    }
+
+    if (result == 0)
+    {
+        result = readBand(&state, &state.in[0], 0);
+    }
+    for (int band = 0; band < state.numBands && result == 0; band++)
+    {
+        // Write band - 1 and read band + 1 while band is filtered
+        pthread_t ioThread;
+        StreamIO io = {&state, band - 1, band + 1 < state.numBands ? band + 1 : -1, 0};
+        int threaded = pthread_create(&ioThread, NULL, streamIOThread, &io) == 0;
+        if (!threaded)
+        {
+            streamIOThread(&io);
+        }
+
+        int filtered = filterBand(&state, &state.in[band % 2], &state.out[band % 2], band);
+
+        if (threaded)
+        {
+            pthread_join(ioThread, NULL);
+        }
+        result = io.result != 0 ? io.result : filtered;
+    }
+    if (result == 0 && state.numBands > 0)
+    {
+        result = writeBand(&state, &state.out[(state.numBands - 1) % 2], state.numBands - 1);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        freeBandBuffer(&state.in[i]);
+        freeBandBuffer(&state.out[i]);
+    }
+    if (state.inFd != -1)
+    {
+        close(state.inFd);
+    }
+    if (state.outFd != -1 && close(state.outFd) == -1)
+    {
+        perror(output);
+        result = -1;
+    }
+    return result;
+}
@@ -0,0 +1,21 @@
+#ifndef _STREAMING_H_
+#define _STREAMING_H_
+#include "bmp.h"
+#include "threadpool.h"
+#include "pipeline.h"
+
+/*
+ * Out-of-core filtering. The image is processed in bands of rows: each band
+ * is read together with the halo rows its kernels need, filtered by the pool
+ * and written to its place in the output file. Two input and two output band
+ * buffers alternate, so while band k is filtered an I/O thread writes band
+ * k - 1 and reads band k + 1. Memory stays at four bands whatever the image
+ * size. Bands are raw file rows, so only 24-bit and 32-bit files stream;
+ * batch's -S filters indexed images in memory instead.
+ */
+#define DEFAULT_BAND_BYTES (16 * 1024 * 1024)
+
+int streamFilterFile(ThreadPool *pool, const FilterChain *chain, const char *input, const char *output,
+                     int bandRows, BMP_Header *header);
+
+#endif /* streaming.h */
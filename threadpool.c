@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "threadpool.h"
+#include "trace.h"
+
+#define INITIAL_DEQUE_CAPACITY 64
+#define MAX_NUMA_NODES 64
+
+typedef struct
+{
+    TaskFunction function;
+    void *arg;
+} Task;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Task *tasks; // Circular buffer
+    int capacity;
+    int head;
+    int count;
+} TaskDeque;
+
+typedef struct
+{
+    ThreadPool *pool;
+    int index;
+} WorkerArgs;
+
+struct ThreadPool
+{
+    pthread_mutex_t lock;     // Guards the counters below
+    pthread_cond_t taskReady; // Signalled when tasks are queued or on shutdown
+    pthread_cond_t allDone;   // Signalled when no task is queued or running
+    int queued;               // Tasks sitting in any deque
+    int running;              // Tasks taken by a worker and not finished
+    int shutdown;
+    int numThreads;
+    int nextDeque; // Round-robin target for submitTask from outside the pool
+    TaskDeque *deques;
+    WorkerArgs *workers;
+    pthread_t *threads;
+};
+
+// Index of the calling worker in its pool, -1 outside of any pool
+static _Thread_local int currentWorker = -1;
+
+// Whether new pools pin their workers, see setThreadPoolPinning
+static int pinWorkers = 0;
+
+// Tile size used by splitIntoTiles, see setTileSize
+static int tileWidth = 0;
+static int tileHeight = 0;
+
+static int initDeque(TaskDeque *deque)
+{
+    deque->tasks = (Task *)malloc(INITIAL_DEQUE_CAPACITY * sizeof(Task));
+    if (deque->tasks == NULL)
+    {
+        return -1;
+    }
+    deque->capacity = INITIAL_DEQUE_CAPACITY;
+    deque->head = 0;
+    deque->count = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+    return 0;
+}
+
+// Appends count tasks to the back of deque, growing it if needed
+static int pushTasks(TaskDeque *deque, TaskFunction function, char *args, size_t argSize, int count)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count + count > deque->capacity)
+    {
+        int capacity = deque->capacity;
+        while (capacity < deque->count + count)
+        {
+            capacity *= 2;
+        }
+        Task *tasks = (Task *)malloc(capacity * sizeof(Task));
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (int i = 0; i < deque->count; i++)
+        {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        deque->tasks[(deque->head + deque->count) % deque->capacity] = (Task){function, args + i * argSize};
+        deque->count++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// Takes a task from the front (owner) or the back (thief) of deque
+static int popTask(TaskDeque *deque, int fromBack, Task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0)
+    {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    if (fromBack)
+    {
+        *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+    }
+    else
+    {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+    }
+    deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+// Own deque first, in order; then steal the far end of the other deques
+static int takeTask(ThreadPool *pool, int index, Task *task)
+{
+    int found = popTask(&pool->deques[index], 0, task);
+    for (int i = 1; !found && i < pool->numThreads; i++)
+    {
+        found = popTask(&pool->deques[(index + i) % pool->numThreads], 1, task);
+        if (found)
+        {
+            TRACE_COUNT("steals", 1);
+        }
+    }
+    if (found)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return found;
+}
+
+// Worker loop: run or steal tasks until shutdown
+static void *poolWorker(void *args)
+{
+    WorkerArgs *worker = (WorkerArgs *)args;
+    ThreadPool *pool = worker->pool;
+    currentWorker = worker->index;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->taskReady, &pool->lock);
+        }
+        if (pool->queued == 0 && pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        Task task;
+        if (!takeTask(pool, worker->index, &task))
+        {
+            continue;
+        }
+        task.function(task.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (pool->queued == 0 && pool->running == 0)
+        {
+            pthread_cond_broadcast(&pool->allDone);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Frees the deques and the pool itself; no worker may be running
+static void freeThreadPool(ThreadPool *pool)
+{
+    for (int i = 0; i < pool->numThreads; i++)
+    {
+        if (pool->deques[i].tasks != NULL)
+        {
+            pthread_mutex_destroy(&pool->deques[i].lock);
+            free(pool->deques[i].tasks);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->taskReady);
+    pthread_cond_destroy(&pool->allDone);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+// Wakes every worker for shutdown and joins the first count of them
+static void stopWorkers(ThreadPool *pool, int count)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->taskReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
+
+// Appends the CPUs of a sysfs cpulist ("0-3,8-11") that are in allowed
+static int parseCpuList(const char *list, const cpu_set_t *allowed, int *cpus, int count)
+{
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        int first = (int)strtol(list, &end, 10);
+        int last = first;
+        if (end == list)
+        {
+            break;
+        }
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = (int)strtol(list, &end, 10);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, allowed))
+            {
+                cpus[count++] = cpu;
+            }
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Fills cpus with the CPUs we may run on, node after node. Returns their count
+static int getCpusByNode(int *cpus)
+{
+    cpu_set_t allowed;
+    int count = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return 0;
+    }
+
+    for (int node = 0; node < MAX_NUMA_NODES; node++)
+    {
+        char path[64], list[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+        {
+            continue;
+        }
+        if (fgets(list, sizeof(list), file) != NULL)
+        {
+            count = parseCpuList(list, &allowed, cpus, count);
+        }
+        fclose(file);
+    }
+
+    // No NUMA information: a single node with every allowed CPU
+    if (count == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+    return count;
+}
+
+// Spreads the workers evenly over the node-ordered CPUs: consecutive workers,
+// which receive consecutive blocks of tiles, share a node
+static void pinWorkerThreads(ThreadPool *pool)
+{
+    int cpus[CPU_SETSIZE];
+    int count = getCpusByNode(cpus);
+    if (count == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < pool->numThreads; i++)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[(long)i * count / pool->numThreads], &set);
+        if (pthread_setaffinity_np(pool->threads[i], sizeof(set), &set) != 0)
+        {
+            fprintf(stderr, "Could not pin worker %d\n", i);
+        }
+    }
+}
+
+/* Makes the pools created from now on pin each worker to one CPU, spread
+ * over the NUMA nodes in order. Tiles are handed out in contiguous blocks
+ * per worker, so a node always works on neighbouring rows, and the pages a
+ * worker writes first are allocated on its own node.
+ */
+void setThreadPoolPinning(int enable)
+{
+    pinWorkers = enable != 0;
+}
+
+/* Starts numThreads workers that stay alive until destroyThreadPool.
+ * Returns NULL if the pool or any of its threads cannot be created.
+ */
+ThreadPool *createThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+    {
+        return NULL;
+    }
+
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->numThreads = numThreads;
+    pool->deques = (TaskDeque *)calloc(numThreads, sizeof(TaskDeque));
+    pool->workers = (WorkerArgs *)calloc(numThreads, sizeof(WorkerArgs));
+    pool->threads = (pthread_t *)calloc(numThreads, sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->taskReady, NULL);
+    pthread_cond_init(&pool->allDone, NULL);
+    if (pool->deques == NULL || pool->workers == NULL || pool->threads == NULL)
+    {
+        pool->numThreads = 0;
+        freeThreadPool(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        if (initDeque(&pool->deques[i]) != 0)
+        {
+            freeThreadPool(pool);
+            return NULL;
+        }
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, poolWorker, &pool->workers[i]) != 0)
+        {
+            fprintf(stderr, "Error creating thread %d\n", i);
+            stopWorkers(pool, i);
+            freeThreadPool(pool);
+            return NULL;
+        }
+    }
+
+    if (pinWorkers)
+    {
+        pinWorkerThreads(pool);
+    }
+    return pool;
+}
+
+int getThreadPoolSize(ThreadPool *pool)
+{
+    return pool->numThreads;
+}
+
+// Makes count more tasks visible to sleeping workers
+static void announceTasks(ThreadPool *pool, int count)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->queued += count;
+    pthread_cond_broadcast(&pool->taskReady);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Queues function(arg). A worker queues on its own deque; any other thread
+ * spreads single tasks round-robin over the deques.
+ * Returns 0 on success, -1 if the deque cannot grow.
+ */
+int submitTask(ThreadPool *pool, TaskFunction function, void *arg)
+{
+    int index = currentWorker;
+    if (index < 0 || index >= pool->numThreads)
+    {
+        pthread_mutex_lock(&pool->lock);
+        index = pool->nextDeque;
+        pool->nextDeque = (pool->nextDeque + 1) % pool->numThreads;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (pushTasks(&pool->deques[index], function, (char *)arg, 0, 1) != 0)
+    {
+        return -1;
+    }
+    announceTasks(pool, 1);
+    return 0;
+}
+
+/* Queues function on each of count arguments laid out argSize bytes apart.
+ * Each worker's deque receives one contiguous block of the batch, so
+ * neighbouring tiles run on the same core unless they get stolen.
+ * Returns the number of tasks queued; the caller runs any others itself.
+ */
+int submitTaskBatch(ThreadPool *pool, TaskFunction function, void *args, size_t argSize, int count)
+{
+    int queued = 0;
+    for (int i = 0; i < pool->numThreads; i++)
+    {
+        int start = (int)((long long)count * i / pool->numThreads);
+        int end = (int)((long long)count * (i + 1) / pool->numThreads);
+        if (end > start && pushTasks(&pool->deques[i], function, (char *)args + start * argSize, argSize, end - start) == 0)
+        {
+            queued += end - start;
+        }
+        else
+        {
+            // No room in this deque: give the block back to the caller
+            for (int j = start; j < end; j++)
+            {
+                function((char *)args + j * argSize);
+            }
+        }
+    }
+    announceTasks(pool, queued);
+    return queued;
+}
+
+/* Blocks until every submitted task has finished.
+ */
+void waitThreadPool(ThreadPool *pool)
+{
+    TRACE_BEGIN(span, "pool wait");
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued > 0 || pool->running > 0)
+    {
+        pthread_cond_wait(&pool->allDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    TRACE_END(span);
+}
+
+/* Lets the workers drain the deques, joins them and frees the pool.
+ */
+void destroyThreadPool(ThreadPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    stopWorkers(pool, pool->numThreads);
+    freeThreadPool(pool);
+}
+
+/* Sets the tile size used by splitIntoTiles, in pixels. Use 0 for the
+ * defaults: full-width tiles, as many rows as fit in DEFAULT_TILE_BYTES.
+ */
+void setTileSize(int width, int height)
+{
+    tileWidth = width > 0 ? width : 0;
+    tileHeight = height > 0 ? height : 0;
+}
+
+/* Sets the tile size from spec, "WxH" in pixels (0 for a default).
+ * Returns 0, or -1 if spec is not of that form.
+ */
+int parseTileSize(const char *spec)
+{
+    int width, height;
+    char end;
+    if (sscanf(spec, "%dx%d%c", &width, &height, &end) != 2 || width < 0 || height < 0)
+    {
+        fprintf(stderr, "Invalid tile size '%s', expected WxH\n", spec);
+        return -1;
+    }
+    setTileSize(width, height);
+    return 0;
+}
+
+void getTileSize(int *width, int *height)
+{
+    *width = tileWidth;
+    *height = tileHeight;
+}
+
+/* Rows per tile for rows rows of rowBytes bytes, cut into tilesPerRow tiles
+ * across: the configured tile height, else as many rows as fit in
+ * DEFAULT_TILE_BYTES but no more than give the pool TASKS_PER_THREAD tiles
+ * per worker.
+ */
+int getTileRows(ThreadPool *pool, int rows, int rowBytes, int tilesPerRow)
+{
+    if (tileHeight > 0)
+    {
+        return tileHeight;
+    }
+    int th = DEFAULT_TILE_BYTES / rowBytes;
+    int bands = (getThreadPoolSize(pool) * TASKS_PER_THREAD + tilesPerRow - 1) / tilesPerRow;
+    int balanced = (rows + bands - 1) / bands;
+    th = balanced < th ? balanced : th;
+    return th < 1 ? 1 : th;
+}
+
+/* Cuts rows [startRow, endRow) of an image width pixels wide into tiles of
+ * the configured size, row of tiles by row of tiles, see getTileRows.
+ * *tiles is malloc'ed and must be freed by the caller. Returns the number
+ * of tiles, -1 on error.
+ */
+int splitIntoTiles(ThreadPool *pool, int startRow, int endRow, int width, int bytesPerPixel, Tile **tiles)
+{
+    int rows = endRow - startRow;
+    *tiles = NULL;
+    if (rows <= 0 || width <= 0)
+    {
+        return 0;
+    }
+
+    int tw = (tileWidth > 0 && tileWidth < width) ? tileWidth : width;
+    int tilesX = (width + tw - 1) / tw;
+    int th = getTileRows(pool, rows, tw * bytesPerPixel, tilesX);
+    int tilesY = (rows + th - 1) / th;
+    *tiles = (Tile *)malloc((size_t)tilesX * tilesY * sizeof(Tile));
+    if (*tiles == NULL)
+    {
+        return -1;
+    }
+
+    int count = 0;
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            Tile *tile = &(*tiles)[count++];
+            tile->startRow = startRow + ty * th;
+            tile->endRow = tile->startRow + th < endRow ? tile->startRow + th : endRow;
+            tile->startCol = tx * tw;
+            tile->endCol = tile->startCol + tw < width ? tile->startCol + tw : width;
+        }
+    }
+    return count;
+}
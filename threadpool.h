@@ -0,0 +1,48 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+#include <stddef.h>
+
+/*
+ * Long-lived pool of worker threads with one task deque per worker.
+ * A worker runs the tasks of its own deque front to back and, once it is
+ * empty, steals from the back of another worker's deque.
+ * Tasks use the pthread start routine signature, so any thread worker
+ * (filterThreadWorker, edgeDetectionThreadWorker) can be submitted as is.
+ */
+typedef void *(*TaskFunction)(void *arg);
+
+typedef struct ThreadPool ThreadPool;
+
+void setThreadPoolPinning(int enable);
+ThreadPool *createThreadPool(int numThreads);
+int getThreadPoolSize(ThreadPool *pool);
+int submitTask(ThreadPool *pool, TaskFunction function, void *arg);
+int submitTaskBatch(ThreadPool *pool, TaskFunction function, void *args, size_t argSize, int count);
+void waitThreadPool(ThreadPool *pool);
+void destroyThreadPool(ThreadPool *pool);
+
+/*
+ * Tiles are the unit of work queued by the filters: a rectangle of rows
+ * [startRow, endRow) and columns [startCol, endCol).
+ * The tile size is tunable: width 0 means full rows, height 0 means as many
+ * rows as fit in DEFAULT_TILE_BYTES (about half of a typical L2 cache), but
+ * no more than leave every worker TASKS_PER_THREAD tiles to share.
+ */
+#define DEFAULT_TILE_BYTES (256 * 1024)
+#define TASKS_PER_THREAD 4
+
+typedef struct
+{
+    int startRow;
+    int endRow;
+    int startCol;
+    int endCol;
+} Tile;
+
+void setTileSize(int width, int height);
+int parseTileSize(const char *spec);
+void getTileSize(int *width, int *height);
+int getTileRows(ThreadPool *pool, int rows, int rowBytes, int tilesPerRow);
+int splitIntoTiles(ThreadPool *pool, int startRow, int endRow, int width, int bytesPerPixel, Tile **tiles);
+
+#endif /* threadpool.h */
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#ifdef EX7_TRACE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INITIAL_TRACE_EVENTS 1024
+#define MAX_TRACE_NAMES 64
+
+typedef struct
+{
+    const char *name;
+    uint64_t start;
+    uint64_t end;  // Equal to start for counters
+    int64_t value; // Counter increment, -1 for spans
+} TraceEvent;
+
+// Events of one thread; only that thread appends to it
+typedef struct TraceBuffer
+{
+    int thread;
+    TraceEvent *events;
+    size_t count;
+    size_t capacity;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+typedef struct
+{
+    const char *name;
+    int isCounter;
+    long count;
+    int64_t total; // Nanoseconds for spans, sum of values for counters
+    uint64_t min;
+    uint64_t max;
+} TraceStage;
+
+static _Thread_local TraceBuffer *localBuffer = NULL;
+static pthread_mutex_t buffersLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *buffers = NULL;
+static int numBuffers = 0;
+static uint64_t traceOrigin = 0;
+
+uint64_t traceNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// The calling thread's buffer, registered on first use
+static TraceBuffer *threadBuffer(void)
+{
+    if (localBuffer == NULL)
+    {
+        TraceBuffer *buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+        if (buffer == NULL)
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&buffersLock);
+        buffer->thread = numBuffers++;
+        buffer->next = buffers;
+        buffers = buffer;
+        pthread_mutex_unlock(&buffersLock);
+        localBuffer = buffer;
+    }
+    return localBuffer;
+}
+
+static void appendEvent(const char *name, uint64_t start, uint64_t end, int64_t value)
+{
+    TraceBuffer *buffer = threadBuffer();
+    if (buffer == NULL)
+    {
+        return;
+    }
+    if (buffer->count == buffer->capacity)
+    {
+        size_t capacity = buffer->capacity == 0 ? INITIAL_TRACE_EVENTS : buffer->capacity * 2;
+        TraceEvent *events = (TraceEvent *)realloc(buffer->events, capacity * sizeof(TraceEvent));
+        if (events == NULL)
+        {
+            return;
+        }
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+    TraceEvent *event = &buffer->events[buffer->count++];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->value = value;
+}
+
+void traceRecord(const char *name, uint64_t start, uint64_t end)
+{
+    appendEvent(name, start, end, -1);
+}
+
+void traceCount(const char *name, int64_t value)
+{
+    uint64_t now = traceNow();
+    appendEvent(name, now, now, value);
+}
+
+static TraceStage *findStage(TraceStage *stages, int *numStages, const char *name, int isCounter)
+{
+    for (int i = 0; i < *numStages; i++)
+    {
+        if (stages[i].isCounter == isCounter && strcmp(stages[i].name, name) == 0)
+        {
+            return &stages[i];
+        }
+    }
+    if (*numStages == MAX_TRACE_NAMES)
+    {
+        return NULL;
+    }
+    TraceStage *stage = &stages[(*numStages)++];
+    memset(stage, 0, sizeof(TraceStage));
+    stage->name = name;
+    stage->isCounter = isCounter;
+    stage->min = UINT64_MAX;
+    return stage;
+}
+
+static void printTextSummary(void)
+{
+    TraceStage stages[MAX_TRACE_NAMES];
+    int numStages = 0;
+
+    fprintf(stderr, "---------------------- trace summary ----------------------\n");
+    fprintf(stderr, "%-16s %8s %12s %10s %10s %10s\n", "stage", "count", "total ms", "mean us", "min us", "max us");
+    for (TraceBuffer *buffer = buffers; buffer != NULL; buffer = buffer->next)
+    {
+        for (size_t i = 0; i < buffer->count; i++)
+        {
+            TraceEvent *event = &buffer->events[i];
+            TraceStage *stage = findStage(stages, &numStages, event->name, event->value >= 0);
+            if (stage == NULL)
+            {
+                continue;
+            }
+            uint64_t length = event->value >= 0 ? (uint64_t)event->value : event->end - event->start;
+            stage->count++;
+            stage->total += length;
+            stage->min = length < stage->min ? length : stage->min;
+            stage->max = length > stage->max ? length : stage->max;
+        }
+    }
+    for (int i = 0; i < numStages; i++)
+    {
+        TraceStage *stage = &stages[i];
+        if (stage->isCounter)
+        {
+            fprintf(stderr, "%-16s %8ld %12lld (counter)\n", stage->name, stage->count, (long long)stage->total);
+            continue;
+        }
+        fprintf(stderr, "%-16s %8ld %12.3f %10.1f %10.1f %10.1f\n", stage->name, stage->count, stage->total / 1e6,
+                stage->total / 1e3 / stage->count, stage->min / 1e3, stage->max / 1e3);
+    }
+
+    fprintf(stderr, "%-8s %8s %12s\n", "thread", "spans", "busy ms");
+    for (TraceBuffer *buffer = buffers; buffer != NULL; buffer = buffer->next)
+    {
+        long spans = 0;
+        uint64_t busy = 0;
+        for (size_t i = 0; i < buffer->count; i++)
+        {
+            if (buffer->events[i].value < 0)
+            {
+                spans++;
+                busy += buffer->events[i].end - buffer->events[i].start;
+            }
+        }
+        fprintf(stderr, "%-8d %8ld %12.3f\n", buffer->thread, spans, busy / 1e6);
+    }
+}
+
+static void writeChromeTrace(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        return;
+    }
+
+    int first = 1;
+    fprintf(file, "{\"traceEvents\": [");
+    for (TraceBuffer *buffer = buffers; buffer != NULL; buffer = buffer->next)
+    {
+        for (size_t i = 0; i < buffer->count; i++)
+        {
+            TraceEvent *event = &buffer->events[i];
+            double start = (event->start - traceOrigin) / 1e3;
+            if (event->value < 0)
+            {
+                fprintf(file,
+                        "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+                        first ? "" : ",", event->name, start, (event->end - event->start) / 1e3, (int)getpid(),
+                        buffer->thread);
+            }
+            else
+            {
+                fprintf(file,
+                        "%s\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d, "
+                        "\"args\": {\"value\": %lld}}",
+                        first ? "" : ",", event->name, start, (int)getpid(), buffer->thread, (long long)event->value);
+            }
+            first = 0;
+        }
+    }
+    fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(file);
+    fprintf(stderr, "Trace written to %s\n", path);
+}
+
+static void flushTrace(void)
+{
+    const char *output = getenv("EX7_TRACE_OUTPUT");
+    pthread_mutex_lock(&buffersLock);
+    if (output != NULL && output[0] != '\0')
+    {
+        writeChromeTrace(output);
+    }
+    else
+    {
+        printTextSummary();
+    }
+    pthread_mutex_unlock(&buffersLock);
+}
+
+/* Starts the trace clock and prints or writes the trace at exit.
+ */
+void traceInit(void)
+{
+    traceOrigin = traceNow();
+    atexit(flushTrace);
+}
+
+#endif /* EX7_TRACE */
@@ -0,0 +1,45 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Optional instrumentation, compiled in with `make TRACE=1` (-DEX7_TRACE).
+ * Spans (read, copy, filter tiles, pool waits, write, ...) and counters are
+ * stored with monotonic timestamps in a buffer owned by the recording
+ * thread, so recording takes no lock. At exit they are summarised per stage
+ * and per thread on stderr, or written as Chrome trace JSON (chrome://tracing,
+ * Perfetto) when EX7_TRACE_OUTPUT names a file.
+ * Without EX7_TRACE every macro, including the TRACE_PRINTF progress lines,
+ * compiles to nothing.
+ */
+#ifdef EX7_TRACE
+
+typedef struct TraceSpan
+{
+    const char *name; // Must outlive the process (string literal, kernel name)
+    uint64_t start;
+} TraceSpan;
+
+void traceInit(void);
+uint64_t traceNow(void);
+void traceRecord(const char *name, uint64_t start, uint64_t end);
+void traceCount(const char *name, int64_t value);
+
+#define TRACE_INIT() traceInit()
+#define TRACE_BEGIN(span, label) TraceSpan span = {(label), traceNow()}
+#define TRACE_END(span) traceRecord((span).name, (span).start, traceNow())
+#define TRACE_COUNT(label, value) traceCount((label), (value))
+#define TRACE_PRINTF(...) printf(__VA_ARGS__)
+
+#else
+
+#define TRACE_INIT() ((void)0)
+#define TRACE_BEGIN(span, label) ((void)0)
+#define TRACE_END(span) ((void)0)
+#define TRACE_COUNT(label, value) ((void)0)
+#define TRACE_PRINTF(...) ((void)0)
+
+#endif /* EX7_TRACE */
+
+#endif /* trace.h */